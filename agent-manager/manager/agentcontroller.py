@@ -33,11 +33,20 @@ log.setLevel(logging.DEBUG)
 
 MAX_PER_THREAD_SAMPLES = 131072
 MAX_PER_THREAD_TX_SAMPLES = 4096
+CONN_HIST_SUB_BITS = 3
+CONN_HIST_BUCKETS = 64 << CONN_HIST_SUB_BITS
+LAT_HIST_SUB_BITS = 7
+LAT_HIST_BUCKETS = 64 << LAT_HIST_SUB_BITS
+MAX_SHARDS = 64
+OP_CLASSES = 4
+WINDOW_HIST_SUB_BITS = 3
+WINDOW_HIST_BUCKETS = 64 << WINDOW_HIST_SUB_BITS
+STATS_WINDOWS = 256
 
 class AgentControlBlock(ctypes.Structure):
     _pack_ = 1
     _fields_ = [
-        ('idist', ctypes.c_char * 52),
+        ('idist', ctypes.c_char * 56),
         ('should_load', ctypes.c_int),
         ('should_measure', ctypes.c_int),
         ('thread_count', ctypes.c_int),
@@ -45,59 +54,150 @@ class AgentControlBlock(ctypes.Structure):
         ('sample_count', ctypes.c_uint32),
         ('sampling_rate', ctypes.c_double),
         ('conn_open', ctypes.c_int),
+        ('conn_total', ctypes.c_int),
     ]
 
+STATS_VERSION = 3
+CACHE_LINE = 64
+
+def cache_aligned(fields):
+    # Lays out (name, type, aligned) like __cacheline_aligned in stats.h
+    out = []
+    off = 0
+    for name, ctype, aligned in fields:
+        pad = -off % (CACHE_LINE if aligned else ctypes.alignment(ctype))
+        if pad:
+            out.append(('_pad_' + name, ctypes.c_char * pad))
+            off += pad
+        out.append((name, ctype))
+        off += ctypes.sizeof(ctype)
+    if -off % CACHE_LINE:
+        out.append(('_pad_end', ctypes.c_char * (-off % CACHE_LINE)))
+    return out
+
 class Timespec(ctypes.Structure):
-    _pack_ = 1
     _fields_ = [
         ('sec', ctypes.c_uint64),
         ('nsec', ctypes.c_uint64),
     ]
 
 class TxTimestamps(ctypes.Structure):
-    _pack_ = 1
+    _fields_ = cache_aligned([
+        ('Count', ctypes.c_uint32, True),
+        ('Samples', Timespec * MAX_PER_THREAD_SAMPLES, True),
+    ])
+
+class StatsHeader(ctypes.Structure):
     _fields_ = [
-        ('Count', ctypes.c_uint32),
-        ('Samples', Timespec * MAX_PER_THREAD_SAMPLES)
+        ('Version', ctypes.c_uint32),
+        ('AgentType', ctypes.c_uint32),
+        ('TxSamplesOff', ctypes.c_uint64),
+        ('WindowsOff', ctypes.c_uint64),
     ]
 
-class ThroughputStats(ctypes.Structure):
-    _pack_ = 1
+class ByteReqPair(ctypes.Structure):
     _fields_ = [
-        ('RxBytes', ctypes.c_uint64),
-        ('RxReqs', ctypes.c_uint64),
-        ('TxBytes', ctypes.c_uint64),
-        ('TxReqs', ctypes.c_uint64),
-        ('TxTs', TxTimestamps),
+        ('Bytes', ctypes.c_uint64),
+        ('Reqs', ctypes.c_uint64),
     ]
 
+class StatsWindow(ctypes.Structure):
+    _fields_ = cache_aligned([
+        ('Idx', ctypes.c_uint64, False),
+        ('Rx', ByteReqPair, False),
+        ('Tx', ByteReqPair, False),
+        ('LatCount', ctypes.c_uint64, False),
+        ('LatSumNs', ctypes.c_uint64, False),
+        ('LatHist', ctypes.c_uint32 * WINDOW_HIST_BUCKETS, False),
+    ])
+
+class StatsWindows(ctypes.Structure):
+    _fields_ = cache_aligned([
+        ('WindowNs', ctypes.c_uint64, False),
+        ('Windows', StatsWindow * STATS_WINDOWS, True),
+    ])
+
+class BacklogStats(ctypes.Structure):
+    _fields_ = [
+        ('Reqs', ctypes.c_uint64),
+        ('WaitNs', ctypes.c_uint64),
+        ('MaxWaitNs', ctypes.c_uint64),
+        ('MaxDepth', ctypes.c_uint64),
+        ('Dropped', ctypes.c_uint64),
+    ]
+
+class ConnStats(ctypes.Structure):
+    _fields_ = [
+        ('Opened', ctypes.c_uint64),
+        ('Resumed', ctypes.c_uint64),
+        ('ConnectHist', ctypes.c_uint64 * CONN_HIST_BUCKETS),
+        ('HandshakeHist', ctypes.c_uint64 * CONN_HIST_BUCKETS),
+    ]
+
+class ShardStats(ctypes.Structure):
+    _fields_ = [
+        ('TxReqs', ctypes.c_uint64 * MAX_SHARDS),
+        ('RxReqs', ctypes.c_uint64 * MAX_SHARDS),
+    ]
+
+class OpStats(ctypes.Structure):
+    _fields_ = [
+        ('TxReqs', ctypes.c_uint64 * OP_CLASSES),
+    ]
+
+THROUGHPUT_FIELDS = [
+    ('Hdr', StatsHeader, False),
+    ('RxBytes', ctypes.c_uint64, True),
+    ('RxReqs', ctypes.c_uint64, False),
+    ('TxBytes', ctypes.c_uint64, False),
+    ('TxReqs', ctypes.c_uint64, False),
+    ('Backlog', BacklogStats, True),
+    ('Conn', ConnStats, True),
+    ('PoolExhausted', ctypes.c_uint64, True),
+    ('Shards', ShardStats, True),
+    ('Ops', OpStats, True),
+]
+
+class ThroughputStats(ctypes.Structure):
+    _fields_ = cache_aligned(THROUGHPUT_FIELDS + [
+        ('TxTs', TxTimestamps, True),
+        ('Windows', StatsWindows, True),
+    ])
+
 
 class LatSample(ctypes.Structure):
-    _pack_ = 1
     _fields_ = [
         ('nsec_latency', ctypes.c_uint64),
         ('sec_send', ctypes.c_uint64),
         ('nsec_send', ctypes.c_uint64),
+        ('nsec_intended', ctypes.c_uint64),
     ]
 
-class LatencyStats(ctypes.Structure):
-    _pack_ = 1
+class LatHist(ctypes.Structure):
     _fields_ = [
-        ('RxBytes', ctypes.c_uint64),
-        ('RxReqs', ctypes.c_uint64),
-        ('TxBytes', ctypes.c_uint64),
-        ('TxReqs', ctypes.c_uint64),
-        ('IncIdx', ctypes.c_uint32),
-        ('Samples', LatSample * MAX_PER_THREAD_SAMPLES),
-        ('TxTs', TxTimestamps),
+        ('Count', ctypes.c_uint64),
+        ('SumNs', ctypes.c_uint64),
+        ('Buckets', ctypes.c_uint64 * LAT_HIST_BUCKETS),
     ]
 
+class LatencyStats(ctypes.Structure):
+    _fields_ = cache_aligned(THROUGHPUT_FIELDS + [
+        ('IncIdx', ctypes.c_uint32, True),
+        ('Samples', LatSample * MAX_PER_THREAD_SAMPLES, True),
+        ('Hist', LatHist, True),
+        ('IntendedHist', LatHist, True),
+        ('OpHists', LatHist * OP_CLASSES, True),
+        ('TxTs', TxTimestamps, True),
+        ('Windows', StatsWindows, True),
+    ])
+
 class LancetController:
 
     def __init__(self, librand_path):
         assert librand_path.exists() and librand_path.is_file(), "Bad librand path at {}".format(librand_path)
         extc = ctypes.CDLL(librand_path.absolute().as_posix())
         self.set_load_fn = extc.set_avg_ext
+        self.set_flag_fn = extc.set_flag_ext
         self.thread_stats = []
 
     def retry_open_shmem(self, path, tries=10, delay=1):
@@ -112,6 +212,19 @@ class LancetController:
         assert shm is not None, path
         return shm
 
+    def check_stats(self, stats, stats_type, tries=100, delay=0.1):
+        # The agent thread writes the header after creating the stats
+        for _i in range(tries):
+            if stats.Hdr.Version != 0:
+                break
+            time.sleep(delay)
+        assert stats.Hdr.Version == STATS_VERSION, \
+                "Agent stats version {}, expected {}".format(
+                        stats.Hdr.Version, STATS_VERSION)
+        assert stats.Hdr.TxSamplesOff == stats_type.TxTs.offset
+        assert stats.Hdr.WindowsOff == stats_type.Windows.offset
+        return stats
+
     def launch_agent(self, args):
         launch_args = [str(args.agent.as_posix())] + shlex.split(" ".join(args.agent_args))
         log.debug("Agent launch command: \"{}\"".format(launch_args))
@@ -126,13 +239,15 @@ class LancetController:
                 shm = self.retry_open_shmem('/lancet-stats{}'.format(i))
                 buffer = mmap.mmap(shm.fd, ctypes.sizeof(ThroughputStats),
                         mmap.MAP_SHARED, mmap.PROT_WRITE)
-                self.thread_stats.append(ThroughputStats.from_buffer(buffer))
+                self.thread_stats.append(self.check_stats(
+                    ThroughputStats.from_buffer(buffer), ThroughputStats))
         elif (self.acb.agent_type == 1 or  self.acb.agent_type == 2 or self.acb.agent_type == 3):
             for i in range(self.acb.thread_count):
                 shm = self.retry_open_shmem('/lancet-stats{}'.format(i))
                 buffer = mmap.mmap(shm.fd, ctypes.sizeof(LatencyStats),
                         mmap.MAP_SHARED, mmap.PROT_WRITE)
-                self.thread_stats.append(LatencyStats.from_buffer(buffer))
+                self.thread_stats.append(self.check_stats(
+                    LatencyStats.from_buffer(buffer), LatencyStats))
         else:
             assert False
 
@@ -142,7 +257,9 @@ class LancetController:
         per_thread_load = float(load.value) / self.acb.thread_count
         l = ctypes.c_double(1e6 / per_thread_load)
         self.set_load_fn(ctypes.byref(self.acb), l)
-        self.acb.should_load = 1
+        # Also wakes the threads parked with sleep pacing
+        self.set_flag_fn(ctypes.byref(self.acb,
+            AgentControlBlock.should_load.offset), 1)
 
     def start_measure(self, sample_count, sampling_rate):
         self.clear_stats()
@@ -152,7 +269,12 @@ class LancetController:
         self.acb.should_measure = 1
 
     def get_conn_open(self):
-        return self.acb.conn_open
+        # conn_open counts the established connections
+        if self.acb.conn_total == 0 or self.acb.conn_open < self.acb.conn_total:
+            log.debug("Connections open: {}/{}".format(self.acb.conn_open,
+                self.acb.conn_total))
+            return 0
+        return 1
 
     def terminate(self):
         self.agent.kill()
@@ -164,6 +286,10 @@ class LancetController:
     def check_agent(self):
         return self.agent.poll()
 
+    def get_windows(self):
+        # Unlike get_stats, does not stop measuring
+        return self.thread_stats
+
     def get_per_thread_samples(self):
         return self.acb.sample_count
 
@@ -174,6 +300,21 @@ class LancetController:
             stats.TxBytes = 0
             stats.TxReqs = 0
             stats.TxTs.Count = 0
+            ctypes.memset(ctypes.byref(stats.Backlog), 0,
+                    ctypes.sizeof(BacklogStats))
+            ctypes.memset(ctypes.byref(stats.Conn), 0,
+                    ctypes.sizeof(ConnStats))
+            stats.PoolExhausted = 0
+            ctypes.memset(ctypes.byref(stats.Shards), 0,
+                    ctypes.sizeof(ShardStats))
+            ctypes.memset(ctypes.byref(stats.Ops), 0,
+                    ctypes.sizeof(OpStats))
 
             if self.acb.agent_type > 0: # clear latency stats
                 stats.IncIdx = 0
+                ctypes.memset(ctypes.byref(stats.Hist), 0,
+                        ctypes.sizeof(LatHist))
+                ctypes.memset(ctypes.byref(stats.IntendedHist), 0,
+                        ctypes.sizeof(LatHist))
+                ctypes.memset(ctypes.byref(stats.OpHists), 0,
+                        ctypes.sizeof(LatHist) * OP_CLASSES)
@@ -29,7 +29,7 @@ import pathlib
 
 from manager.proto import LancetProto
 from manager.agentcontroller import LancetController
-from manager.stats import aggregate_throughput, aggregate_latency
+from manager.stats import aggregate_throughput, aggregate_latency, aggregate_windows
 
 MANAGER_PORT = 5001
 this_dir = pathlib.Path(__file__).absolute().parent
@@ -70,6 +70,7 @@ class LancetServer:
         self.socket.bind(("", MANAGER_PORT))
         self.socket.listen(1)
         self.controller = LancetController(librand_path=librand)
+        self.next_window = None
 
     def run(self, args):
         self.controller.launch_agent(args)
@@ -103,6 +104,7 @@ class LancetServer:
                 agg_stats = aggregate_throughput(throughput_stats)
                 agg_stats.duration = self.end_time - self.start_time
                 self.proto.reply_throughput(agg_stats)
+                self.proto.reply_conn_hist(agg_stats)
             elif msg.info == 1:
                 self.end_time = time.time()
                 latency_stats = self.controller.get_stats()
@@ -113,6 +115,13 @@ class LancetServer:
                     return -1
                 agg_stats.duration = self.end_time - self.start_time
                 self.proto.reply_latency(agg_stats) # should pass something here
+                self.proto.reply_conn_hist(agg_stats.throughput_stats)
+                self.proto.reply_lat_hist(agg_stats)
+                self.proto.reply_op_hists(agg_stats)
+            elif msg.info == 2:
+                windows, window_ns, self.next_window = aggregate_windows(
+                        self.controller.get_windows(), self.next_window)
+                self.proto.reply_windows(windows, window_ns, self.next_window)
             else:
                 print("Unknown report msg")
                 return -1
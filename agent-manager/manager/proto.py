@@ -21,6 +21,9 @@
 # SOFTWARE.
 import ctypes
 import io
+import numpy
+
+from manager.agentcontroller import CONN_HIST_SUB_BITS, LAT_HIST_SUB_BITS, WINDOW_HIST_SUB_BITS
 
 class MsgHdr(ctypes.Structure):
     _pack_ = 1
@@ -52,6 +55,21 @@ class ThroughputReply(ctypes.Structure):
         ('ReqCount', ctypes.c_uint64),
         ('Duration', ctypes.c_uint64),
         ('CorrectIAD', ctypes.c_uint64),
+        ('BacklogReqs', ctypes.c_uint64),
+        ('BacklogWait', ctypes.c_uint64),
+        ('BacklogMaxWait', ctypes.c_uint64),
+        ('BacklogMaxDepth', ctypes.c_uint64),
+        ('BacklogDropped', ctypes.c_uint64),
+        ('ConnOpened', ctypes.c_uint64),
+        ('ConnResumed', ctypes.c_uint64),
+        ('ConnectP50', ctypes.c_uint64),
+        ('ConnectP99', ctypes.c_uint64),
+        ('HandshakeP50', ctypes.c_uint64),
+        ('HandshakeP99', ctypes.c_uint64),
+        ('PoolExhausted', ctypes.c_uint64),
+        ('ShardTx', ctypes.c_uint64 * 64),
+        ('ShardRx', ctypes.c_uint64 * 64),
+        ('OpTx', ctypes.c_uint64 * 4),
     ]
 
 class LatencyReply(ctypes.Structure):
@@ -86,8 +104,92 @@ class LatencyReply(ctypes.Structure):
         ('ToReduceSampling', ctypes.c_uint32),
         ('IsIID', ctypes.c_uint8),
         ('IsStationary', ctypes.c_uint8),
+        ('Pad', ctypes.c_uint8 * 2),
+        ('IntendedAvg', ctypes.c_uint64),
+        ('IntendedP50', ctypes.c_uint64),
+        ('IntendedP90', ctypes.c_uint64),
+        ('IntendedP99', ctypes.c_uint64),
+        ('IntendedP999', ctypes.c_uint64),
+        ('IntendedP9999', ctypes.c_uint64),
+    ]
+
+class LatHistReply(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('Samples', ctypes.c_uint64),
+        ('Count', ctypes.c_uint64),
+        ('SumNs', ctypes.c_uint64),
+        ('IntendedCount', ctypes.c_uint64),
+        ('IntendedSumNs', ctypes.c_uint64),
+        ('SubBits', ctypes.c_uint32),
+        ('Entries', ctypes.c_uint32),
+        ('IntendedEntries', ctypes.c_uint32),
+        ('Pad', ctypes.c_uint32),
+    ]
+
+class LatHistEntry(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('Bucket', ctypes.c_uint64),
+        ('Count', ctypes.c_uint64),
+    ]
+
+class ConnHistReply(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('SubBits', ctypes.c_uint32),
+        ('Entries', ctypes.c_uint32),
+        ('HandshakeEntries', ctypes.c_uint32),
+        ('Pad', ctypes.c_uint32),
+    ]
+
+class OpHistsReply(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('Classes', ctypes.c_uint32),
+        ('SubBits', ctypes.c_uint32),
+    ]
+
+class OpHistEntry(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('Count', ctypes.c_uint64),
+        ('SumNs', ctypes.c_uint64),
+        ('Entries', ctypes.c_uint32),
+        ('Pad', ctypes.c_uint32),
+    ]
+
+class WindowsReply(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('WindowNs', ctypes.c_uint64),
+        ('UntilNs', ctypes.c_uint64),
+        ('SubBits', ctypes.c_uint32),
+        ('Count', ctypes.c_uint32),
+    ]
+
+class WindowEntry(ctypes.Structure):
+    _pack_ = 1
+    _fields_ = [
+        ('StartNs', ctypes.c_uint64),
+        ('RxBytes', ctypes.c_uint64),
+        ('RxReqs', ctypes.c_uint64),
+        ('TxBytes', ctypes.c_uint64),
+        ('TxReqs', ctypes.c_uint64),
+        ('LatCount', ctypes.c_uint64),
+        ('LatSumNs', ctypes.c_uint64),
+        ('Entries', ctypes.c_uint32),
+        ('Pad', ctypes.c_uint32),
     ]
 
+def lat_hist_entries(buckets):
+    nonzero = numpy.nonzero(buckets)[0]
+    entries = (LatHistEntry * len(nonzero))()
+    for e, b in zip(entries, nonzero):
+        e.Bucket = int(b)
+        e.Count = int(buckets[b])
+    return entries
+
 class MsgInternal:
     def __init__(self, msg_type, info):
         self.msg_type = msg_type
@@ -140,43 +242,73 @@ class LancetProto:
         msg.MessageType = 3 # Reply
         msg.MessageLength = 4
         msg.Info = 0 # REPLY_ACK
-        self.conn.send(msg)
+        self.conn.sendall(msg)
 
     def reply_value(self, value):
         msg = Msg1()
         msg.MessageType = 3 # Reply
         msg.MessageLength = 4
         msg.Info = value
-        self.conn.send(msg)
+        self.conn.sendall(msg)
 
     def reply_throughput(self, stats):
         msg = Msg1()
         msg.MessageType = 3 # Reply
-        msg.MessageLength = 36 # throughput stats + type
         msg.Info = 1 # REPLY_STATS_THROUGHPUT
         reply = ThroughputReply()
+        msg.MessageLength = 4 + ctypes.sizeof(reply) # type + stats
         reply.Duration = int(1e6*stats.duration)
         reply.RxBytes = stats.RxBytes
         reply.TxBytes = stats.TxBytes
         reply.ReqCount = stats.RxReqs
         reply.CorrectIAD = stats.ia_is_correct
+        reply.BacklogReqs = stats.BacklogReqs
+        reply.BacklogWait = stats.BacklogWait
+        reply.BacklogMaxWait = stats.BacklogMaxWait
+        reply.BacklogMaxDepth = stats.BacklogMaxDepth
+        reply.BacklogDropped = stats.BacklogDropped
+        reply.ConnOpened = stats.ConnOpened
+        reply.ConnResumed = stats.ConnResumed
+        reply.ConnectP50 = stats.ConnectP50
+        reply.ConnectP99 = stats.ConnectP99
+        reply.HandshakeP50 = stats.HandshakeP50
+        reply.HandshakeP99 = stats.HandshakeP99
+        reply.PoolExhausted = stats.PoolExhausted
+        reply.ShardTx[:] = stats.ShardTx
+        reply.ShardRx[:] = stats.ShardRx
+        reply.OpTx[:] = stats.OpTx
         replyBuf = io.BytesIO()
         replyBuf.write(msg)
         replyBuf.write(reply)
-        self.conn.send(replyBuf.getvalue())
+        self.conn.sendall(replyBuf.getvalue())
         replyBuf.close()
 
     def reply_latency(self, stats):
         msg = Msg1()
         msg.MessageType = 3 # Reply
-        msg.MessageLength = 140 # latency stats + type
         msg.Info = 2 # REPLY_STATS_LATENCY
         reply = LatencyReply()
+        msg.MessageLength = 4 + ctypes.sizeof(reply) # type + stats
         reply.Th_data.Duration = int(1e6*stats.duration)
         reply.Th_data.RxBytes = stats.throughput_stats.RxBytes
         reply.Th_data.TxBytes = stats.throughput_stats.TxBytes
         reply.Th_data.ReqCount = stats.throughput_stats.RxReqs
         reply.Th_data.CorrectIAD = stats.throughput_stats.ia_is_correct
+        reply.Th_data.BacklogReqs = stats.throughput_stats.BacklogReqs
+        reply.Th_data.BacklogWait = stats.throughput_stats.BacklogWait
+        reply.Th_data.BacklogMaxWait = stats.throughput_stats.BacklogMaxWait
+        reply.Th_data.BacklogMaxDepth = stats.throughput_stats.BacklogMaxDepth
+        reply.Th_data.BacklogDropped = stats.throughput_stats.BacklogDropped
+        reply.Th_data.ConnOpened = stats.throughput_stats.ConnOpened
+        reply.Th_data.ConnResumed = stats.throughput_stats.ConnResumed
+        reply.Th_data.ConnectP50 = stats.throughput_stats.ConnectP50
+        reply.Th_data.ConnectP99 = stats.throughput_stats.ConnectP99
+        reply.Th_data.HandshakeP50 = stats.throughput_stats.HandshakeP50
+        reply.Th_data.HandshakeP99 = stats.throughput_stats.HandshakeP99
+        reply.Th_data.PoolExhausted = stats.throughput_stats.PoolExhausted
+        reply.Th_data.ShardTx[:] = stats.throughput_stats.ShardTx
+        reply.Th_data.ShardRx[:] = stats.throughput_stats.ShardRx
+        reply.Th_data.OpTx[:] = stats.throughput_stats.OpTx
         reply.Avg_latency = stats.Avg_latency
         reply.P50i = stats.P50i
         reply.P50 = stats.P50
@@ -205,10 +337,112 @@ class LancetProto:
         reply.IsIID = stats.IsIID
         reply.ToReduceSampling = stats.ToReduce
         reply.IsStationary = stats.is_stationary
+        reply.IntendedAvg = stats.IntendedAvg
+        reply.IntendedP50 = stats.IntendedP50
+        reply.IntendedP90 = stats.IntendedP90
+        reply.IntendedP99 = stats.IntendedP99
+        reply.IntendedP999 = stats.IntendedP999
+        reply.IntendedP9999 = stats.IntendedP9999
         replyBuf = io.BytesIO()
         replyBuf.write(msg)
         replyBuf.write(reply)
-        self.conn.send(replyBuf.getvalue())
+        self.conn.sendall(replyBuf.getvalue())
+        replyBuf.close()
+
+    def reply_lat_hist(self, stats):
+        buckets, count, sum_ns = stats.Hist
+        intended_buckets, intended_count, intended_sum_ns = stats.IntendedHist
+        entries = lat_hist_entries(buckets)
+        intended_entries = lat_hist_entries(intended_buckets)
+        reply = LatHistReply()
+        reply.Samples = stats.Samples
+        reply.Count = count
+        reply.SumNs = sum_ns
+        reply.IntendedCount = intended_count
+        reply.IntendedSumNs = intended_sum_ns
+        reply.SubBits = LAT_HIST_SUB_BITS
+        reply.Entries = len(entries)
+        reply.IntendedEntries = len(intended_entries)
+        msg = Msg1()
+        msg.MessageType = 3 # Reply
+        msg.MessageLength = 4 + ctypes.sizeof(reply) + \
+                ctypes.sizeof(entries) + ctypes.sizeof(intended_entries)
+        msg.Info = 6 # REPLY_LAT_HIST
+        replyBuf = io.BytesIO()
+        replyBuf.write(msg)
+        replyBuf.write(reply)
+        replyBuf.write(entries)
+        replyBuf.write(intended_entries)
+        self.conn.sendall(replyBuf.getvalue())
+        replyBuf.close()
+
+    def reply_conn_hist(self, stats):
+        entries = lat_hist_entries(stats.ConnectHist)
+        handshake_entries = lat_hist_entries(stats.HandshakeHist)
+        reply = ConnHistReply()
+        reply.SubBits = CONN_HIST_SUB_BITS
+        reply.Entries = len(entries)
+        reply.HandshakeEntries = len(handshake_entries)
+        msg = Msg1()
+        msg.MessageType = 3 # Reply
+        msg.MessageLength = 4 + ctypes.sizeof(reply) + \
+                ctypes.sizeof(entries) + ctypes.sizeof(handshake_entries)
+        msg.Info = 9 # REPLY_CONN_HIST
+        replyBuf = io.BytesIO()
+        replyBuf.write(msg)
+        replyBuf.write(reply)
+        replyBuf.write(entries)
+        replyBuf.write(handshake_entries)
+        self.conn.sendall(replyBuf.getvalue())
+        replyBuf.close()
+
+    def reply_op_hists(self, stats):
+        reply = OpHistsReply()
+        reply.Classes = len(stats.OpHists)
+        reply.SubBits = LAT_HIST_SUB_BITS
+        replyBuf = io.BytesIO()
+        replyBuf.write(reply)
+        for buckets, count, sum_ns in stats.OpHists:
+            entry = OpHistEntry()
+            entry.Count = count
+            entry.SumNs = sum_ns
+            entries = lat_hist_entries(buckets)
+            entry.Entries = len(entries)
+            replyBuf.write(entry)
+            replyBuf.write(entries)
+        msg = Msg1()
+        msg.MessageType = 3 # Reply
+        msg.MessageLength = 4 + replyBuf.tell()
+        msg.Info = 8 # REPLY_OP_HISTS
+        self.conn.sendall(bytes(msg) + replyBuf.getvalue())
+        replyBuf.close()
+
+    def reply_windows(self, windows, window_ns, until):
+        reply = WindowsReply()
+        reply.WindowNs = window_ns
+        reply.UntilNs = until * window_ns
+        reply.SubBits = WINDOW_HIST_SUB_BITS
+        reply.Count = len(windows)
+        replyBuf = io.BytesIO()
+        replyBuf.write(reply)
+        for w in windows:
+            entry = WindowEntry()
+            entry.StartNs = w.StartNs
+            entry.RxBytes = w.RxBytes
+            entry.RxReqs = w.RxReqs
+            entry.TxBytes = w.TxBytes
+            entry.TxReqs = w.TxReqs
+            entry.LatCount = w.LatCount
+            entry.LatSumNs = w.LatSumNs
+            entries = lat_hist_entries(w.LatHist)
+            entry.Entries = len(entries)
+            replyBuf.write(entry)
+            replyBuf.write(entries)
+        msg = Msg1()
+        msg.MessageType = 3 # Reply
+        msg.MessageLength = 4 + replyBuf.tell()
+        msg.Info = 7 # REPLY_WINDOWS
+        self.conn.sendall(bytes(msg) + replyBuf.getvalue())
         replyBuf.close()
 
     def close(self):
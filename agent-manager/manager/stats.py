@@ -22,12 +22,14 @@
 import numpy
 import math
 import sys
+import time
 from scipy.stats import spearmanr, anderson, kstest, ks_2samp
 from statsmodels.tsa.stattools import adfuller
 
-from manager.agentcontroller import MAX_PER_THREAD_SAMPLES, MAX_PER_THREAD_TX_SAMPLES
+from manager.agentcontroller import MAX_PER_THREAD_SAMPLES, MAX_PER_THREAD_TX_SAMPLES, CONN_HIST_SUB_BITS, CONN_HIST_BUCKETS, MAX_SHARDS, OP_CLASSES, LAT_HIST_SUB_BITS, LAT_HIST_BUCKETS, WINDOW_HIST_BUCKETS, STATS_WINDOWS, StatsWindow
 
 IID_A_VAL = 1e-10
+MAX_PENDING_SLACK = 64 # replies per thread around the end of measuring
 
 class LancetThroughputStats:
     def __init__(self):
@@ -35,10 +37,27 @@ class LancetThroughputStats:
         self.RxReqs   = 0
         self.TxBytes  = 0
         self.TxReqs   = 0
+        self.BacklogReqs = 0
+        self.BacklogWait = 0
+        self.BacklogMaxWait = 0
+        self.BacklogMaxDepth = 0
+        self.BacklogDropped = 0
+        self.ConnOpened = 0
+        self.ConnResumed = 0
+        self.ConnectP50 = 0
+        self.ConnectP99 = 0
+        self.HandshakeP50 = 0
+        self.HandshakeP99 = 0
+        self.ConnectHist = numpy.zeros(CONN_HIST_BUCKETS, dtype=numpy.uint64)
+        self.HandshakeHist = numpy.zeros(CONN_HIST_BUCKETS, dtype=numpy.uint64)
+        self.PoolExhausted = 0
+        self.ShardTx = [0] * MAX_SHARDS
+        self.ShardRx = [0] * MAX_SHARDS
+        self.OpTx = [0] * OP_CLASSES
         self.ia_is_correct = False
 
 class LancetLatencyStats:
-    def _init_(self):
+    def __init__(self):
         self.throughput_stats = LancetThroughputStats()
         self.Avg_latency = 0
         self.P50i = 0
@@ -67,6 +86,23 @@ class LancetLatencyStats:
         self.P999999k = 0
         self.IsIID = 0
         self.ToReduce = 0
+        self.IntendedAvg = 0
+        self.IntendedP50 = 0
+        self.IntendedP90 = 0
+        self.IntendedP99 = 0
+        self.IntendedP999 = 0
+        self.IntendedP9999 = 0
+
+class LancetWindow:
+    def __init__(self, start_ns):
+        self.StartNs = start_ns
+        self.RxBytes = 0
+        self.RxReqs = 0
+        self.TxBytes = 0
+        self.TxReqs = 0
+        self.LatCount = 0
+        self.LatSumNs = 0
+        self.LatHist = numpy.zeros(WINDOW_HIST_BUCKETS, dtype=numpy.uint64)
 
 def get_ci(samples, percentile):
     size = len(samples)
@@ -133,6 +169,28 @@ def check_stationarity(all_latency_stats, per_thread_samples):
         return False
     return adf_res[0] < 0
 
+def hist_ns(bucket, sub_bits):
+    # Middle of a bucket of hist_bucket in agents/stats.c
+    if bucket < (1 << sub_bits):
+        return bucket
+    shift = (bucket >> sub_bits) - 1
+    return (((1 << sub_bits) + (bucket & ((1 << sub_bits) - 1))) << shift) + \
+            (1 << shift) // 2
+
+def conn_hist_ns(bucket):
+    return hist_ns(bucket, CONN_HIST_SUB_BITS)
+
+def conn_hist_percentile(hist, percentile):
+    total = sum(hist)
+    if total == 0:
+        return 0
+    seen = 0
+    for bucket, count in enumerate(hist):
+        seen += count
+        if seen >= percentile * total:
+            return conn_hist_ns(bucket)
+    return 0
+
 def aggregate_throughput(stats):
     agg = LancetThroughputStats()
     for s in stats:
@@ -140,11 +198,71 @@ def aggregate_throughput(stats):
         agg.RxReqs  +=  s.RxReqs
         agg.TxBytes +=  s.TxBytes
         agg.TxReqs  +=  s.TxReqs
+        agg.BacklogReqs += s.Backlog.Reqs
+        agg.BacklogWait += s.Backlog.WaitNs
+        agg.BacklogMaxWait = max(agg.BacklogMaxWait, s.Backlog.MaxWaitNs)
+        agg.BacklogMaxDepth = max(agg.BacklogMaxDepth, s.Backlog.MaxDepth)
+        agg.BacklogDropped += s.Backlog.Dropped
+        agg.ConnOpened += s.Conn.Opened
+        agg.ConnResumed += s.Conn.Resumed
+        agg.PoolExhausted += s.PoolExhausted
+        agg.ConnectHist += numpy.ctypeslib.as_array(s.Conn.ConnectHist)
+        agg.HandshakeHist += numpy.ctypeslib.as_array(s.Conn.HandshakeHist)
+        for i in range(MAX_SHARDS):
+            agg.ShardTx[i] += s.Shards.TxReqs[i]
+            agg.ShardRx[i] += s.Shards.RxReqs[i]
+        for i in range(OP_CLASSES):
+            agg.OpTx[i] += s.Ops.TxReqs[i]
+    agg.ConnectP50 = conn_hist_percentile(agg.ConnectHist, 0.5)
+    agg.ConnectP99 = conn_hist_percentile(agg.ConnectHist, 0.99)
+    agg.HandshakeP50 = conn_hist_percentile(agg.HandshakeHist, 0.5)
+    agg.HandshakeP99 = conn_hist_percentile(agg.HandshakeHist, 0.99)
 
     agg.ia_is_correct = check_interarrival(stats)
 
     return agg
 
+def merge_lat_hists(hists):
+    # Adding up the buckets is exact, unlike averaging percentiles
+    buckets = numpy.zeros(LAT_HIST_BUCKETS, dtype=numpy.uint64)
+    count, sum_ns = 0, 0
+    for h in hists:
+        buckets += numpy.ctypeslib.as_array(h.Buckets)
+        count += h.Count
+        sum_ns += h.SumNs
+    return buckets, count, sum_ns
+
+def lat_hist_percentile(buckets, count, percentile):
+    rank = max(math.ceil(percentile * count), 1)
+    bucket = numpy.searchsorted(numpy.cumsum(buckets), rank)
+    return hist_ns(int(bucket), LAT_HIST_SUB_BITS)
+
+def aggregate_intended_latency(agg, stats, per_thread_samples):
+    # Only filled when the agent runs with -d
+    buckets, count, sum_ns = merge_lat_hists(s.IntendedHist for s in stats)
+    agg.IntendedHist = (buckets, count, sum_ns)
+    if count > 0:
+        agg.IntendedAvg = sum_ns // count
+        agg.IntendedP50 = lat_hist_percentile(buckets, count, 0.5)
+        agg.IntendedP90 = lat_hist_percentile(buckets, count, 0.9)
+        agg.IntendedP99 = lat_hist_percentile(buckets, count, 0.99)
+        agg.IntendedP999 = lat_hist_percentile(buckets, count, 0.999)
+        agg.IntendedP9999 = lat_hist_percentile(buckets, count, 0.9999)
+        return
+    samples = []
+    for s in stats:
+        sample_count = min(per_thread_samples, s.IncIdx)
+        samples += map(lambda x: x.nsec_intended, s.Samples[:sample_count])
+    samples = [x for x in samples if x > 0]
+    if len(samples) == 0:
+        return
+    agg.IntendedAvg = int(numpy.mean(samples))
+    agg.IntendedP50 = int(numpy.percentile(samples, 50))
+    agg.IntendedP90 = int(numpy.percentile(samples, 90))
+    agg.IntendedP99 = int(numpy.percentile(samples, 99))
+    agg.IntendedP999 = int(numpy.percentile(samples, 99.9))
+    agg.IntendedP9999 = int(numpy.percentile(samples, 99.99))
+
 def aggregate_latency(stats, per_thread_samples):
     agg = LancetLatencyStats()
     agg.throughput_stats = aggregate_throughput(stats)
@@ -158,7 +276,17 @@ def aggregate_latency(stats, per_thread_samples):
     #with open("/tmp/kogias/lancet-samples", 'w') as f:
     #    f.write("\n".join(map(str, all_samples)))
 
-    print("There are {} samples".format(len(all_samples)))
+    buckets, count, sum_ns = merge_lat_hists(s.Hist for s in stats)
+    agg.Hist = (buckets, count, sum_ns)
+    agg.Samples = len(all_samples)
+    print("There are {} samples out of {} latencies".format(len(all_samples),
+        count))
+    # Every reply counted as received has its latency in the histograms,
+    # short of the few in flight while measuring stopped
+    rx_reqs = agg.throughput_stats.RxReqs
+    if abs(int(count) - rx_reqs) > len(stats) * MAX_PENDING_SLACK:
+        print("WARNING: {} latencies for {} received replies".format(count,
+            rx_reqs))
     all_samples.sort()
     agg.Avg_latency = int(numpy.mean(all_samples))
     agg.P50 = int(numpy.percentile(all_samples, 50))
@@ -177,9 +305,66 @@ def aggregate_latency(stats, per_thread_samples):
     agg.P99999i, agg.P99999k = get_ci(all_samples, 0.99999)
     agg.P999999 = int(numpy.percentile(all_samples, 99.9999))
     agg.P999999i, agg.P999999k = get_ci(all_samples, 0.999999)
+    # The percentiles count every latency, the confidence intervals stay
+    # on the iid samples
+    if count > 0:
+        agg.Avg_latency = sum_ns // count
+        agg.P50 = lat_hist_percentile(buckets, count, 0.5)
+        agg.P90 = lat_hist_percentile(buckets, count, 0.9)
+        agg.P95 = lat_hist_percentile(buckets, count, 0.95)
+        agg.P99 = lat_hist_percentile(buckets, count, 0.99)
+        agg.P999 = lat_hist_percentile(buckets, count, 0.999)
+        agg.P9999 = lat_hist_percentile(buckets, count, 0.9999)
+        agg.P99999 = lat_hist_percentile(buckets, count, 0.99999)
+        agg.P999999 = lat_hist_percentile(buckets, count, 0.999999)
+    aggregate_intended_latency(agg, stats, per_thread_samples)
+    agg.OpHists = [merge_lat_hists(s.OpHists[c] for s in stats)
+            for c in range(OP_CLASSES)]
     agg.is_stationary = check_stationarity(stats, per_thread_samples)
     is_iid, to_reduce = check_iid(stats, per_thread_samples)
     agg.IsIID = is_iid
     agg.ToReduce = to_reduce
 
     return agg
+
+def read_window(stats, idx):
+    # None if the thread did not count in window idx, or moved its slot on
+    # to a later window while we copied it
+    slot = stats.Windows.Windows[idx % STATS_WINDOWS]
+    if slot.Idx != idx:
+        return None
+    w = StatsWindow.from_buffer_copy(slot)
+    if w.Idx != idx or slot.Idx != idx:
+        return None
+    return w
+
+def aggregate_windows(stats, first):
+    # The windows from first on that ended a whole window ago, so that no
+    # thread still counts in them, added up over the threads. Without first,
+    # starts at the oldest window left in the rings.
+    window_ns = stats[0].Windows.WindowNs
+    until = time.time_ns() // window_ns - 1
+    oldest = until - STATS_WINDOWS + 2
+    if first is None:
+        first = until
+        for s in stats:
+            for w in s.Windows.Windows:
+                if oldest <= w.Idx < first:
+                    first = w.Idx
+    first = max(first, oldest)
+    windows = []
+    for idx in range(first, until):
+        agg = LancetWindow(idx * window_ns)
+        for s in stats:
+            w = read_window(s, idx)
+            if w is None:
+                continue
+            agg.RxBytes += w.Rx.Bytes
+            agg.RxReqs += w.Rx.Reqs
+            agg.TxBytes += w.Tx.Bytes
+            agg.TxReqs += w.Tx.Reqs
+            agg.LatCount += w.LatCount
+            agg.LatSumNs += w.LatSumNs
+            agg.LatHist += numpy.ctypeslib.as_array(w.LatHist)
+        windows.append(agg)
+    return windows, window_ns, max(first, until)
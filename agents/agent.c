@@ -30,12 +30,18 @@
 #include <stdlib.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include <lancet/agent.h>
 #include <lancet/app_proto.h>
+#include <lancet/backlog.h>
 #include <lancet/error.h>
+#include <lancet/futex.h>
+#include <lancet/misc.h>
+#include <lancet/placement.h>
+#include <lancet/shard.h>
 #include <lancet/stats.h>
 #include <lancet/timestamping.h>
 #include <lancet/tp_proto.h>
@@ -43,12 +49,25 @@
 static struct agent_config *cfg;
 static struct agent_control_block *acb;
 static __thread struct request to_send;
+static __thread int request_held;
 static __thread struct iovec received;
 static __thread int thread_idx;
+static __thread long ia_ring[IA_RING_SIZE];
+static __thread double ia_batch[IA_BATCH];
+static __thread uint32_t ia_head, ia_tail, ia_version;
 pthread_barrier_t conn_open_barrier;
 
 int should_load(void)
 {
+	/*
+	 * With sleep pacing the idle threads park until the manager starts the
+	 * load. The timeout covers a manager that does not wake them. Report
+	 * idle once more, so that the caller restarts its schedule from now.
+	 */
+	if (!acb->should_load && cfg->pacing_spin_ns) {
+		futex_wait(&acb->should_load, 0, LOAD_PARK_NS);
+		return 0;
+	}
 	return acb->should_load;
 }
 
@@ -82,9 +101,58 @@ struct host_tuple *get_targets(void)
 	return cfg->targets;
 }
 
+char *get_unix_path(int idx)
+{
+	return cfg->unix_paths[idx];
+}
+
+/*
+ * Append IA_BATCH inter-arrivals to the ring. get_ia runs right after a
+ * send, so the refill happens in the slack before the next one.
+ */
+static void fill_ia_ring(void)
+{
+	int i;
+
+	generate_batch(cfg->idist, ia_batch, IA_BATCH);
+	for (i = 0; i < IA_BATCH; i++)
+		ia_ring[ia_tail++ & (IA_RING_SIZE - 1)] = lround(ia_batch[i] * 1000);
+}
+
 long get_ia(void)
 {
-	return lround(generate(cfg->idist) * 1000);
+	uint32_t version = cfg->idist->version;
+
+	if (version != ia_version) {
+		/* The manager changed the load, drop the old gaps */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		ia_version = version;
+		ia_head = ia_tail;
+	}
+	if (ia_tail - ia_head <= IA_RING_SIZE - IA_BATCH)
+		fill_ia_ring();
+	return ia_ring[ia_head++ & (IA_RING_SIZE - 1)];
+}
+
+/*
+ * Sleep until pacing_spin_ns before next_tx, so that the caller only spins
+ * for the last part of the wait.
+ */
+void pace_wait(long next_tx)
+{
+	struct timespec ts;
+	long wake, now;
+
+	wake = next_tx - cfg->pacing_spin_ns;
+	now = time_ns();
+	if (!cfg->pacing_spin_ns || now >= wake)
+		return;
+	/*
+	 * time_ns may run on the calibrated TSC, which drifts from
+	 * CLOCK_MONOTONIC, so sleep for the interval instead of until wake.
+	 */
+	ns_to_ts(wake - now, &ts);
+	clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
 }
 
 enum agent_type get_agent_type(void)
@@ -117,15 +185,75 @@ int get_max_pending_reqs(void)
 	return cfg->per_conn_reqs;
 }
 
-void set_conn_open(int val)
+int get_udp_batch(void)
+{
+	return cfg->udp_batch;
+}
+
+int get_conn_wave(void)
+{
+	return cfg->conn_wave;
+}
+
+int get_intended_latency(void)
+{
+	return cfg->intended_latency;
+}
+
+int get_zerocopy(void)
+{
+	return cfg->zerocopy;
+}
+
+int get_ktls(void)
 {
-	acb->conn_open = val;
+	return cfg->ktls;
+}
+
+int get_churn_reqs(void)
+{
+	return cfg->churn_reqs;
+}
+
+int get_tls_resume(void)
+{
+	return cfg->tls_resume;
+}
+
+long get_stats_window_ns(void)
+{
+	return cfg->stats_window_ns;
+}
+
+void add_conn_open(int count)
+{
+	__atomic_fetch_add(&acb->conn_open, count, __ATOMIC_RELAXED);
 }
 
 struct request *prepare_request(void)
 {
-	create_request(cfg->app_proto, &to_send);
+	if (request_held)
+		request_held = 0;
+	else
+		create_request(cfg->app_proto, &to_send);
+	if (shard_count)
+		add_shard_tx_sample(request_shard(&to_send));
+	add_op_tx_sample(to_send.op_class);
+
+	return &to_send;
+}
 
+/*
+ * With key routing the connection depends on the key, so the next request is
+ * created before a connection is picked. It is held until prepare_request
+ * hands it out, also when its shard has no free connection yet.
+ */
+struct request *peek_request(void)
+{
+	if (!request_held) {
+		create_request(cfg->app_proto, &to_send);
+		request_held = 1;
+	}
 	return &to_send;
 }
 
@@ -138,24 +266,21 @@ struct byte_req_pair process_response(char *buf, int size)
 
 static void *agent_main(void *arg)
 {
-	cpu_set_t cpuset;
-	pthread_t thread;
-	int s;
-
-	thread = pthread_self();
 	thread_idx = (int)(long)arg;
+	/* Pin first so that the per-thread state is allocated on the node */
+	if (placement_bind(thread_idx))
+		return NULL;
 	init_per_thread_stats();
+	if (backlog_init()) {
+		lancet_fprintf(stderr, "Error allocating the backlog\n");
+		return NULL;
+	}
 
 	srand(time(NULL) + thread_idx * 12345);
+	/* The default 50us slack would delay the wake-ups of pace_wait */
+	if (cfg->pacing_spin_ns)
+		prctl(PR_SET_TIMERSLACK, 1);
 
-	CPU_ZERO(&cpuset);
-	CPU_SET(thread_idx, &cpuset);
-
-	s = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
-	if (s != 0) {
-		lancet_perror("pthread_setaffinity_np");
-		return NULL;
-	}
 	cfg->tp->tp_main[cfg->atype]();
 
 	return NULL;
@@ -187,6 +312,8 @@ static int configure_control_block(void)
 	free(cfg->idist);
 	cfg->idist = &acb->idist;
 	acb->agent_type = get_agent_type();
+	acb->conn_total =
+		(get_conn_count() / get_thread_count()) * get_thread_count();
 
 	return 0;
 }
@@ -200,9 +327,18 @@ int main(int argc, char **argv)
 	if (!cfg)
 		exit(-1);
 
+	/* Before any thread takes timestamps */
+	time_init();
+
 	if (cfg->atype == SYMMETRIC_NIC_TIMESTAMP_AGENT)
 		enable_nic_timestamping(cfg->if_name);
 
+	if (placement_init(cfg->cpu_list, cfg->numa_node, cfg->if_name,
+					   cfg->thread_count)) {
+		lancet_fprintf(stderr, "failed to place the agent threads\n");
+		exit(-1);
+	}
+
 	if (configure_control_block()) {
 		lancet_fprintf(stderr, "failed to init the control block\n");
 		exit(-1);
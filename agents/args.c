@@ -27,11 +27,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #include <lancet/agent.h>
 #include <lancet/app_proto.h>
 #include <lancet/error.h>
+#include <lancet/placement.h>
 #include <lancet/rand_gen.h>
+#include <lancet/shard.h>
+#include <lancet/stats.h>
 #include <lancet/tp_proto.h>
 
 static struct transport_protocol *
@@ -49,6 +53,20 @@ init_transport_protocol(enum transport_protocol_type tp_type)
 	case TLS:
 		res = init_tls();
 		break;
+	case URING:
+		res = init_uring();
+		break;
+	case UNIX:
+		res = init_unix(SOCK_STREAM);
+		break;
+	case UNIXPACKET:
+		res = init_unix(SOCK_SEQPACKET);
+		break;
+#ifdef ENABLE_XDP
+	case XDP:
+		res = init_xdp();
+		break;
+#endif
 #ifdef ENABLE_R2P2
 	case R2P2:
 		res = init_r2p2();
@@ -61,12 +79,44 @@ init_transport_protocol(enum transport_protocol_type tp_type)
 	return res;
 }
 
+/*
+ * Targets are ip:port,ip:port or, for the UNIX transports, socket
+ * paths separated by commas. A path starting with @ names an abstract socket.
+ */
+static int parse_targets(struct agent_config *cfg, char *arg)
+{
+	char *token1, *token2;
+	struct sockaddr_in sa;
+
+	token1 = strtok_r(arg, ",", &arg);
+	while (token1) {
+		assert(cfg->target_count < 64);
+		if (cfg->tp_type == UNIX || cfg->tp_type == UNIXPACKET) {
+			if (strlen(token1) >= UNIX_PATH_LEN) {
+				lancet_fprintf(stderr, "Socket path too long: %s\n", token1);
+				return -1;
+			}
+			strcpy(cfg->unix_paths[cfg->target_count++], token1);
+			token1 = strtok_r(arg, ",", &arg);
+			continue;
+		}
+		/* Prepare the target */
+		token2 = strtok_r(token1, ":", &token1);
+		inet_pton(AF_INET, token2, &(sa.sin_addr));
+		cfg->targets[cfg->target_count].ip = sa.sin_addr.s_addr;
+		token2 = strtok_r(token1, ":", &token1);
+		cfg->targets[cfg->target_count++].port = atoi(token2);
+
+		token1 = strtok_r(arg, ",", &arg);
+	}
+	return 0;
+}
+
 struct agent_config *parse_arguments(int argc, char **argv)
 {
 	int c, agent_type;
 	struct agent_config *cfg;
-	char *token1, *token2;
-	struct sockaddr_in sa;
+	char *targets = NULL;
 	// char proto[128];
 
 	cfg = calloc(1, sizeof(struct agent_config));
@@ -74,27 +124,19 @@ struct agent_config *parse_arguments(int argc, char **argv)
 		lancet_fprintf(stderr, "Failed to allocate cfg\n");
 		return NULL;
 	}
+	cfg->conn_wave = 512;
+	cfg->numa_node = PLACEMENT_NO_NODE;
+	cfg->stats_window_ns = STATS_WINDOW_NS;
 
-	while ((c = getopt(argc, argv, "t:s:c:a:p:i:r:n:o:")) != -1) {
+	while ((c = getopt(argc, argv, "t:s:c:a:p:i:r:n:o:b:w:d:u:m:z:k:e:x:g:y:l:")) != -1) {
 		switch (c) {
 		case 't':
 			// Thread count
 			cfg->thread_count = atoi(optarg);
 			break;
 		case 's':
-			// Targets ip:port,ip:port
-			token1 = strtok_r(optarg, ",", &optarg);
-			while (token1) {
-				/* Prepare the target */
-				token2 = strtok_r(token1, ":", &token1);
-				inet_pton(AF_INET, token2, &(sa.sin_addr));
-				cfg->targets[cfg->target_count].ip = sa.sin_addr.s_addr;
-				token2 = strtok_r(token1, ":", &token1);
-				cfg->targets[cfg->target_count++].port = atoi(token2);
-
-				assert(cfg->target_count < 64);
-				token1 = strtok_r(optarg, ",", &optarg);
-			}
+			// Targets, parsed once the transport is known
+			targets = optarg;
 			break;
 		case 'c':
 			// Connection count
@@ -128,6 +170,16 @@ struct agent_config *parse_arguments(int argc, char **argv)
 				cfg->tp_type = UDP;
 			else if (strcmp(optarg, "TLS") == 0)
 				cfg->tp_type = TLS;
+			else if (strcmp(optarg, "URING") == 0)
+				cfg->tp_type = URING;
+			else if (strcmp(optarg, "UNIX") == 0)
+				cfg->tp_type = UNIX;
+			else if (strcmp(optarg, "UNIXPACKET") == 0)
+				cfg->tp_type = UNIXPACKET;
+#ifdef ENABLE_XDP
+			else if (strcmp(optarg, "XDP") == 0)
+				cfg->tp_type = XDP;
+#endif
 			else {
 				lancet_fprintf(stderr, "Unknown transport protocol\n");
 				return NULL;
@@ -155,11 +207,73 @@ struct agent_config *parse_arguments(int argc, char **argv)
 		case 'o':
 			cfg->per_conn_reqs = atoi(optarg);
 			break;
+		case 'b':
+			// Max UDP messages per sendmmsg/recvmmsg, 0 disables batching
+			cfg->udp_batch = atoi(optarg);
+			break;
+		case 'w':
+			// Max TCP connection attempts in flight during setup
+			cfg->conn_wave = atoi(optarg);
+			break;
+		case 'd':
+			// Also report latency from the intended send time
+			cfg->intended_latency = atoi(optarg);
+			break;
+		case 'u':
+			// CPUs of the agent threads, e.g. 0-7,16-23
+			strncpy(cfg->cpu_list, optarg, sizeof(cfg->cpu_list) - 1);
+			break;
+		case 'm':
+			// NUMA node of the agent threads, or nic for the -n interface
+			if (strcmp(optarg, "nic") == 0)
+				cfg->numa_node = PLACEMENT_NIC_NODE;
+			else if ((cfg->numa_node = atoi(optarg)) < 0) {
+				lancet_fprintf(stderr, "Invalid NUMA node\n");
+				return NULL;
+			}
+			break;
+		case 'z':
+			// Send large values with MSG_ZEROCOPY
+			cfg->zerocopy = atoi(optarg);
+			break;
+		case 'k':
+			// Move the TLS records to the kernel after the handshake
+			cfg->ktls = atoi(optarg);
+			break;
+		case 'e':
+			// Reopen every connection after this many requests
+			cfg->churn_reqs = atoi(optarg);
+			break;
+		case 'x':
+			// Resume the TLS session when a connection is reopened
+			cfg->tls_resume = atoi(optarg);
+			break;
+		case 'g':
+			// Route the KV requests to the target of their key
+			if (strcmp(optarg, "ketama") == 0)
+				cfg->shard_policy = SHARD_KETAMA;
+			else if (strcmp(optarg, "slots") == 0)
+				cfg->shard_policy = SHARD_SLOTS;
+			else {
+				lancet_fprintf(stderr, "Unknown key routing\n");
+				return NULL;
+			}
+			break;
+		case 'y':
+			// Spin only for the last us before a latency send
+			cfg->pacing_spin_ns = atol(optarg) * 1000;
+			break;
+		case 'l':
+			// Length of the stats windows in ms
+			cfg->stats_window_ns = atol(optarg) * 1000000;
+			break;
 		default:
 			lancet_fprintf(stderr, "Unknown argument\n");
 			abort();
 		}
 	}
+	if (targets && parse_targets(cfg, targets))
+		return NULL;
 #ifdef ENABLE_R2P2
 	// Generators interfacing with R2P2 must use host endianness (except latency)
 	if (cfg->tp_type == R2P2 && cfg->atype != LATENCY_AGENT) {
@@ -167,6 +281,61 @@ struct agent_config *parse_arguments(int argc, char **argv)
 			cfg->targets[i].ip = ntohl(cfg->targets[i].ip);
 	}
 #endif
+	if (cfg->conn_wave <= 0) {
+		lancet_fprintf(stderr, "Connection wave must be positive\n");
+		return NULL;
+	}
+	if (cfg->stats_window_ns <= 0) {
+		lancet_fprintf(stderr, "Stats window must be positive\n");
+		return NULL;
+	}
+	/*
+	 * The NIC timestamps share the error queue with the TCP completions.
+	 * With XDP, -z binds the sockets in zero-copy mode.
+	 */
+	if (cfg->zerocopy &&
+		((cfg->tp_type != TCP && cfg->tp_type != XDP) ||
+		 cfg->atype == SYMMETRIC_NIC_TIMESTAMP_AGENT)) {
+		lancet_fprintf(stderr,
+					   "Zero-copy needs TCP or XDP without NIC timestamps\n");
+		return NULL;
+	}
+	/* NIC timestamps need the record sizes, which only user-space TLS knows */
+	if (cfg->ktls &&
+		(cfg->tp_type != TLS || cfg->atype == SYMMETRIC_NIC_TIMESTAMP_AGENT)) {
+		lancet_fprintf(stderr, "kTLS needs TLS without NIC timestamps\n");
+		return NULL;
+	}
+	if (cfg->churn_reqs < 0 ||
+		(cfg->churn_reqs &&
+		 ((cfg->tp_type != TCP && cfg->tp_type != TLS &&
+		   cfg->tp_type != UNIX && cfg->tp_type != UNIXPACKET) ||
+		  (cfg->atype != THROUGHPUT_AGENT && cfg->atype != SYMMETRIC_AGENT)))) {
+		lancet_fprintf(stderr, "Churn needs the TCP, TLS or UNIX load or "
+							   "symmetric agents\n");
+		return NULL;
+	}
+	if ((cfg->tp_type == UNIX || cfg->tp_type == UNIXPACKET ||
+		 cfg->tp_type == XDP) &&
+		cfg->atype == SYMMETRIC_NIC_TIMESTAMP_AGENT) {
+		lancet_fprintf(stderr, "UNIX and XDP sockets have no NIC timestamps\n");
+		return NULL;
+	}
+	if (cfg->tls_resume && (!cfg->churn_reqs || cfg->tp_type != TLS)) {
+		lancet_fprintf(stderr, "Session resumption needs TLS with churn\n");
+		return NULL;
+	}
+	if (cfg->shard_policy) {
+		if (cfg->tp_type != TCP && cfg->tp_type != TLS &&
+			cfg->tp_type != URING && cfg->tp_type != UNIX &&
+			cfg->tp_type != UNIXPACKET) {
+			lancet_fprintf(stderr, "Key routing needs a connection-based "
+								   "transport\n");
+			return NULL;
+		}
+		if (shard_init(cfg))
+			return NULL;
+	}
 	cfg->tp = init_transport_protocol(cfg->tp_type);
 	if (!cfg->tp) {
 		lancet_fprintf(stderr, "Failed to init transport\n");
@@ -0,0 +1,88 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <lancet/agent.h>
+#include <lancet/backlog.h>
+#include <lancet/misc.h>
+#include <lancet/stats.h>
+
+static __thread long *intended;
+static __thread uint32_t head;
+static __thread uint32_t tail;
+
+int backlog_init(void)
+{
+	intended = malloc(BACKLOG_SIZE * sizeof(long));
+	if (!intended)
+		return -1;
+	head = tail = 0;
+	return 0;
+}
+
+/*
+ * Queue every request that became due up to now and advance next_tx. When
+ * the backlog is full the target is hopelessly overloaded; the new arrivals
+ * are counted as dropped so that the schedule keeps its pace.
+ */
+void backlog_fill(long *next_tx)
+{
+	long now = time_ns();
+
+	while (now >= *next_tx) {
+		if (tail - head < BACKLOG_SIZE)
+			intended[tail++ & (BACKLOG_SIZE - 1)] = *next_tx;
+		else
+			add_backlog_drop();
+		*next_tx += get_ia();
+	}
+}
+
+uint32_t backlog_count(void)
+{
+	return tail - head;
+}
+
+/*
+ * Dequeue the oldest request and return its intended send time. Must only
+ * be called right before the request is sent.
+ */
+long backlog_pop(void)
+{
+	long ts;
+
+	assert(head != tail);
+	ts = intended[head & (BACKLOG_SIZE - 1)];
+	add_backlog_sample(time_ns() - ts, tail - head);
+	head++;
+	return ts;
+}
+
+void backlog_clear(void)
+{
+	head = tail;
+}
@@ -0,0 +1,107 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include <lancet/buffer_pool.h>
+#include <lancet/error.h>
+
+/*
+ * Buffers up to SLAB_CLASS_MAX are carved out of slabs, larger ones are
+ * allocated one by one. Released buffers are kept in per class free lists
+ * linked through their first bytes and are never returned to the system.
+ */
+#define CLASS_COUNT 15 // 4K .. 64M
+#define SLAB_SIZE (256 * 1024)
+#define SLAB_CLASS_MAX 16384
+
+struct free_buffer {
+	struct free_buffer *next;
+};
+
+static __thread struct free_buffer *free_lists[CLASS_COUNT];
+
+static inline int size_class(uint32_t size)
+{
+	int class = 0;
+	uint32_t class_size = BUFFER_POOL_MIN_SIZE;
+
+	while (class_size < size) {
+		class_size <<= 1;
+		class++;
+	}
+	return class;
+}
+
+static int refill(int class)
+{
+	uint32_t size = BUFFER_POOL_MIN_SIZE << class;
+	struct free_buffer *buf;
+	char *slab;
+	int i, count;
+
+	count = (size <= SLAB_CLASS_MAX) ? SLAB_SIZE / size : 1;
+	slab = malloc((size_t)count * size);
+	if (!slab)
+		return -1;
+	for (i = 0; i < count; i++) {
+		buf = (struct free_buffer *)&slab[(size_t)i * size];
+		buf->next = free_lists[class];
+		free_lists[class] = buf;
+	}
+	return 0;
+}
+
+char *buffer_pool_get(uint32_t size, uint32_t *actual_size)
+{
+	struct free_buffer *buf;
+	int class;
+
+	if (size > BUFFER_POOL_MAX_SIZE) {
+		lancet_fprintf(stderr, "Buffer of %u bytes exceeds the max (%d)\n",
+					   size, BUFFER_POOL_MAX_SIZE);
+		return NULL;
+	}
+	class = size_class(size);
+	if (!free_lists[class] && refill(class)) {
+		lancet_fprintf(stderr, "Failed to allocate buffers\n");
+		return NULL;
+	}
+	buf = free_lists[class];
+	free_lists[class] = buf->next;
+	*actual_size = BUFFER_POOL_MIN_SIZE << class;
+	return (char *)buf;
+}
+
+void buffer_pool_put(char *buf, uint32_t size)
+{
+	struct free_buffer *fbuf = (struct free_buffer *)buf;
+	int class;
+
+	class = size_class(size);
+	assert((BUFFER_POOL_MIN_SIZE << class) == size);
+	fbuf->next = free_lists[class];
+	free_lists[class] = fbuf;
+}
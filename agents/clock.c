@@ -0,0 +1,120 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
+
+#include <lancet/error.h>
+#include <lancet/misc.h>
+
+#define CALIBRATION_NS 50000000
+#define CALIBRATION_READS 16
+
+struct tsc_clock tsc_clock;
+
+#ifdef __x86_64__
+/*
+ * Only trust a TSC that ticks at a constant rate in every C/P-state and that
+ * the kernel itself keeps as its clocksource, i.e. did not find unsynchronized
+ * across the CPUs.
+ */
+static int tsc_usable(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	char clocksource[32] = {0};
+	FILE *f;
+
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+		!(edx & (1 << 8)))
+		return 0;
+
+	f = fopen("/sys/devices/system/clocksource/clocksource0/"
+			  "current_clocksource",
+			  "r");
+	if (!f)
+		return 0;
+	if (!fgets(clocksource, sizeof(clocksource), f))
+		clocksource[0] = '\0';
+	fclose(f);
+	return strcmp(clocksource, "tsc\n") == 0;
+}
+
+/*
+ * Read the TSC and CLOCK_MONOTONIC together, keeping the read with the
+ * narrowest TSC window around clock_gettime.
+ */
+static void tsc_sample(uint64_t *tsc, int64_t *ns)
+{
+	uint64_t before, after, best = UINT64_MAX;
+	struct timespec ts;
+	int i;
+
+	for (i = 0; i < CALIBRATION_READS; i++) {
+		before = rdtsc();
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		after = rdtsc();
+		/* The first read always counts, later ones only if narrower */
+		if (i == 0 || after - before < best) {
+			best = after - before;
+			*tsc = before + best / 2;
+			*ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+		}
+	}
+}
+#endif
+
+void time_init(void)
+{
+#ifdef __x86_64__
+	struct timespec sleep = {0, CALIBRATION_NS};
+	uint64_t tsc0, tsc1, mult;
+	int64_t ns0, ns1;
+
+	if (!tsc_usable()) {
+		lancet_fprintf(stderr, "No invariant TSC, timing with "
+							   "clock_gettime\n");
+		return;
+	}
+
+	tsc_sample(&tsc0, &ns0);
+	nanosleep(&sleep, NULL);
+	tsc_sample(&tsc1, &ns1);
+
+	mult = ((unsigned __int128)(ns1 - ns0) << 32) / (tsc1 - tsc0);
+	/* Between 10 GHz and 100 MHz */
+	if (mult < (1UL << 32) / 10 || mult > (1UL << 32) * 10) {
+		lancet_fprintf(stderr, "TSC calibration failed, timing with "
+							   "clock_gettime\n");
+		return;
+	}
+	tsc_clock.base_tsc = tsc1;
+	tsc_clock.base_ns = ns1;
+	tsc_clock.mult = mult;
+	tsc_clock.enabled = 1;
+#endif
+}
@@ -0,0 +1,135 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <assert.h>
+#include <stdlib.h>
+
+#include <lancet/conn_sched.h>
+
+#define SCHED_QUEUED 0x1
+#define SCHED_PAUSED 0x2
+#define SCHED_CLOSED 0x4
+
+/*
+ * A connection is queued when it has spare slots and is neither paused nor
+ * closed. Entries that stopped being usable while queued are dropped lazily
+ * by conn_sched_get_shard.
+ */
+static inline void sched_enqueue(struct conn_sched *s, int idx)
+{
+	uint32_t shard;
+
+	if (s->flags[idx] || s->spare[idx] == 0)
+		return;
+	shard = idx % s->shard_count;
+	s->queue[shard * s->size + (s->tail[shard]++ & (s->size - 1))] = idx;
+	s->flags[idx] |= SCHED_QUEUED;
+}
+
+int conn_sched_init_shards(struct conn_sched *s, int count, int depth,
+						   int shard_count)
+{
+	int i;
+
+	/* A power of two so that the indices stay right when they wrap */
+	s->size = 1;
+	while (s->size < (count + shard_count - 1) / shard_count)
+		s->size <<= 1;
+	s->shard_count = shard_count;
+	s->queue = malloc(shard_count * s->size * sizeof(uint32_t));
+	s->head = calloc(shard_count, sizeof(uint32_t));
+	s->tail = calloc(shard_count, sizeof(uint32_t));
+	s->spare = malloc(count * sizeof(uint16_t));
+	s->flags = calloc(count, sizeof(uint8_t));
+	if (!s->queue || !s->head || !s->tail || !s->spare || !s->flags)
+		return -1;
+	for (i = 0; i < count; i++) {
+		s->spare[i] = depth;
+		sched_enqueue(s, i);
+	}
+	return 0;
+}
+
+int conn_sched_init(struct conn_sched *s, int count, int depth)
+{
+	return conn_sched_init_shards(s, count, depth, 1);
+}
+
+/*
+ * Take a slot on the next usable connection of shard. Returns the connection
+ * index or -1 if every connection of the shard is busy.
+ */
+int conn_sched_get_shard(struct conn_sched *s, int shard)
+{
+	uint32_t *queue, idx;
+
+	queue = &s->queue[shard * s->size];
+	while (s->head[shard] != s->tail[shard]) {
+		idx = queue[s->head[shard]++ & (s->size - 1)];
+		s->flags[idx] &= ~SCHED_QUEUED;
+		if (s->flags[idx] || s->spare[idx] == 0)
+			continue;
+		s->spare[idx]--;
+		/* Back to the tail so that the load is spread round robin */
+		sched_enqueue(s, idx);
+		return idx;
+	}
+	return -1;
+}
+
+/*
+ * Same for a scheduler without shards
+ */
+int conn_sched_get(struct conn_sched *s)
+{
+	return conn_sched_get_shard(s, 0);
+}
+
+/*
+ * Return slots of a connection, e.g. after receiving replies
+ */
+void conn_sched_put(struct conn_sched *s, int idx, int slots)
+{
+	s->spare[idx] += slots;
+	sched_enqueue(s, idx);
+}
+
+/*
+ * Keep a connection out of the schedule without losing its slots
+ */
+void conn_sched_pause(struct conn_sched *s, int idx)
+{
+	s->flags[idx] |= SCHED_PAUSED;
+}
+
+void conn_sched_resume(struct conn_sched *s, int idx)
+{
+	s->flags[idx] &= ~SCHED_PAUSED;
+	sched_enqueue(s, idx);
+}
+
+void conn_sched_close(struct conn_sched *s, int idx)
+{
+	s->flags[idx] |= SCHED_CLOSED;
+}
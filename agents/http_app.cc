@@ -115,8 +115,8 @@ byte_req_pair http_consume_response(application_protocol *proto, iovec *response
     auto reported_total_len = ret + reported_content_length;
     auto leftover_bytes = response->iov_len - reported_total_len;
     if (reported_total_len > response->iov_len) {
-        // in this case, we may need to wait for more if MAX_PAYLOAD has some left
-        // if this is greater than MAX_PAYLOAD to buffer, then the calling method should error
+        // in this case, we need to wait for more, the connection buffer grows
+        // up to BUFFER_POOL_MAX_SIZE to fit the whole response
         return {0,0};
     }
 
@@ -140,6 +140,7 @@ static int memcache_ascii_create_request(struct application_protocol *proto,
 		req->iovs[6].iov_len = 2;
 
 		req->iov_cnt = 7;
+		req->op_class = OP_WRITE;
 	} else {
 		// get
 		req->iovs[0].iov_base = get_cmd;
@@ -150,7 +151,10 @@ static int memcache_ascii_create_request(struct application_protocol *proto,
 		req->iovs[2].iov_len = 2;
 
 		req->iov_cnt = 3;
+		req->op_class = OP_READ;
 	}
+	if (info->route_keys)
+		req->meta = key;
 
 	return 0;
 }
@@ -241,6 +245,7 @@ static int memcache_bin_create_request(struct application_protocol *proto,
 		req->iovs[3].iov_len = val_len;
 
 		req->iov_cnt = 4;
+		req->op_class = OP_WRITE;
 	} else {
 		// get
 		header.opcode = CMD_GETK;
@@ -253,7 +258,10 @@ static int memcache_bin_create_request(struct application_protocol *proto,
 		req->iovs[1].iov_len = key->iov_len;
 
 		req->iov_cnt = 2;
+		req->op_class = OP_READ;
 	}
+	if (info->route_keys)
+		req->meta = key;
 
 	return 0;
 }
@@ -266,7 +274,7 @@ int memcache_init(char *proto, struct application_protocol *app_proto)
 	char *saveptr;
 	char key_sel[64];
 
-	data = malloc(sizeof(struct kv_info));
+	data = calloc(1, sizeof(struct kv_info));
 	assert(data != NULL);
 
 	assert(strncmp("memcache-", proto, 9) == 0);
@@ -0,0 +1,251 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <lancet/error.h>
+#include <lancet/placement.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define SYSFS_BUF_SIZE 4096
+
+static int *thread_cpus;
+static int cpu_count;
+static int mem_node = PLACEMENT_NO_NODE;
+
+/*
+ * Parse a kernel style CPU list, e.g. 0-7,16,18-19
+ */
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	char *copy, *token, *saveptr, *end;
+	long first, last, i;
+
+	CPU_ZERO(set);
+	copy = strdup(list);
+	if (!copy)
+		return -1;
+
+	for (token = strtok_r(copy, ",\n", &saveptr); token;
+		 token = strtok_r(NULL, ",\n", &saveptr)) {
+		first = strtol(token, &end, 10);
+		last = first;
+		if (end != token && *end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == token || *end != '\0' || first < 0 || last < first ||
+			last >= CPU_SETSIZE) {
+			free(copy);
+			return -1;
+		}
+		for (i = first; i <= last; i++)
+			CPU_SET(i, set);
+	}
+	free(copy);
+	return 0;
+}
+
+static int read_sysfs(const char *path, char *buf, int len)
+{
+	FILE *f;
+	char *ret;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fgets(buf, len, f);
+	fclose(f);
+	return ret ? 0 : -1;
+}
+
+static int nic_node(const char *if_name)
+{
+	char path[128], buf[16];
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+			 if_name);
+	if (read_sysfs(path, buf, sizeof(buf)))
+		return PLACEMENT_NO_NODE;
+	return atoi(buf);
+}
+
+static int node_cpus(int node, cpu_set_t *set)
+{
+	char path[128], buf[SYSFS_BUF_SIZE];
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+			 node);
+	if (read_sysfs(path, buf, sizeof(buf)))
+		return -1;
+	return parse_cpu_list(buf, set);
+}
+
+/*
+ * Collect the CPUs that the interrupts of the interface are steered to
+ */
+static void irq_cpus(const char *if_name, cpu_set_t *set)
+{
+	char path[300], buf[SYSFS_BUF_SIZE];
+	struct dirent *entry;
+	cpu_set_t irq_set;
+	DIR *dir;
+
+	CPU_ZERO(set);
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", if_name);
+	dir = opendir(path);
+	if (!dir)
+		return;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/irq/%s/smp_affinity_list",
+				 entry->d_name);
+		if (read_sysfs(path, buf, sizeof(buf)))
+			continue;
+		if (parse_cpu_list(buf, &irq_set))
+			continue;
+		CPU_OR(set, set, &irq_set);
+	}
+	closedir(dir);
+}
+
+/*
+ * Pick the CPUs of the agent threads. An explicit CPU list is used as is.
+ * Otherwise the threads go on the CPUs of the NUMA node, skipping the
+ * cores that handle the NIC interrupts when enough cores are left, or on
+ * every CPU the agent may run on.
+ */
+int placement_init(const char *cpu_list, int node, const char *if_name,
+				   int thread_count)
+{
+	cpu_set_t allowed, node_set, irq_set;
+	int i, left;
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed)) {
+		lancet_perror("sched_getaffinity");
+		return -1;
+	}
+
+	if (node == PLACEMENT_NIC_NODE) {
+		if (if_name[0] == '\0') {
+			lancet_fprintf(stderr, "The NIC node needs an interface (-n)\n");
+			return -1;
+		}
+		node = nic_node(if_name);
+		if (node < 0)
+			lancet_fprintf(stderr, "No NUMA node for %s, ignoring it\n",
+						   if_name);
+	}
+	if (node >= PLACEMENT_MAX_NODES - 1) {
+		lancet_fprintf(stderr, "Invalid NUMA node %d\n", node);
+		return -1;
+	}
+	mem_node = node;
+
+	if (cpu_list[0] != '\0') {
+		if (parse_cpu_list(cpu_list, &allowed)) {
+			lancet_fprintf(stderr, "Invalid CPU list %s\n", cpu_list);
+			return -1;
+		}
+	} else if (node >= 0) {
+		if (node_cpus(node, &node_set)) {
+			lancet_fprintf(stderr, "Failed to read the CPUs of node %d\n",
+						   node);
+			return -1;
+		}
+		CPU_AND(&allowed, &allowed, &node_set);
+
+		irq_cpus(if_name, &irq_set);
+		left = 0;
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &allowed) && !CPU_ISSET(i, &irq_set))
+				left++;
+		if (left >= thread_count)
+			for (i = 0; i < CPU_SETSIZE; i++)
+				if (CPU_ISSET(i, &irq_set))
+					CPU_CLR(i, &allowed);
+	}
+
+	cpu_count = CPU_COUNT(&allowed);
+	if (cpu_count == 0) {
+		lancet_fprintf(stderr, "No CPU left to run the agent threads\n");
+		return -1;
+	}
+	if (thread_count > cpu_count)
+		lancet_fprintf(stderr, "%d threads share %d CPUs\n", thread_count,
+					   cpu_count);
+
+	thread_cpus = malloc(cpu_count * sizeof(int));
+	if (!thread_cpus)
+		return -1;
+	cpu_count = 0;
+	for (i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &allowed))
+			thread_cpus[cpu_count++] = i;
+
+	return 0;
+}
+
+/*
+ * Pin the calling thread and set its memory policy. It runs before any
+ * per-thread allocation, so that the pages are first touched on the node.
+ */
+int placement_bind(int thread_idx)
+{
+	unsigned long nodemask[PLACEMENT_MAX_NODES / (8 * sizeof(long))];
+	cpu_set_t cpuset;
+	int s;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(thread_cpus[thread_idx % cpu_count], &cpuset);
+	s = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+	if (s != 0) {
+		lancet_perror("pthread_setaffinity_np");
+		return -1;
+	}
+
+	if (mem_node < 0)
+		return 0;
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[mem_node / (8 * sizeof(long))] |=
+		1UL << (mem_node % (8 * sizeof(long)));
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+				PLACEMENT_MAX_NODES)) {
+		lancet_perror("set_mempolicy");
+		return -1;
+	}
+
+	return 0;
+}
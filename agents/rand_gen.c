@@ -367,6 +367,7 @@ struct rand_gen *init_rand(char *gen_type)
 		lancet_fprintf(stderr, "Unknown generator type %s\n", gen_type);
 		return NULL;
 	}
+	gen->version = 0;
 	return gen;
 }
 
@@ -382,4 +383,34 @@ void set_avg_ext(struct rand_gen *gen, double avg)
 	default:
 		assert(0);
 	}
+	/* The agent threads read the version before the parameters */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	gen->version++;
+}
+
+/*
+ * The fixed and exponential inter-arrivals are drawn in one loop without
+ * going through the function pointers for every sample.
+ */
+void generate_batch(struct rand_gen *gen, double *out, int count)
+{
+	double lambda;
+	int i;
+
+	switch (gen->gen_type) {
+	case GEN_FIXED:
+		for (i = 0; i < count; i++)
+			out[i] = gen->params.p1.a;
+		break;
+	case GEN_EXP:
+		lambda = gen->params.p1.a;
+		for (i = 0; i < count; i++)
+			out[i] = drand48();
+		for (i = 0; i < count; i++)
+			out[i] = -log(out[i]) / lambda;
+		break;
+	default:
+		for (i = 0; i < count; i++)
+			out[i] = generate(gen);
+	}
 }
@@ -193,6 +193,7 @@ static int redis_kv_create_request(struct application_protocol *proto,
 		req->iovs[9].iov_len = 2;
 
 		req->iov_cnt = 10;
+		req->op_class = OP_WRITE;
 #ifdef ENABLE_R2P2
 		req->meta = (void *)(unsigned long)FIXED_ROUTE;
 #endif
@@ -201,10 +202,13 @@ static int redis_kv_create_request(struct application_protocol *proto,
 		req->iovs[0].iov_len = 14;
 
 		req->iov_cnt = 5;
+		req->op_class = OP_READ;
 #ifdef ENABLE_R2P2
 		req->meta = (void *)(unsigned long)LB_ROUTE;
 #endif
 	}
+	if (info->route_keys)
+		req->meta = key;
 
 	return 0;
 }
@@ -217,7 +221,7 @@ static int init_redis_kv(char *proto, struct application_protocol *app_proto)
 	char *saveptr;
 	char key_sel[64];
 
-	data = malloc(sizeof(struct kv_info));
+	data = calloc(1, sizeof(struct kv_info));
 	assert(data != NULL);
 
 	/* key size dist */
@@ -282,6 +286,7 @@ static int redis_ycsbe_create_request(struct application_protocol *proto,
 		req->iovs[2].iov_base = ycsbe_scan;
 		req->iovs[2].iov_len = strlen(ycsbe_scan);
 		req->iov_cnt = 3;
+		req->op_class = OP_SCAN;
 
 		if (info->replicated) {
 #ifdef ENABLE_R2P2
@@ -300,6 +305,7 @@ static int redis_ycsbe_create_request(struct application_protocol *proto,
 		req->iovs[2].iov_base = info->fixed_req_body;
 		req->iovs[2].iov_len = info->field_count*(info->field_size+1);
 		req->iov_cnt = 3;
+		req->op_class = OP_WRITE;
 		if (info->replicated) {
 #ifdef ENABLE_R2P2
 			req->meta = (void *)(unsigned long)REPLICATED_ROUTE;
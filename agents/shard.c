@@ -0,0 +1,209 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lancet/error.h>
+#include <lancet/shard.h>
+
+/* Points of a target on the ketama continuum, 4 per MD5 digest */
+#define KETAMA_POINTS 160
+#define REDIS_SLOTS 16384
+
+int shard_count;
+struct iovec *shard_keys;
+uint8_t *key_shard;
+
+struct ketama_point {
+	uint32_t hash;
+	uint32_t shard;
+};
+
+static int point_cmp(const void *a, const void *b)
+{
+	const struct ketama_point *pa = a, *pb = b;
+
+	return (pa->hash > pb->hash) - (pa->hash < pb->hash);
+}
+
+static void target_name(struct agent_config *cfg, int idx, char *name,
+						size_t len)
+{
+	struct in_addr addr;
+
+	if (cfg->tp_type == UNIX || cfg->tp_type == UNIXPACKET) {
+		snprintf(name, len, "%s", cfg->unix_paths[idx]);
+		return;
+	}
+	addr.s_addr = cfg->targets[idx].ip;
+	snprintf(name, len, "%s:%u", inet_ntoa(addr), cfg->targets[idx].port);
+}
+
+/*
+ * Same continuum as libketama with equal weights: the point i of a target
+ * is taken from the MD5 digest of "<target>-<i / 4>".
+ */
+static int ketama_init(struct agent_config *cfg, struct kv_info *info)
+{
+	struct ketama_point *points;
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	char name[UNIX_PATH_LEN + 16];
+	char target[UNIX_PATH_LEN];
+	int i, j, k, lo, hi, count;
+	uint32_t hash;
+
+	count = shard_count * KETAMA_POINTS;
+	points = malloc(count * sizeof(struct ketama_point));
+	if (!points)
+		return -1;
+
+	for (i = 0; i < shard_count; i++) {
+		target_name(cfg, i, target, sizeof(target));
+		for (j = 0; j < KETAMA_POINTS / 4; j++) {
+			snprintf(name, sizeof(name), "%s-%d", target, j);
+			if (!EVP_Digest(name, strlen(name), digest, NULL, EVP_md5(), NULL))
+				goto err;
+			for (k = 0; k < 4; k++) {
+				points[i * KETAMA_POINTS + j * 4 + k].hash =
+					(uint32_t)digest[3 + k * 4] << 24 |
+					(uint32_t)digest[2 + k * 4] << 16 |
+					(uint32_t)digest[1 + k * 4] << 8 | digest[k * 4];
+				points[i * KETAMA_POINTS + j * 4 + k].shard = i;
+			}
+		}
+	}
+	qsort(points, count, sizeof(struct ketama_point), point_cmp);
+
+	/* A key goes to the first point at or after its hash, wrapping around */
+	for (i = 0; i < info->key->key_count; i++) {
+		if (!EVP_Digest(shard_keys[i].iov_base, shard_keys[i].iov_len, digest,
+						NULL, EVP_md5(), NULL))
+			goto err;
+		hash = (uint32_t)digest[3] << 24 | (uint32_t)digest[2] << 16 |
+			   (uint32_t)digest[1] << 8 | digest[0];
+		lo = 0;
+		hi = count;
+		while (lo < hi) {
+			j = (lo + hi) / 2;
+			if (points[j].hash < hash)
+				lo = j + 1;
+			else
+				hi = j;
+		}
+		key_shard[i] = points[lo == count ? 0 : lo].shard;
+	}
+	free(points);
+	return 0;
+err:
+	lancet_fprintf(stderr, "MD5 failed\n");
+	free(points);
+	return -1;
+}
+
+/* CRC16-CCITT (XModem), as used for the Redis cluster slots */
+static uint16_t crc16(const char *buf, int len)
+{
+	uint16_t crc = 0;
+	int i, j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= (uint16_t)(unsigned char)buf[i] << 8;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/*
+ * Only the part between the first { and the next } is hashed, if not empty,
+ * so that keys with the same hash tag share a slot.
+ */
+static int redis_slot(const char *key, int len)
+{
+	const char *open, *close;
+
+	open = memchr(key, '{', len);
+	if (open) {
+		close = memchr(open + 1, '}', key + len - open - 1);
+		if (close && close > open + 1)
+			return crc16(open + 1, close - open - 1) % REDIS_SLOTS;
+	}
+	return crc16(key, len) % REDIS_SLOTS;
+}
+
+/*
+ * The targets own equal ranges of slots in their order, the layout of a
+ * cluster created with redis-cli --cluster create.
+ */
+static void slots_init(struct kv_info *info)
+{
+	int i, slot;
+
+	for (i = 0; i < info->key->key_count; i++) {
+		slot = redis_slot(shard_keys[i].iov_base, shard_keys[i].iov_len);
+		key_shard[i] = slot * shard_count / REDIS_SLOTS;
+	}
+}
+
+int shard_init(struct agent_config *cfg)
+{
+	struct kv_info *info;
+	int ret = 0;
+
+	if (cfg->app_proto->type != PROTO_REDIS &&
+		cfg->app_proto->type != PROTO_MEMCACHED_BIN &&
+		cfg->app_proto->type != PROTO_MEMCACHED_ASCII) {
+		lancet_fprintf(stderr, "Key routing needs a memcache or redis "
+							   "key-value protocol\n");
+		return -1;
+	}
+	if (cfg->target_count > MAX_SHARDS) {
+		lancet_fprintf(stderr, "Key routing supports up to %d targets\n",
+					   MAX_SHARDS);
+		return -1;
+	}
+	if (cfg->conn_count / cfg->thread_count < cfg->target_count) {
+		lancet_fprintf(stderr, "Key routing needs a connection to every "
+							   "target in each thread\n");
+		return -1;
+	}
+
+	info = cfg->app_proto->arg;
+	shard_count = cfg->target_count;
+	shard_keys = info->key->keys;
+	key_shard = malloc(info->key->key_count * sizeof(uint8_t));
+	if (!key_shard)
+		return -1;
+
+	if (cfg->shard_policy == SHARD_KETAMA)
+		ret = ketama_init(cfg, info);
+	else
+		slots_init(info);
+	info->route_keys = 1;
+	return ret;
+}
@@ -24,6 +24,7 @@
  */
 #include <fcntl.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +37,7 @@
 #include <lancet/agent.h>
 #include <lancet/error.h>
 #include <lancet/manager.h>
+#include <lancet/misc.h>
 #include <lancet/stats.h>
 #include <lancet/timestamping.h>
 
@@ -45,54 +47,54 @@ static __thread union stats *thread_stats;
 static __thread struct timespec prev_tx_timestamp;
 static __thread struct tx_samples *tx_s;
 static __thread uint32_t tx_sample_selector = 0;
+static __thread struct stats_windows *windows_s;
+static __thread struct stats_window *cur_window;
+static __thread int64_t cur_window_end;
+static __thread int64_t window_clock_off; // wall clock minus time_ns()
 
 static int configure_stats_shm(void)
 {
 	int fd, ret;
 	void *vaddr;
 	char fname[64];
+	size_t stats_size, total_size;
+	struct timespec now;
 
 	sprintf(fname, "/lancet-stats%d", get_agent_tid());
 	fd = shm_open(fname, O_RDWR | O_CREAT | O_TRUNC, 0660);
 	if (fd == -1)
 		return 1;
 
-	if (get_agent_type() == THROUGHPUT_AGENT) {
-		ret = ftruncate(fd, sizeof(struct throughput_stats) +
-								sizeof(struct tx_samples));
-		if (ret)
-			return ret;
-
-		vaddr = mmap(NULL, sizeof(struct throughput_stats) +
-							   sizeof(struct tx_samples),
-					 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		if (vaddr == MAP_FAILED)
-			return 1;
-
-		bzero(vaddr,
-			  sizeof(struct throughput_stats) + sizeof(struct tx_samples));
-
-		tx_s = (struct tx_samples *)(((char *)vaddr) +
-									 sizeof(struct throughput_stats));
-	} else {
-		ret = ftruncate(fd, sizeof(struct latency_stats) +
-								sizeof(struct tx_samples));
-		if (ret)
-			return ret;
-
-		vaddr =
-			mmap(NULL, sizeof(struct latency_stats) + sizeof(struct tx_samples),
-				 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-		if (vaddr == MAP_FAILED)
-			return 1;
-
-		bzero(vaddr, sizeof(struct latency_stats) + sizeof(struct tx_samples));
-
-		tx_s = (struct tx_samples *)(((char *)vaddr) +
-									 sizeof(struct latency_stats));
-	}
+	if (get_agent_type() == THROUGHPUT_AGENT)
+		stats_size = sizeof(struct throughput_stats);
+	else
+		stats_size = sizeof(struct latency_stats);
+
+	total_size = stats_size + sizeof(struct tx_samples) +
+				 sizeof(struct stats_windows);
+	ret = ftruncate(fd, total_size);
+	if (ret)
+		return ret;
+
+	vaddr = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (vaddr == MAP_FAILED)
+		return 1;
+
+	bzero(vaddr, total_size);
+
+	tx_s = (struct tx_samples *)(((char *)vaddr) + stats_size);
+	windows_s = (struct stats_windows *)(((char *)tx_s) +
+										 sizeof(struct tx_samples));
+	windows_s->window_ns = get_stats_window_ns();
+	/* Windows start on the wall clock, so that agents agree on them */
+	clock_gettime(CLOCK_REALTIME, &now);
+	window_clock_off = now.tv_sec * 1000000000L + now.tv_nsec - time_ns();
 
 	thread_stats = vaddr;
+	thread_stats->th_s.hdr.version = STATS_VERSION;
+	thread_stats->th_s.hdr.agent_type = get_agent_type();
+	thread_stats->th_s.hdr.tx_samples_off = stats_size;
+	thread_stats->th_s.hdr.windows_off = (char *)windows_s - (char *)vaddr;
 
 	return 0;
 }
@@ -108,8 +110,42 @@ int init_per_thread_stats(void)
 	return 0;
 }
 
+/*
+ * The window of the current time. A new window zeroes its slot between
+ * marking it invalid and publishing its number, so that a reader that finds
+ * the same number before and after copying the slot has a whole window.
+ */
+static struct stats_window *get_window(void)
+{
+	struct stats_window *w;
+	int64_t now;
+	uint64_t idx;
+
+	now = time_ns() + window_clock_off;
+	if (now < cur_window_end)
+		return cur_window;
+
+	idx = now / windows_s->window_ns;
+	w = &windows_s->windows[idx % STATS_WINDOWS];
+	__atomic_store_n(&w->idx, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	bzero(&w->rx, sizeof(struct stats_window) -
+					  offsetof(struct stats_window, rx));
+	__atomic_store_n(&w->idx, idx, __ATOMIC_RELEASE);
+
+	cur_window = w;
+	cur_window_end = (idx + 1) * windows_s->window_ns;
+	return w;
+}
+
 int add_throughput_tx_sample(struct byte_req_pair tx_p)
 {
+	struct stats_window *w;
+
+	w = get_window();
+	w->tx.bytes += tx_p.bytes;
+	w->tx.reqs += tx_p.reqs;
+
 	if (!should_measure())
 		return 0;
 
@@ -121,6 +157,12 @@ int add_throughput_tx_sample(struct byte_req_pair tx_p)
 
 int add_throughput_rx_sample(struct byte_req_pair rx_p)
 {
+	struct stats_window *w;
+
+	w = get_window();
+	w->rx.bytes += rx_p.bytes;
+	w->rx.reqs += rx_p.reqs;
+
 	if (!should_measure())
 		return 0;
 
@@ -146,19 +188,172 @@ int add_tx_timestamp(struct timespec *tx_ts)
 	return 0;
 }
 
-int add_latency_sample(long diff, struct timespec *tx)
+/*
+ * Values below 2^sub_bits ns get a bucket each, above that every power of
+ * two is split in 2^sub_bits buckets of equal width.
+ */
+static int hist_bucket(uint64_t ns, int sub_bits)
+{
+	int msb;
+
+	if (ns < (1 << sub_bits))
+		return ns;
+	msb = 63 - __builtin_clzl(ns);
+	return ((msb - sub_bits + 1) << sub_bits) +
+		   ((ns >> (msb - sub_bits)) & ((1 << sub_bits) - 1));
+}
+
+static int conn_hist_bucket(uint64_t ns)
+{
+	return hist_bucket(ns, CONN_HIST_SUB_BITS);
+}
+
+static void add_lat_hist(struct lat_hist *h, uint64_t ns)
+{
+	h->count++;
+	h->sum_ns += ns;
+	h->buckets[hist_bucket(ns, LAT_HIST_SUB_BITS)]++;
+}
+
+/*
+ * diff is the service latency measured from the actual send and sched_delay
+ * how late the request was sent compared to its intended send time. By
+ * default the sample counts from the intended send time. With -d both
+ * latencies are kept, so that the delay hidden by a stalled agent or
+ * connection shows up next to the service latency. Every latency goes into
+ * the histograms, also into the one of the op class of the request, only
+ * the sampled ones into the samples.
+ */
+int add_latency_sample(long diff, long sched_delay, struct timespec *tx,
+					   int op_class)
 {
 	struct lat_sample *lts;
+	struct stats_window *w;
+	long lat;
 
 	assert(diff > 0);
-	if (!should_measure() ||
-		(tx_sample_selector++ % lround(1 / get_sampling_rate())))
+	if (sched_delay < 0)
+		sched_delay = 0;
+	/* The service latency with -d, like hist */
+	lat = get_intended_latency() ? diff : diff + sched_delay;
+	w = get_window();
+	w->lat_count++;
+	w->lat_sum_ns += lat;
+	w->lat_hist[hist_bucket(lat, WINDOW_HIST_SUB_BITS)]++;
+
+	if (!should_measure())
+		return 0;
+	add_lat_hist(&thread_stats->lt_s.hist, lat);
+	add_lat_hist(&thread_stats->lt_s.op_hists[op_class], lat);
+	if (get_intended_latency())
+		add_lat_hist(&thread_stats->lt_s.intended_hist, diff + sched_delay);
+	if (tx_sample_selector++ % lround(1 / get_sampling_rate()))
 		return 0;
 	lts = &thread_stats->lt_s
 			   .samples[thread_stats->lt_s.inc_idx++ % MAX_PER_THREAD_SAMPLES];
-	lts->nsec = diff;
+	if (get_intended_latency()) {
+		lts->nsec = diff;
+		lts->intended_nsec = diff + sched_delay;
+	} else
+		lts->nsec = diff + sched_delay;
 	if (tx)
 		lts->tx = *tx;
 
 	return 0;
 }
+
+int add_backlog_sample(long wait, uint32_t depth)
+{
+	struct backlog_stats *bs;
+
+	if (!should_measure())
+		return 0;
+
+	bs = &thread_stats->th_s.backlog;
+	bs->reqs++;
+	bs->wait_ns += wait;
+	if (wait > bs->max_wait_ns)
+		bs->max_wait_ns = wait;
+	if (depth > bs->max_depth)
+		bs->max_depth = depth;
+
+	return 0;
+}
+
+int add_backlog_drop(void)
+{
+	if (!should_measure())
+		return 0;
+
+	thread_stats->th_s.backlog.dropped++;
+
+	return 0;
+}
+
+int add_connect_sample(long connect)
+{
+	struct conn_stats *cs;
+
+	if (!should_measure())
+		return 0;
+
+	cs = &thread_stats->th_s.conn;
+	cs->opened++;
+	cs->connect_hist[conn_hist_bucket(connect > 0 ? connect : 0)]++;
+
+	return 0;
+}
+
+int add_handshake_sample(long handshake, int resumed)
+{
+	struct conn_stats *cs;
+
+	if (!should_measure())
+		return 0;
+
+	cs = &thread_stats->th_s.conn;
+	cs->resumed += resumed;
+	cs->handshake_hist[conn_hist_bucket(handshake > 0 ? handshake : 0)]++;
+
+	return 0;
+}
+
+int add_pool_exhausted(void)
+{
+	if (!should_measure())
+		return 0;
+
+	thread_stats->th_s.pool_exhausted++;
+
+	return 0;
+}
+
+int add_shard_tx_sample(int shard)
+{
+	if (!should_measure())
+		return 0;
+
+	thread_stats->th_s.shards.tx_reqs[shard]++;
+
+	return 0;
+}
+
+int add_shard_rx_sample(int shard, uint64_t reqs)
+{
+	if (!should_measure())
+		return 0;
+
+	thread_stats->th_s.shards.rx_reqs[shard] += reqs;
+
+	return 0;
+}
+
+int add_op_tx_sample(int op_class)
+{
+	if (!should_measure())
+		return 0;
+
+	thread_stats->th_s.ops.tx_reqs[op_class]++;
+
+	return 0;
+}
@@ -193,6 +193,16 @@ ssize_t timestamp_recv(int sockfd, void *buf, size_t len, int flags,
 	return nbytes;
 }
 
+/*
+ * Extract the rx timestamp from a message received by other means than
+ * timestamp_recv. Returns 1 if timestamp found.
+ */
+int extract_rx_timestamp(struct msghdr *hdr, struct timestamp_info *rx_time)
+{
+	bzero(rx_time, sizeof(struct timestamp_info));
+	return extract_timestamp(hdr, rx_time);
+}
+
 /*
  * Used only for NIC timestamping with UDP
  * Returns -1 if no new timestamp found
@@ -282,12 +292,53 @@ int get_tx_timestamp(int sockfd, struct pending_tx_timestamps *tx_timestamps)
 	return n;
 }
 
+/*
+ * Drain the MSG_ZEROCOPY notifications of the socket error queue.
+ * Returns the number of completed sends, copied is set if the kernel
+ * had to copy the data anyway.
+ */
+int get_zerocopy_completions(int sockfd, int *copied)
+{
+	char control[CONTROL_LEN];
+	struct msghdr mhdr;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *se;
+	int completed = 0;
+
+	while (1) {
+		bzero(&mhdr, sizeof(mhdr));
+		mhdr.msg_control = control;
+		mhdr.msg_controllen = CONTROL_LEN;
+		if (recvmsg(sockfd, &mhdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cmsg = CMSG_FIRSTHDR(&mhdr); cmsg != NULL;
+			 cmsg = CMSG_NXTHDR(&mhdr, cmsg)) {
+			if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+				continue;
+			se = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (se->ee_errno != 0 || se->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* The notification covers the sends ee_info to ee_data */
+			completed += se->ee_data - se->ee_info + 1;
+			if (se->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copied = 1;
+		}
+	}
+	return completed;
+}
+
 void add_pending_tx_timestamp(struct pending_tx_timestamps *tx_timestamps,
-							  uint32_t bytes)
+							  uint32_t bytes, long sched_delay, int op_class)
 {
+	struct timestamp_info *ts_info;
+
 	tx_timestamps->tx_byte_counter += bytes;
-	tx_timestamps->pending[tx_timestamps->head++ % get_max_pending_reqs()]
-		.optid = tx_timestamps->tx_byte_counter;
+	ts_info =
+		&tx_timestamps->pending[tx_timestamps->head++ % get_max_pending_reqs()];
+	ts_info->optid = tx_timestamps->tx_byte_counter;
+	ts_info->sched_delay = sched_delay;
+	ts_info->op_class = op_class;
 }
 
 struct timestamp_info *
@@ -305,13 +356,16 @@ pop_pending_tx_timestamps(struct pending_tx_timestamps *tx_timestamps)
 }
 
 void push_complete_tx_timestamp(struct pending_tx_timestamps *tx_timestamps,
-								struct timespec *to_add)
+								struct timespec *to_add, long sched_delay,
+								int op_class)
 {
 	struct timestamp_info *ts_info;
 
 	ts_info =
 		&tx_timestamps->pending[tx_timestamps->tail % get_max_pending_reqs()];
 	ts_info->time = *to_add;
+	ts_info->sched_delay = sched_delay;
+	ts_info->op_class = op_class;
 	// this is confusing but the consumed is used when receiving the reply
 	tx_timestamps->head++;
 	tx_timestamps->tail++;
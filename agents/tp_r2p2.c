@@ -24,6 +24,7 @@
  */
 #include <arpa/inet.h>
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -38,6 +39,66 @@
 #include <r2p2/api-internal.h>
 #include <r2p2/api.h>
 
+/*
+ * Per-thread pool of request contexts. R2P2 runs the callbacks from
+ * r2p2_poll on the thread that sent the request, so the free-list needs no
+ * locks. The pool is sized for the expected in-flight requests, when it
+ * runs dry the context is allocated anyway, counted, and joins the pool
+ * once released.
+ */
+#define CTX_POOL_MIN 4096
+
+struct lancet_r2p2_ctx {
+	struct r2p2_ctx ctx; // first, the callbacks get it as arg
+	struct timespec tx_timestamp; // symmetric agent only
+	int op_class; // symmetric agent only
+	struct lancet_r2p2_ctx *next;
+};
+
+static __thread struct lancet_r2p2_ctx *ctx_free_list;
+
+static int ctx_pool_init(void)
+{
+	struct lancet_r2p2_ctx *pool;
+	int i, count;
+
+	count = get_conn_count() / get_thread_count() * get_max_pending_reqs();
+	if (count < CTX_POOL_MIN)
+		count = CTX_POOL_MIN;
+	pool = malloc(count * sizeof(struct lancet_r2p2_ctx));
+	if (!pool)
+		return -1;
+	for (i = 0; i < count; i++) {
+		pool[i].next = ctx_free_list;
+		ctx_free_list = &pool[i];
+	}
+	return 0;
+}
+
+static struct r2p2_ctx *ctx_pool_get(void)
+{
+	struct lancet_r2p2_ctx *lctx;
+
+	lctx = ctx_free_list;
+	if (lctx)
+		ctx_free_list = lctx->next;
+	else {
+		add_pool_exhausted();
+		lctx = malloc(sizeof(struct lancet_r2p2_ctx));
+		assert(lctx);
+	}
+	bzero(lctx, offsetof(struct lancet_r2p2_ctx, next));
+	return &lctx->ctx;
+}
+
+static void ctx_pool_put(void *arg)
+{
+	struct lancet_r2p2_ctx *lctx = arg;
+
+	lctx->next = ctx_free_list;
+	ctx_free_list = lctx;
+}
+
 void lancet_success_nic_timestamping_cb(long handle, void *arg,
 										struct iovec *iov, int iovcnt)
 {
@@ -61,12 +122,13 @@ void lancet_success_nic_timestamping_cb(long handle, void *arg,
 
 	if (ret == 0) {
 		add_tx_timestamp(&ctx->tx_timestamp);
-		add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9,
-						   &ctx->tx_timestamp);
+		add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9, 0,
+						   &ctx->tx_timestamp,
+						   ((struct lancet_r2p2_ctx *)ctx)->op_class);
 	}
 
 	// free ctx
-	free(arg);
+	ctx_pool_put(arg);
 
 	r2p2_recv_resp_done(handle);
 #endif
@@ -91,15 +153,16 @@ void lancet_success_timestamping_cb(long handle, void *arg, struct iovec *iov,
 	add_throughput_rx_sample(read_res);
 
 	ctx = (struct r2p2_ctx *)arg;
-	tx_timestamp = (struct timespec *)(ctx + 1);
+	tx_timestamp = &((struct lancet_r2p2_ctx *)ctx)->tx_timestamp;
 	ret = timespec_diff(&latency, &rx_timestamp, tx_timestamp);
 	if (ret == 0) {
-		add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9,
-						   tx_timestamp);
+		add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9, 0,
+						   tx_timestamp,
+						   ((struct lancet_r2p2_ctx *)ctx)->op_class);
 	}
 
 	// free ctx
-	free(arg);
+	ctx_pool_put(arg);
 
 	r2p2_recv_resp_done(handle);
 }
@@ -115,7 +178,7 @@ void lancet_success_cb(long handle, void *arg, struct iovec *iov, int iovcnt)
 	add_throughput_rx_sample(read_res);
 
 	// free ctx
-	free(arg);
+	ctx_pool_put(arg);
 
 	r2p2_recv_resp_done(handle);
 }
@@ -123,13 +186,13 @@ void lancet_success_cb(long handle, void *arg, struct iovec *iov, int iovcnt)
 void lancet_error_cb(void *arg, int err)
 {
 	//lancet_fprintf(stderr, "Error cb %d\n", err);
-	free(arg);
+	ctx_pool_put(arg);
 }
 
 void lancet_timeout_cb(void *arg)
 {
 	//lancet_fprintf(stderr, "Request timeout\n");
-	free(arg);
+	ctx_pool_put(arg);
 }
 
 static void throughput_r2p2_main(void)
@@ -146,6 +209,10 @@ static void throughput_r2p2_main(void)
 		lancet_fprintf(stderr, "Error initialising per core\n");
 		return;
 	}
+	if (ctx_pool_init()) {
+		lancet_fprintf(stderr, "Failed to allocate the context pool\n");
+		return;
+	}
 
 	targets = (struct r2p2_host_tuple *)get_targets();
 	target_count = get_target_count();
@@ -161,8 +228,7 @@ static void throughput_r2p2_main(void)
 			// prepare msg to be sent
 			to_send = prepare_request();
 			// prepare ctx
-			ctx = malloc(sizeof(struct r2p2_ctx));
-			assert(ctx);
+			ctx = ctx_pool_get();
 			ctx->success_cb = lancet_success_cb;
 			ctx->error_cb = lancet_error_cb;
 			ctx->timeout_cb = lancet_timeout_cb;
@@ -270,8 +336,10 @@ static void latency_r2p2_main(void)
 			continue;
 		}
 		diff = time_ns() - next_tx;
-		if (diff < 0)
+		if (diff < 0) {
+			pace_wait(next_tx);
 			continue;
+		}
 
 		// Prepare request
 		to_send = prepare_request();
@@ -339,7 +407,9 @@ static void latency_r2p2_main(void)
 		// end_time = rdtsc();
 		end_time = time_ns();
 		// bookkeeping
-		add_latency_sample(end_time - start_time, NULL);
+		add_latency_sample(end_time - start_time,
+						   get_intended_latency() ? start_time - next_tx : 0,
+						   NULL, to_send->op_class);
 		brp.bytes = byte_count - sizeof(struct r2p2_header);
 		brp.reqs = 1;
 		add_throughput_rx_sample(brp);
@@ -371,12 +441,16 @@ static void symmetric_nic_r2p2_main(void)
 		lancet_fprintf(stderr, "Error initialising per core\n");
 		return;
 	}
+	if (ctx_pool_init()) {
+		lancet_fprintf(stderr, "Failed to allocate the context pool\n");
+		return;
+	}
 
 	targets = (struct r2p2_host_tuple *)get_targets();
 	target_count = get_target_count();
 
 	next_tx = time_ns();
-	ctx = malloc(sizeof(struct r2p2_ctx));
+	ctx = ctx_pool_get();
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
@@ -401,6 +475,7 @@ static void symmetric_nic_r2p2_main(void)
 			ctx->rx_timestamp.tv_nsec = 0;
 			ctx->tx_timestamp.tv_sec = 0;
 			ctx->tx_timestamp.tv_nsec = 0;
+			((struct lancet_r2p2_ctx *)ctx)->op_class = to_send->op_class;
 
 			if (to_send->meta)
 				ctx->destination = &targets[0];
@@ -420,8 +495,8 @@ static void symmetric_nic_r2p2_main(void)
 			send_res.reqs = 1;
 			add_throughput_tx_sample(send_res);
 
-			// malloc for the next
-			ctx = malloc(sizeof(struct r2p2_ctx));
+			// take the next from the pool
+			ctx = ctx_pool_get();
 		}
 
 		// poll for responses
@@ -444,6 +519,10 @@ static void symmetric_r2p2_main(void)
 		lancet_fprintf(stderr, "Error initialising per core\n");
 		return;
 	}
+	if (ctx_pool_init()) {
+		lancet_fprintf(stderr, "Failed to allocate the context pool\n");
+		return;
+	}
 
 	targets = (struct r2p2_host_tuple *)get_targets();
 	target_count = get_target_count();
@@ -459,11 +538,8 @@ static void symmetric_r2p2_main(void)
 			// prepare msg to be sent
 			to_send = prepare_request();
 			// prepare ctx
-			ctx = (struct r2p2_ctx *)malloc(sizeof(struct r2p2_ctx) +
-											sizeof(struct timespec));
-			assert(ctx);
-			bzero(ctx, sizeof(struct r2p2_ctx) + sizeof(struct timespec));
-			tx_timestamp = (struct timespec *)(ctx + 1);
+			ctx = ctx_pool_get();
+			tx_timestamp = &((struct lancet_r2p2_ctx *)ctx)->tx_timestamp;
 			ctx->success_cb = lancet_success_timestamping_cb;
 			ctx->error_cb = lancet_error_cb;
 			ctx->timeout_cb = lancet_timeout_cb;
@@ -472,6 +548,7 @@ static void symmetric_r2p2_main(void)
 			else
 				ctx->destination = &targets[rand() % target_count];
 			time_ns_to_ts(tx_timestamp);
+			((struct lancet_r2p2_ctx *)ctx)->op_class = to_send->op_class;
 			ctx->arg = (void *)ctx;
 			ctx->timeout = 5000000;
 			ctx->routing_policy = (int)(unsigned long)to_send->meta;
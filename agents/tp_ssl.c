@@ -14,10 +14,14 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 
+#include <lancet/backlog.h>
+#include <lancet/conn_sched.h>
 #include <lancet/error.h>
 #include <lancet/misc.h>
+#include <lancet/shard.h>
 #include <lancet/timestamping.h>
 #include <lancet/tp_proto.h>
 
@@ -25,25 +29,29 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 
+/* Ciphertext read from the socket at once and fed to the SSL engine */
+#define TLS_RECORD_BUF_SIZE 65536
+
 static SSL_CTX *ssl_ctx;
 static __thread struct tls_connection *connections;
 static __thread int epoll_fd;
 static __thread struct pending_tx_timestamps *per_conn_tx_timestamps;
-static __thread uint32_t conn_idx = 0;
+static __thread struct conn_sched sched;
+static __thread char *record_buf;
+static __thread char *wbuf;
+static __thread uint32_t wbuf_size;
+static __thread int churn_reqs;
+static pthread_once_t ktls_fallback_once = PTHREAD_ONCE_INIT;
+static pthread_once_t ktls_rx_only_once = PTHREAD_ONCE_INIT;
 
 static inline struct tls_connection *pick_conn()
 {
 	int idx;
-	struct tls_connection *c;
-
-	// FIXME: Consider picking connection round robin
-	// idx = rand() % (get_conn_count() / get_thread_count()) ;
-	idx = conn_idx++ % (get_conn_count() / get_thread_count());
-	c = &connections[idx];
-	if ((c->conn.pending_reqs < get_max_pending_reqs()) && (!c->conn.closed))
-		return c;
 
-	return NULL;
+	idx = shard_sched_get(&sched);
+	if (idx < 0)
+		return NULL;
+	return &connections[idx];
 }
 
 static int ssl_init(void)
@@ -71,13 +79,29 @@ static int ssl_init(void)
 	return 0;
 }
 
-static int ssl_init_connection(struct tls_connection *tls_conn)
+static void ssl_new_connection(struct tls_connection *tls_conn)
 {
+	int err;
+
 	tls_conn->ssl = SSL_new(ssl_ctx);
 	assert(tls_conn->ssl);
+	if (get_ktls())
+		SSL_set_options(tls_conn->ssl,
+						SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	if (tls_conn->session) {
+		err = SSL_set_session(tls_conn->ssl, tls_conn->session);
+		assert(err == 1);
+	}
 
-	int err = SSL_set_fd(tls_conn->ssl, tls_conn->conn.fd);
+	err = SSL_set_fd(tls_conn->ssl, tls_conn->conn.fd);
 	assert(err == 1);
+}
+
+static int ssl_init_connection(struct tls_connection *tls_conn)
+{
+	int err;
+
+	ssl_new_connection(tls_conn);
 
 	/*
 	 * Assume that connection is in blocking mode
@@ -94,28 +118,340 @@ static int ssl_init_connection(struct tls_connection *tls_conn)
 	return 0;
 }
 
+static void tls_init_tx(struct tls_connection *tls_conn)
+{
+	tls_conn->tx_size = 4096;
+	tls_conn->tx_buf = malloc(tls_conn->tx_size);
+	assert(tls_conn->tx_buf);
+	tls_conn->tx_len = 0;
+	tls_conn->tx_armed = 0;
+}
+
+/*
+ * Swap the socket BIO of the handshake for a pair of memory BIOs, so that
+ * SSL_write never blocks and the socket I/O stays with the agent, as in the
+ * TCP transport. Returns the bytes sent during the handshake.
+ */
+static uint32_t ssl_start_engine(struct tls_connection *tls_conn)
+{
+	uint32_t handshake_bytes;
+
+	handshake_bytes = BIO_number_written(SSL_get_wbio(tls_conn->ssl));
+
+	tls_conn->rbio = BIO_new(BIO_s_mem());
+	tls_conn->wbio = BIO_new(BIO_s_mem());
+	assert(tls_conn->rbio && tls_conn->wbio);
+	/* An empty rbio means SSL_ERROR_WANT_READ, not EOF */
+	BIO_set_mem_eof_return(tls_conn->rbio, -1);
+	SSL_set_bio(tls_conn->ssl, tls_conn->rbio, tls_conn->wbio);
+	tls_init_tx(tls_conn);
+
+	return handshake_bytes;
+}
+
+static void ktls_fallback(void)
+{
+	lancet_fprintf(stderr, "kTLS is not available, using user-space TLS\n");
+}
+
+static void ktls_rx_only(void)
+{
+	lancet_fprintf(stderr, "kTLS offloaded only the receive side, "
+						   "encrypting in user space\n");
+}
+
+/*
+ * With -k OpenSSL hands the keys to the kernel at the end of the handshake,
+ * if the kernel has the tls module and supports the cipher. Returns 0 if
+ * either side was offloaded, and 1 if the connection has to fall back to the
+ * user-space engine.
+ */
+static int ssl_start_ktls(struct tls_connection *tls_conn)
+{
+	int ktls_send = 0, ktls_recv = 0;
+
+#ifndef OPENSSL_NO_KTLS
+	ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls_conn->ssl));
+	ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(tls_conn->ssl));
+#endif
+	if (ktls_send) {
+		tls_conn->ktls = KTLS_TX | (ktls_recv ? KTLS_RX : 0);
+		tls_init_tx(tls_conn);
+		return 0;
+	}
+	/*
+	 * The socket keeps the kernel receive side, the records to send are
+	 * built in user space through a memory write BIO, as without kTLS.
+	 */
+	if (ktls_recv) {
+		pthread_once(&ktls_rx_only_once, ktls_rx_only);
+		tls_conn->ktls = KTLS_RX;
+		tls_conn->wbio = BIO_new(BIO_s_mem());
+		assert(tls_conn->wbio);
+		SSL_set0_wbio(tls_conn->ssl, tls_conn->wbio);
+		tls_init_tx(tls_conn);
+		return 0;
+	}
+	pthread_once(&ktls_fallback_once, ktls_fallback);
+	return 1;
+}
+
+static void tls_release(struct tls_connection *tls_conn)
+{
+	SSL_free(tls_conn->ssl);
+	tls_conn->ssl = NULL;
+	tls_conn->rbio = NULL;
+	tls_conn->wbio = NULL;
+	tls_conn->ktls = 0;
+	free(tls_conn->tx_buf);
+	tls_conn->tx_buf = NULL;
+}
+
+static void tls_close(struct tls_connection *tls_conn)
+{
+	tls_release(tls_conn);
+	close(tls_conn->conn.fd);
+	lancet_fprintf(stderr, "Connection closed\n");
+	tls_conn->conn.closed = 1;
+	conn_sched_close(&sched, tls_conn->conn.idx);
+}
+
+static int tls_arm_tx(struct tls_connection *tls_conn, uint32_t armed)
+{
+	struct epoll_event event;
+
+	if (tls_conn->tx_armed == armed)
+		return 0;
+	event.events = armed ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.u32 = tls_conn->conn.idx;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, tls_conn->conn.fd, &event)) {
+		lancet_perror("Error while modifying epoll group");
+		return -1;
+	}
+	tls_conn->tx_armed = armed;
+	return 0;
+}
+
+static char *tls_tx_reserve(struct tls_connection *tls_conn, uint32_t len)
+{
+	if (tls_conn->tx_len + len > tls_conn->tx_size) {
+		while (tls_conn->tx_len + len > tls_conn->tx_size)
+			tls_conn->tx_size *= 2;
+		tls_conn->tx_buf = realloc(tls_conn->tx_buf, tls_conn->tx_size);
+		assert(tls_conn->tx_buf);
+	}
+	return &tls_conn->tx_buf[tls_conn->tx_len];
+}
+
+/*
+ * Move the records the SSL engine produced to the socket. What does not fit
+ * in the socket buffer is sent on EPOLLOUT.
+ */
+static int tls_flush(struct tls_connection *tls_conn)
+{
+	int ret;
+	uint32_t pending;
+
+	pending =
+		(tls_conn->ktls & KTLS_TX) ? 0 : BIO_ctrl_pending(tls_conn->wbio);
+	if (pending) {
+		ret = BIO_read(tls_conn->wbio, tls_tx_reserve(tls_conn, pending),
+					   pending);
+		assert(ret == pending);
+		tls_conn->tx_len += pending;
+	}
+
+	while (tls_conn->tx_len) {
+		ret = send(tls_conn->conn.fd, tls_conn->tx_buf, tls_conn->tx_len, 0);
+		if ((ret < 0) && (errno != EWOULDBLOCK)) {
+			lancet_perror("Unknown connection error write\n");
+			return -1;
+		}
+		if (ret < 0)
+			break;
+		tls_conn->tx_len -= ret;
+		memmove(tls_conn->tx_buf, &tls_conn->tx_buf[ret], tls_conn->tx_len);
+	}
+	return tls_arm_tx(tls_conn, tls_conn->tx_len > 0);
+}
+
+/*
+ * Write a request as plaintext to a kTLS socket, which builds the records.
+ * What the socket does not take is queued behind the earlier requests.
+ */
+static int ktls_send(struct tls_connection *tls_conn, struct request *to_send)
+{
+	int i, ret = 0, bytes_to_send = 0;
+	uint32_t len;
+
+	for (i = 0; i < to_send->iov_cnt; i++)
+		bytes_to_send += to_send->iovs[i].iov_len;
+
+	if (!tls_conn->tx_len) {
+		ret = writev(tls_conn->conn.fd, to_send->iovs, to_send->iov_cnt);
+		if ((ret < 0) && (errno != EWOULDBLOCK)) {
+			lancet_perror("Unknown connection error write\n");
+			return -1;
+		}
+		if (ret == bytes_to_send)
+			return ret;
+		if (ret < 0)
+			ret = 0;
+	}
+
+	for (i = 0; i < to_send->iov_cnt; i++) {
+		len = to_send->iovs[i].iov_len;
+		if (ret >= len) {
+			ret -= len;
+			continue;
+		}
+		memcpy(tls_tx_reserve(tls_conn, len - ret),
+			   (char *)to_send->iovs[i].iov_base + ret, len - ret);
+		tls_conn->tx_len += len - ret;
+		ret = 0;
+	}
+	if (tls_flush(tls_conn))
+		return -1;
+	return bytes_to_send;
+}
+
+/*
+ * Encrypt a request as one record and send it. Returns the request bytes,
+ * record_bytes is set to the bytes that go on the wire.
+ */
+static int tls_send(struct tls_connection *tls_conn, struct request *to_send,
+					uint32_t *record_bytes)
+{
+	int i, ret, err;
+	uint32_t bytes_to_send, copied;
+
+	if (tls_conn->ktls & KTLS_TX)
+		return ktls_send(tls_conn, to_send);
+
+	bytes_to_send = 0;
+	for (i = 0; i < to_send->iov_cnt; i++)
+		bytes_to_send += to_send->iovs[i].iov_len;
+
+	if (bytes_to_send > wbuf_size) {
+		free(wbuf);
+		wbuf = malloc(bytes_to_send);
+		assert(wbuf);
+		wbuf_size = bytes_to_send;
+	}
+
+	copied = 0;
+	for (i = 0; i < to_send->iov_cnt; i++) {
+		memcpy(&wbuf[copied], to_send->iovs[i].iov_base,
+			   to_send->iovs[i].iov_len);
+		copied += to_send->iovs[i].iov_len;
+	}
+	assert(copied == bytes_to_send);
+
+	ret = SSL_write(tls_conn->ssl, wbuf, bytes_to_send);
+	if (ret <= 0) {
+		/*
+		 * The memory BIO takes every record, so wanting I/O can only mean
+		 * that the engine waits for the peer; the socket is handled by
+		 * tls_flush and tls_recv.
+		 */
+		err = SSL_get_error(tls_conn->ssl, ret);
+		lancet_fprintf(stderr, "SSL_write failed %d\n", err);
+		return -1;
+	}
+	assert(ret == bytes_to_send);
+
+	if (record_bytes)
+		*record_bytes = BIO_ctrl_pending(tls_conn->wbio);
+	if (tls_flush(tls_conn))
+		return -1;
+	return ret;
+}
+
+/*
+ * Read the available records of the socket and decrypt them into the
+ * connection buffer, for handle_response. A record may carry several
+ * responses or part of one. With kTLS SSL_read reads the socket itself.
+ * Returns the decrypted bytes, closing the connection if the peer did.
+ */
+static int tls_recv(struct tls_connection *tls_conn,
+					struct timestamp_info *rx_timestamp)
+{
+	int ret, err, decrypted = 0;
+	char *rx_buf;
+	uint32_t room;
+
+	if (tls_conn->ktls)
+		ret = -1;
+	else if (rx_timestamp)
+		ret = timestamp_recv(tls_conn->conn.fd, record_buf, TLS_RECORD_BUF_SIZE,
+							 0, rx_timestamp);
+	else
+		ret = recv(tls_conn->conn.fd, record_buf, TLS_RECORD_BUF_SIZE, 0);
+	if ((ret < 0) && !tls_conn->ktls && (errno != EWOULDBLOCK)) {
+		lancet_perror("Unknown connection error read\n");
+		return -1;
+	}
+	if (ret == 0) {
+		tls_close(tls_conn);
+		return 0;
+	}
+	if (ret > 0) {
+		err = BIO_write(tls_conn->rbio, record_buf, ret);
+		assert(err == ret);
+	}
+
+	/* Drain the engine, it may hold more than one record */
+	while (1) {
+		rx_buf = tcp_rx_reserve(&tls_conn->conn, &room);
+		ret = SSL_read(tls_conn->ssl, rx_buf, room);
+		if (ret > 0) {
+			tls_conn->conn.buffer_end += ret;
+			decrypted += ret;
+			continue;
+		}
+		err = SSL_get_error(tls_conn->ssl, ret);
+		if (err == SSL_ERROR_WANT_READ)
+			break;
+		if (err == SSL_ERROR_WANT_WRITE) {
+			/* e.g. a key update to answer */
+			if (tls_flush(tls_conn))
+				return -1;
+			continue;
+		}
+		if (err == SSL_ERROR_ZERO_RETURN) {
+			tls_close(tls_conn);
+			return 0;
+		}
+		lancet_fprintf(stderr, "Unexpected SSL error %d\n", err);
+		return -1;
+	}
+
+	/* Post-handshake messages may have produced records to send */
+	if (!(tls_conn->ktls & KTLS_TX) && BIO_ctrl_pending(tls_conn->wbio) &&
+		tls_flush(tls_conn))
+		return -1;
+	return decrypted;
+}
+
 static int throughput_open_connections(void)
 {
 	/*init epoll*/
-	struct sockaddr_in addr;
-	int i, efd, ret, sock, per_thread_conn, dest_idx, n;
-	int one = 1;
+	int i, efd, ret, per_thread_conn, flags;
+	int *fds;
+	uint32_t handshake_bytes;
 	struct epoll_event event;
-	struct linger linger;
-	struct host_tuple *targets;
 
-	addr.sin_family = AF_INET;
 	efd = epoll_create(1);
 	if (efd < 0) {
 		lancet_perror("epoll_create error");
 		return -1;
 	}
+	epoll_fd = efd;
 
 	per_thread_conn = get_conn_count() / get_thread_count();
 	connections = calloc(per_thread_conn, sizeof(struct tls_connection));
 	assert(connections);
-	if ((get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) ||
-		(get_agent_type() == SYMMETRIC_AGENT)) {
+	if (get_agent_type() != THROUGHPUT_AGENT) {
 		per_conn_tx_timestamps =
 			calloc(per_thread_conn, sizeof(struct pending_tx_timestamps));
 		assert(per_conn_tx_timestamps);
@@ -125,126 +461,150 @@ static int throughput_open_connections(void)
 			assert(per_conn_tx_timestamps[i].pending);
 		}
 	}
-	targets = get_targets();
+	churn_reqs = get_churn_reqs();
+	record_buf = malloc(TLS_RECORD_BUF_SIZE);
+	wbuf_size = 512;
+	wbuf = malloc(wbuf_size);
+	assert(record_buf && wbuf);
 
-	for (i = 0; i < per_thread_conn; i++) {
-		sock = socket(AF_INET, SOCK_STREAM, 0);
-		if (sock == -1) {
-			lancet_perror("Error creating socket");
-			return -1;
-		}
-		dest_idx = i % get_target_count();
-		addr.sin_port = htons(targets[dest_idx].port);
-		addr.sin_addr.s_addr = targets[dest_idx].ip;
-		ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-		if (ret) {
-			lancet_perror("Error connecting");
-			return -1;
-		}
+	fds = malloc(per_thread_conn * sizeof(int));
+	assert(fds);
+	if (tcp_open_sockets(fds, per_thread_conn))
+		return -1;
 
-		connections[i].conn.fd = sock;
+	for (i = 0; i < per_thread_conn; i++) {
+		connections[i].conn.fd = fds[i];
 		connections[i].conn.pending_reqs = 0;
 		connections[i].conn.idx = i;
-		connections[i].conn.buffer_idx = 0;
 		connections[i].conn.closed = 0;
+		connections[i].conn.churn_left = churn_reqs;
 
 		/* Init connection in blocking mode */
-		if (ssl_init_connection(&connections[i]))
-			return -1;
-
-		ret = fcntl(sock, F_SETFL, O_NONBLOCK);
+		flags = fcntl(fds[i], F_GETFL);
+		ret = fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK);
 		if (ret == -1) {
-			lancet_perror("Error while setting nonblocking");
+			lancet_perror("Error while setting blocking");
 			return -1;
 		}
-
-		n = 524288;
-		ret = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n));
-		if (ret) {
-			lancet_perror("Error setsockopt");
+		if (ssl_init_connection(&connections[i]))
 			return -1;
-		}
-		n = 524288;
-		ret = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
-		if (ret) {
-			lancet_perror("Error setsockopt");
+		ret = fcntl(fds[i], F_SETFL, flags | O_NONBLOCK);
+		if (ret == -1) {
+			lancet_perror("Error while setting nonblocking");
 			return -1;
 		}
-
-		if (get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) {
-			if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, get_if_name(),
-						   strlen(get_if_name()))) {
-				lancet_perror("setsockopt SO_BINDTODEVICE");
-				return -1;
-			}
-			ret = sock_enable_timestamping(sock);
-			if (ret) {
-				lancet_fprintf(stderr, "sock enable timestamping failed\n");
-				return -1;
-			}
-		}
-
-		/* Disable Nagle's algorithm */
-		ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		ret = get_ktls() ? ssl_start_ktls(&connections[i]) : 1;
 		if (ret) {
-			lancet_perror("Error setsockopt");
-			return -1;
-		}
-
-		/* Close with RST not FIN */
-		linger.l_onoff = 1;
-		linger.l_linger = 0;
-		if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&linger,
-					   sizeof(linger))) {
-			perror("setsockopt(SO_LINGER)");
-			exit(1);
+			handshake_bytes = ssl_start_engine(&connections[i]);
+			/* NIC tx timestamps count the handshake records too */
+			if (per_conn_tx_timestamps)
+				per_conn_tx_timestamps[i].tx_byte_counter = handshake_bytes;
 		}
 
 		event.events = EPOLLIN;
 		event.data.u32 = i;
-		ret = epoll_ctl(efd, EPOLL_CTL_ADD, sock, &event);
+		ret = epoll_ctl(efd, EPOLL_CTL_ADD, fds[i], &event);
 		if (ret) {
 			lancet_perror("Error while adding to epoll group");
 			return -1;
 		}
 	}
-	epoll_fd = efd;
+	free(fds);
+	return shard_sched_init(&sched, per_thread_conn, get_max_pending_reqs());
+}
+
+static int tls_set_events(struct tls_connection *tls_conn, uint32_t events)
+{
+	struct epoll_event event;
+
+	event.events = events;
+	event.data.u32 = tls_conn->conn.idx;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, tls_conn->conn.fd, &event)) {
+		lancet_perror("Error while modifying epoll group");
+		return -1;
+	}
 	return 0;
 }
 
-static void throughput_ssl_main(void)
+/*
+ * Churn: a connection that used up its requests leaves the schedule and is
+ * reopened once their replies are in. The handshake of the new connection
+ * is driven by the epoll loop, then it rejoins the schedule.
+ */
+static inline void churn_sent(struct tls_connection *tls_conn)
 {
-	lancet_fprintf(stderr, "throughput_ssl_main not implemented\n");
-	assert(0);
+	if (churn_reqs && --tls_conn->conn.churn_left == 0)
+		conn_sched_pause(&sched, tls_conn->conn.idx);
 }
 
-static void latency_ssl_main(void)
+static int churn_replied(struct tls_connection *tls_conn)
 {
-	lancet_fprintf(stderr, "latency_ssl_main not implemented\n");
-	assert(0);
+	if (!churn_reqs || tls_conn->conn.churn_left ||
+		tls_conn->conn.pending_reqs)
+		return 0;
+	if (get_tls_resume()) {
+		SSL_SESSION_free(tls_conn->session);
+		tls_conn->session = SSL_get1_session(tls_conn->ssl);
+	}
+	/* Without close_notify the session would not be resumable */
+	SSL_shutdown(tls_conn->ssl);
+	if (tls_flush(tls_conn))
+		return -1;
+	tls_release(tls_conn);
+	return tcp_reopen(&tls_conn->conn, epoll_fd);
 }
 
-static void symmetric_nic_ssl_main(void)
+static int churn_handshake(struct tls_connection *tls_conn)
+{
+	int ret, err;
+
+	ret = SSL_connect(tls_conn->ssl);
+	if (ret <= 0) {
+		err = SSL_get_error(tls_conn->ssl, ret);
+		if (err == SSL_ERROR_WANT_READ)
+			return tls_set_events(tls_conn, EPOLLIN);
+		if (err == SSL_ERROR_WANT_WRITE)
+			return tls_set_events(tls_conn, EPOLLOUT);
+		lancet_fprintf(stderr, "Failed to ssl connect %d\n", err);
+		return -1;
+	}
+
+	add_handshake_sample(time_ns() - tls_conn->handshake_start,
+						 SSL_session_reused(tls_conn->ssl));
+	tls_conn->handshaking = 0;
+	ret = get_ktls() ? ssl_start_ktls(tls_conn) : 1;
+	if (ret)
+		ssl_start_engine(tls_conn);
+	if (tls_set_events(tls_conn, EPOLLIN))
+		return -1;
+	tls_conn->conn.churn_left = churn_reqs;
+	conn_sched_resume(&sched, tls_conn->conn.idx);
+	return 0;
+}
+
+static int churn_progress(struct tls_connection *tls_conn)
 {
-	lancet_fprintf(stderr, "symmetric_nic_ssl_main not implemented\n");
-	assert(0);
+	if (tls_conn->handshaking)
+		return churn_handshake(tls_conn);
+
+	if (tcp_reopen_complete(&tls_conn->conn, epoll_fd))
+		return -1;
+	ssl_new_connection(tls_conn);
+	tls_conn->handshaking = 1;
+	tls_conn->handshake_start = time_ns();
+	return churn_handshake(tls_conn);
 }
 
-static void symmetric_ssl_main(void)
+static void throughput_ssl_main(void)
 {
-	int ready, idx, i, j, conn_per_thread, ret, bytes_to_send;
-	long next_tx, copied;
+	int ready, idx, i, conn_per_thread, ret;
+	long next_tx;
 	struct epoll_event *events;
 	struct tls_connection *conn;
 	struct request *to_send;
 	struct byte_req_pair read_res;
 	struct byte_req_pair send_res;
-	struct timespec tx_timestamp, rx_timestamp, latency;
-	struct timestamp_info *pending_tx;
-	char *wbuf;
-	uint64_t wbuf_size = 512;
-
-	wbuf = malloc(wbuf_size);
+	struct timespec tx_timestamp;
 
 	if (throughput_open_connections())
 		return;
@@ -254,108 +614,354 @@ static void symmetric_ssl_main(void)
 	events = malloc(conn_per_thread * sizeof(struct epoll_event));
 
 	pthread_barrier_wait(&conn_open_barrier);
-	set_conn_open(1);
 
 	next_tx = time_ns();
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
+			backlog_clear();
 			continue;
 		}
-		while (time_ns() >= next_tx) {
+		backlog_fill(&next_tx);
+		while (backlog_count()) {
 			conn = pick_conn();
 			if (!conn)
 				goto REP_PROC;
+			backlog_pop();
 			to_send = prepare_request();
+			ret = tls_send(conn, to_send, NULL);
+			if (ret < 0)
+				return;
+			conn->conn.pending_reqs++;
+			churn_sent(conn);
+			time_ns_to_ts(&tx_timestamp);
+			add_tx_timestamp(&tx_timestamp);
 
-			bytes_to_send = 0;
-			for (i = 0; i < to_send->iov_cnt; i++)
-				bytes_to_send += to_send->iovs[i].iov_len;
-
-			if (bytes_to_send > wbuf_size) {
-				free(wbuf);
-				wbuf = malloc(bytes_to_send);
-				wbuf_size = bytes_to_send;
+			/*BookKeeping*/
+			send_res.bytes = ret;
+			send_res.reqs = 1;
+			add_throughput_tx_sample(send_res);
+		}
+	REP_PROC:
+		/* process responses */
+		ready = epoll_wait(epoll_fd, events, conn_per_thread, 0);
+		for (i = 0; i < ready; i++) {
+			idx = events[i].data.u32;
+			conn = &connections[idx];
+			if (conn->conn.reopen_start || conn->handshaking) {
+				if (churn_progress(conn))
+					return;
+				continue;
 			}
+			if ((events[i].events & EPOLLOUT) && tls_flush(conn))
+				return;
+			if (!(events[i].events & EPOLLIN))
+				continue;
+			ret = tls_recv(conn, NULL);
+			if (ret < 0)
+				return;
+			if (ret == 0)
+				continue;
 
-			copied = 0;
-			for (i = 0; i < to_send->iov_cnt; i++) {
-				memcpy(&wbuf[copied], to_send->iovs[i].iov_base,
-					   to_send->iovs[i].iov_len);
-				copied += to_send->iovs[i].iov_len;
+			read_res = handle_response(&conn->conn);
+			if (read_res.reqs > 0) {
+				conn->conn.pending_reqs -= read_res.reqs;
+				conn_sched_put(&sched, conn->conn.idx, read_res.reqs);
+				/* Bookkeeping */
+				add_throughput_rx_sample(read_res);
+				if (churn_replied(conn))
+					return;
 			}
-			assert(copied == bytes_to_send);
+		}
+	}
+}
+
+static void symmetric_ssl_main(void);
+
+static void latency_ssl_main(void)
+{
+	int ret;
+	long start_time, end_time, next_tx, sched_delay;
+	struct tls_connection *conn;
+	struct request *to_send;
+	struct byte_req_pair read_res;
+	struct byte_req_pair send_res;
 
-			int ret = SSL_write(conn->ssl, wbuf, bytes_to_send);
+	/* Pipelined latency requests run open loop, as over TCP */
+	if (get_max_pending_reqs() > 1) {
+		symmetric_ssl_main();
+		return;
+	}
 
-			assert(ret == bytes_to_send);
+	if (throughput_open_connections())
+		exit(-1);
 
-			time_ns_to_ts(&tx_timestamp);
-			push_complete_tx_timestamp(&per_conn_tx_timestamps[conn->conn.idx],
-									   &tx_timestamp);
+	next_tx = time_ns();
+	while (1) {
+		if (!should_load()) {
+			next_tx = time_ns();
+			continue;
+		}
+		if (time_ns() < next_tx) {
+			pace_wait(next_tx);
+			continue;
+		}
+		conn = pick_conn();
+		if (!conn)
+			continue;
+
+		to_send = prepare_request();
+		start_time = time_ns();
+		/* The agent is closed loop, lateness only counts with -d */
+		sched_delay = get_intended_latency() ? start_time - next_tx : 0;
+		ret = tls_send(conn, to_send, NULL);
+		if (ret < 0)
+			return;
+		/* Bookkeeping */
+		send_res.bytes = ret;
+		send_res.reqs = 1;
+		add_throughput_tx_sample(send_res);
+
+		/* Spin on the non-blocking socket until the reply is complete */
+		read_res.reqs = 0;
+		while (!read_res.reqs && !conn->conn.closed) {
+			if (conn->tx_len && tls_flush(conn))
+				return;
+			ret = tls_recv(conn, NULL);
+			if (ret < 0)
+				return;
+			if (ret > 0)
+				read_res = handle_response(&conn->conn);
+		}
+		if (conn->conn.closed)
+			continue;
+
+		end_time = time_ns();
+		conn_sched_put(&sched, conn->conn.idx, read_res.reqs);
+		/*BookKeeping*/
+		add_throughput_rx_sample(read_res);
+		add_latency_sample((end_time - start_time), sched_delay, NULL,
+						   to_send->op_class);
+
+		/*Schedule next*/
+		next_tx += get_ia();
+	}
+}
+
+static void symmetric_nic_ssl_main(void)
+{
+	int ready, idx, i, j, conn_per_thread, ret;
+	long next_tx, intended;
+	struct epoll_event *events;
+	struct tls_connection *conn;
+	struct request *to_send;
+	struct byte_req_pair read_res;
+	struct byte_req_pair send_res;
+	struct timestamp_info rx_timestamp, *tx_timestamp;
+	struct timespec latency;
+	uint32_t record_bytes;
+
+	if (throughput_open_connections())
+		return;
+
+	/*Initializations*/
+	conn_per_thread = get_conn_count() / get_thread_count();
+	events = malloc(conn_per_thread * sizeof(struct epoll_event));
+
+	pthread_barrier_wait(&conn_open_barrier);
+
+	next_tx = time_ns();
+	while (1) {
+		if (!should_load()) {
+			next_tx = time_ns();
+			backlog_clear();
+			continue;
+		}
+		backlog_fill(&next_tx);
+		if (backlog_count()) {
+			conn = pick_conn();
+			if (!conn)
+				goto REP_PROC;
+			intended = backlog_pop();
+
+			to_send = prepare_request();
+			ret = tls_send(conn, to_send, &record_bytes);
+			if (ret < 0)
+				return;
+			/* The kernel numbers the tx timestamps by the record bytes */
+			/* Wire to wire unless -d, the wait is in the backlog stats */
+			add_pending_tx_timestamp(
+				&per_conn_tx_timestamps[conn->conn.idx], record_bytes,
+				get_intended_latency() ? time_ns() - intended : 0,
+				to_send->op_class);
 			conn->conn.pending_reqs++;
 
 			/*BookKeeping*/
 			send_res.bytes = ret;
 			send_res.reqs = 1;
 			add_throughput_tx_sample(send_res);
-
-			/*Schedule next*/
-			next_tx += get_ia();
 		}
-
 	REP_PROC:
 		/* process responses */
 		ready = epoll_wait(epoll_fd, events, conn_per_thread, 0);
 		for (i = 0; i < ready; i++) {
 			idx = events[i].data.u32;
 			conn = &connections[idx];
-			/* Handle incoming packet */
-			assert(events[i].events & EPOLLIN);
-
-			// read into the connection buffer
-			ret = SSL_read(conn->ssl, &conn->conn.buffer[conn->conn.buffer_idx],
-						   MAX_PAYLOAD - conn->conn.buffer_idx);
-			if (ret <= 0) {
-				int ssl_err = SSL_get_error(conn->ssl, ret);
-				if (ssl_err == SSL_ERROR_WANT_READ)
-					continue;
-
-				if (ret == 0) {
-					SSL_shutdown(conn->ssl);
-					SSL_free(conn->ssl);
-					close(conn->conn.fd);
-					conn->conn.closed = 1;
-					continue;
+			if (events[i].events & EPOLLERR) {
+				/* Get tx timetamps */
+				get_tx_timestamp(conn->conn.fd,
+								 &per_conn_tx_timestamps[conn->conn.idx]);
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && tls_flush(conn))
+				return;
+			if (!(events[i].events & EPOLLIN))
+				continue;
+			ret = tls_recv(conn, &rx_timestamp);
+			if (ret < 0)
+				return;
+			if (ret == 0)
+				continue;
+			read_res = handle_response(&conn->conn);
+			if (read_res.reqs == 0)
+				continue;
+
+			conn->conn.pending_reqs -= read_res.reqs;
+			conn_sched_put(&sched, conn->conn.idx, read_res.reqs);
+
+			/* Every reply of the read is sampled against its rx timestamp */
+			for (j = 0; j < read_res.reqs; j++) {
+				tx_timestamp = pop_pending_tx_timestamps(
+					&per_conn_tx_timestamps[conn->conn.idx]);
+				if (!tx_timestamp) {
+					ret = get_tx_timestamp(
+						conn->conn.fd, &per_conn_tx_timestamps[conn->conn.idx]);
+					while (ret != 1)
+						ret = get_tx_timestamp(
+							conn->conn.fd,
+							&per_conn_tx_timestamps[conn->conn.idx]);
+					tx_timestamp = pop_pending_tx_timestamps(
+						&per_conn_tx_timestamps[conn->conn.idx]);
+					assert(tx_timestamp);
 				}
+				ret = timespec_diff(&latency, &rx_timestamp.time,
+									&tx_timestamp->time);
+				assert(ret == 0);
+				long diff = latency.tv_nsec + latency.tv_sec * 1e9;
+				add_latency_sample(diff, tx_timestamp->sched_delay,
+								   &tx_timestamp->time, tx_timestamp->op_class);
+			}
+
+			/* Bookkeeping */
+			add_throughput_rx_sample(read_res);
+
+			if ((time_ns() - next_tx) > 0)
+				break;
+		}
+	}
+}
+
+static void symmetric_ssl_main(void)
+{
+	int ready, idx, i, j, conn_per_thread, ret;
+	long next_tx, intended, now;
+	struct epoll_event *events;
+	struct tls_connection *conn;
+	struct request *to_send;
+	struct byte_req_pair read_res;
+	struct byte_req_pair send_res;
+	struct timespec tx_timestamp, rx_timestamp, latency;
+	struct timestamp_info *pending_tx;
+
+	if (throughput_open_connections())
+		return;
 
-				lancet_fprintf(stderr, "Unexpected SSL error %d\n", ssl_err);
+	/*Initializations*/
+	conn_per_thread = get_conn_count() / get_thread_count();
+	events = malloc(conn_per_thread * sizeof(struct epoll_event));
+
+	pthread_barrier_wait(&conn_open_barrier);
+
+	next_tx = time_ns();
+	while (1) {
+		if (!should_load()) {
+			next_tx = time_ns();
+			backlog_clear();
+			continue;
+		}
+		backlog_fill(&next_tx);
+		while (backlog_count()) {
+			conn = pick_conn();
+			if (!conn)
+				goto REP_PROC;
+			intended = backlog_pop();
+			to_send = prepare_request();
+
+			ret = tls_send(conn, to_send, NULL);
+			if (ret < 0)
 				return;
-			}
 
+			now = time_ns();
+			ns_to_ts(now, &tx_timestamp);
+			push_complete_tx_timestamp(&per_conn_tx_timestamps[conn->conn.idx],
+									   &tx_timestamp, now - intended,
+									   to_send->op_class);
+			conn->conn.pending_reqs++;
+			churn_sent(conn);
+
+			/*BookKeeping*/
+			send_res.bytes = ret;
+			send_res.reqs = 1;
+			add_throughput_tx_sample(send_res);
+		}
+
+	REP_PROC:
+		/* process responses */
+		ready = epoll_wait(epoll_fd, events, conn_per_thread, 0);
+		for (i = 0; i < ready; i++) {
+			idx = events[i].data.u32;
+			conn = &connections[idx];
+			if (conn->conn.reopen_start || conn->handshaking) {
+				if (churn_progress(conn))
+					return;
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && tls_flush(conn))
+				return;
+			if (!(events[i].events & EPOLLIN))
+				continue;
+			ret = tls_recv(conn, NULL);
+			if (ret < 0)
+				return;
+			if (ret == 0)
+				continue;
 			time_ns_to_ts(&rx_timestamp);
-			conn->conn.buffer_idx += ret;
 
 			read_res = handle_response(&conn->conn);
 			if (read_res.reqs == 0)
 				continue;
 
 			conn->conn.pending_reqs -= read_res.reqs;
+			conn_sched_put(&sched, conn->conn.idx, read_res.reqs);
 			/*
-			 * Assume only the last request will have an rx timestamp!
+			 * Every reply of the read is sampled against its rx timestamp,
+			 * with NIC timestamps the one of its last packet
 			 */
 			for (j = 0; j < read_res.reqs; j++) {
 				pending_tx = pop_pending_tx_timestamps(
 					&per_conn_tx_timestamps[conn->conn.idx]);
 				assert(pending_tx);
+				ret = timespec_diff(&latency, &rx_timestamp, &pending_tx->time);
+				assert(ret == 0);
+				long diff = latency.tv_nsec + latency.tv_sec * 1e9;
+				add_latency_sample(diff, pending_tx->sched_delay,
+								   &pending_tx->time, pending_tx->op_class);
 			}
-			ret = timespec_diff(&latency, &rx_timestamp, &pending_tx->time);
-			assert(ret == 0);
-			long diff = latency.tv_nsec + latency.tv_sec * 1e9;
-			add_latency_sample(diff, &pending_tx->time);
 
 			/* Bookkeeping */
 			add_throughput_rx_sample(read_res);
+			if (churn_replied(conn))
+				return;
 		}
 	}
 }
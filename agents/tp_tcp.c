@@ -30,94 +30,444 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
 
+#include <lancet/app_proto.h>
+#include <lancet/backlog.h>
+#include <lancet/buffer_pool.h>
+#include <lancet/conn_sched.h>
 #include <lancet/error.h>
 #include <lancet/misc.h>
+#include <lancet/shard.h>
 #include <lancet/timestamping.h>
 #include <lancet/tp_proto.h>
 
+/* Smaller values are cheaper to copy than to pin */
+#define ZEROCOPY_MIN_BYTES 16384
+
 static __thread struct tcp_connection *connections;
 static __thread int epoll_fd;
 static __thread struct pending_tx_timestamps *per_conn_tx_timestamps;
-static __thread uint32_t conn_idx = 0;
+static __thread struct conn_sched sched;
+static __thread int zerocopy;
+static __thread int churn_reqs;
+
+/* Socket type of the UNIX transports, 0 for TCP */
+static int unix_type;
+static int recv_flags;
 
 static inline struct tcp_connection *pick_conn()
 {
 	int idx;
-	struct tcp_connection *c;
 
-	// FIXME: Consider picking connection round robin
-	// idx = rand() % (get_conn_count() / get_thread_count()) ;
-	idx = conn_idx++ % (get_conn_count() / get_thread_count());
-	c = &connections[idx];
-	if ((c->pending_reqs < get_max_pending_reqs()) && (!c->closed))
-		return c;
+	idx = shard_sched_get(&sched);
+	if (idx < 0)
+		return NULL;
+	return &connections[idx];
+}
 
-	return NULL;
+/*
+ * Move the bytes left in the buffer of conn to the front of a buffer of at
+ * least size bytes from the pool.
+ */
+static void tcp_rx_move(struct tcp_connection *conn, uint32_t size)
+{
+	uint32_t used, actual;
+	char *buf;
+
+	used = conn->buffer_end - conn->buffer_start;
+	buf = buffer_pool_get(size, &actual);
+	if (!buf) {
+		lancet_fprintf(stderr, "partial response of %u bytes does "
+							   "not fit in the largest buffer\n",
+					   used);
+		assert(0);
+	}
+	memcpy(buf, &conn->buffer[conn->buffer_start], used);
+	buffer_pool_put(conn->buffer, conn->buffer_size);
+	conn->buffer = buf;
+	conn->buffer_size = actual;
+	conn->buffer_start = 0;
+	conn->buffer_end = used;
 }
 
-static int latency_open_connections(void)
+/*
+ * Receive into the buffer of conn. A SOCK_SEQPACKET socket drops the part of
+ * a message that does not fit, so the length of the next message is peeked
+ * first and the buffer grows to hold it. With MSG_TRUNC recv returns the full
+ * length so a loss would not be silent.
+ */
+static inline int conn_recv(struct tcp_connection *conn)
 {
-	struct sockaddr_in addr;
-	int i, ret, sock, per_thread_conn, million = 1e6, one = 1, dest_idx;
+	uint32_t room;
+	char *buf;
+	int ret;
+
+	buf = tcp_rx_reserve(conn, &room);
+	if (unix_type == SOCK_SEQPACKET) {
+		ret = recv(conn->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (ret <= 0)
+			return ret;
+		if (ret > (int)room) {
+			tcp_rx_move(conn, conn->buffer_end - conn->buffer_start + ret);
+			buf = &conn->buffer[conn->buffer_end];
+			room = conn->buffer_size - conn->buffer_end;
+		}
+	}
+	ret = recv(conn->fd, buf, room, recv_flags);
+	if (ret > (int)room) {
+		lancet_fprintf(stderr, "Message of %d bytes truncated to %u\n", ret,
+					   room);
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return ret;
+}
+
+static int latency_socket_setup(int sock)
+{
+	int ret, million = 1e6, one = 1;
 	struct linger linger;
-	struct host_tuple *targets;
 
-	addr.sin_family = AF_INET;
+	/* Nothing to tune on UNIX sockets */
+	if (unix_type)
+		return 0;
 
-	per_thread_conn = get_conn_count() / get_thread_count();
-	connections = calloc(per_thread_conn, sizeof(struct tcp_connection));
-	targets = get_targets();
+	/* Disable Nagle */
+	ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (ret) {
+		lancet_perror("Error setsockopt TCP_NODELAY");
+		return -1;
+	}
+	/* Close with RST not FIN */
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&linger,
+				   sizeof(linger))) {
+		perror("setsockopt(SO_LINGER)");
+		exit(1);
+	}
+	/* Enable busy polling */
+	ret = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &million,
+					 sizeof(million));
+	if (ret) {
+		lancet_perror("Error setsockopt SO_BUSY_POLL");
+		return -1;
+	}
+	return 0;
+}
 
-	for (i = 0; i < per_thread_conn; i++) {
-		sock = socket(AF_INET, SOCK_STREAM, 0);
-		if (sock == -1) {
-			lancet_perror("Error creating socket");
+static int throughput_socket_setup(int sock)
+{
+	int ret, n, one = 1, million = 1e6;
+	struct linger linger;
+
+	ret = fcntl(sock, F_SETFL, O_NONBLOCK);
+	if (ret == -1) {
+		lancet_perror("Error while setting nonblocking");
+		return -1;
+	}
+	n = 524288;
+	ret = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n));
+	if (ret) {
+		lancet_perror("Error setsockopt");
+		return -1;
+	}
+	n = 524288;
+	ret = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
+	if (ret) {
+		lancet_perror("Error setsockopt");
+		return -1;
+	}
+
+	if (get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) {
+		if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, get_if_name(),
+					   strlen(get_if_name()))) {
+			lancet_perror("setsockopt SO_BINDTODEVICE");
 			return -1;
 		}
-		dest_idx = i % get_target_count();
-		addr.sin_port = htons(targets[dest_idx].port);
-		addr.sin_addr.s_addr = targets[dest_idx].ip;
-		ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+		ret = sock_enable_timestamping(sock);
 		if (ret) {
-			lancet_perror("Error connecting");
+			lancet_fprintf(stderr, "sock enable timestamping failed\n");
 			return -1;
 		}
-		/* Disable Nagle */
-		ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	if (get_zerocopy()) {
+		ret = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
 		if (ret) {
-			lancet_perror("Error setsockopt TCP_NODELAY");
+			lancet_perror("Error setsockopt SO_ZEROCOPY");
 			return -1;
 		}
-		/* Close with RST not FIN */
-		linger.l_onoff = 1;
-		linger.l_linger = 0;
-		if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&linger,
-					   sizeof(linger))) {
-			perror("setsockopt(SO_LINGER)");
-			exit(1);
-		}
-		/* Enable busy polling */
+	}
+
+	/* The remaining options only apply to TCP */
+	if (unix_type)
+		return 0;
+
+	/* The pipelined latency agent keeps busy polling */
+	if (get_agent_type() == LATENCY_AGENT) {
 		ret = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &million,
 						 sizeof(million));
 		if (ret) {
 			lancet_perror("Error setsockopt SO_BUSY_POLL");
 			return -1;
 		}
-		connections[i].fd = sock;
+	}
+
+	/* Disable Nagle's algorithm */
+	ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (ret) {
+		lancet_perror("Error setsockopt");
+		return -1;
+	}
+
+	/* Close with RST not FIN */
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&linger,
+				   sizeof(linger))) {
+		perror("setsockopt(SO_LINGER)");
+		exit(1);
+	}
+	return 0;
+}
+
+static int new_socket(void)
+{
+	if (unix_type)
+		return socket(AF_UNIX, unix_type, 0);
+	return socket(AF_INET, SOCK_STREAM, 0);
+}
+
+/*
+ * Fill addr with the target of connection idx and return its length. The
+ * UNIX transports map a leading @ to the abstract namespace.
+ */
+static socklen_t target_addr(int idx, struct sockaddr_storage *addr)
+{
+	struct sockaddr_in *in_addr = (struct sockaddr_in *)addr;
+	struct sockaddr_un *un_addr = (struct sockaddr_un *)addr;
+	struct host_tuple *target;
+	char *path;
+
+	idx %= get_target_count();
+	if (unix_type) {
+		path = get_unix_path(idx);
+		un_addr->sun_family = AF_UNIX;
+		strcpy(un_addr->sun_path, path);
+		if (path[0] == '@')
+			un_addr->sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + strlen(path) +
+			   (path[0] != '@');
+	}
+	target = &get_targets()[idx];
+	in_addr->sin_family = AF_INET;
+	in_addr->sin_port = htons(target->port);
+	in_addr->sin_addr.s_addr = target->ip;
+	return sizeof(struct sockaddr_in);
+}
+
+/*
+ * Connect count sockets to the targets in waves of non-blocking connects,
+ * with at most get_conn_wave() handshakes in flight. Sockets are configured
+ * by setup before connecting and keep the blocking mode setup left them in.
+ * Progress is reported through the control block.
+ */
+static int connect_sockets(int *fds, int count, int (*setup)(int))
+{
+	struct sockaddr_storage addr;
+	struct epoll_event event, *events;
+	int i, ret, sock, efd, ready, err, wave;
+	int next = 0, inflight = 0, opened = 0, done;
+	int *flags;
+	socklen_t len;
+
+	wave = get_conn_wave();
+
+	efd = epoll_create(1);
+	if (efd < 0) {
+		lancet_perror("epoll_create error");
+		return -1;
+	}
+	events = malloc(wave * sizeof(struct epoll_event));
+	flags = malloc(count * sizeof(int));
+	assert(events && flags);
+
+	while (opened < count) {
+		/* Start a new wave of connects */
+		done = 0;
+		while (inflight < wave && next < count) {
+			sock = new_socket();
+			if (sock == -1) {
+				lancet_perror("Error creating socket");
+				return -1;
+			}
+			if (setup(sock))
+				return -1;
+			flags[next] = fcntl(sock, F_GETFL);
+			ret = fcntl(sock, F_SETFL, flags[next] | O_NONBLOCK);
+			if (ret == -1) {
+				lancet_perror("Error while setting nonblocking");
+				return -1;
+			}
+			fds[next] = sock;
+
+			len = target_addr(next, &addr);
+			ret = connect(sock, (struct sockaddr *)&addr, len);
+			if (ret == 0) {
+				fcntl(sock, F_SETFL, flags[next]);
+				done++;
+			} else if (errno == EINPROGRESS) {
+				event.events = EPOLLOUT;
+				event.data.u32 = next;
+				ret = epoll_ctl(efd, EPOLL_CTL_ADD, sock, &event);
+				if (ret) {
+					lancet_perror("Error while adding to epoll group");
+					return -1;
+				}
+				inflight++;
+			} else {
+				lancet_perror("Error connecting");
+				return -1;
+			}
+			next++;
+		}
+
+		/* Complete the handshakes of the current wave */
+		ready = epoll_wait(efd, events, wave, done ? 0 : 1000);
+		for (i = 0; i < ready; i++) {
+			sock = fds[events[i].data.u32];
+			len = sizeof(err);
+			ret = getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (ret || err) {
+				lancet_fprintf(stderr, "Error connecting: %s\n",
+							   strerror(ret ? errno : err));
+				return -1;
+			}
+			epoll_ctl(efd, EPOLL_CTL_DEL, sock, NULL);
+			fcntl(sock, F_SETFL, flags[events[i].data.u32]);
+			inflight--;
+			done++;
+		}
+		opened += done;
+		add_conn_open(done);
+	}
+
+	close(efd);
+	free(events);
+	free(flags);
+	return 0;
+}
+
+static int latency_open_connections(void)
+{
+	int i, per_thread_conn;
+	int *fds;
+
+	per_thread_conn = get_conn_count() / get_thread_count();
+	connections = calloc(per_thread_conn, sizeof(struct tcp_connection));
+	fds = malloc(per_thread_conn * sizeof(int));
+	assert(connections && fds);
+
+	if (connect_sockets(fds, per_thread_conn, latency_socket_setup))
+		return -1;
+
+	for (i = 0; i < per_thread_conn; i++) {
+		connections[i].fd = fds[i];
+		connections[i].idx = i;
 		connections[i].closed = 0;
-#if 0
-		if (dest_idx == 0)
-			t_ctx->connections[i].master_conn = NULL;
-		else
-			t_ctx->connections[i].master_conn = &t_ctx->connections[i - dest_idx];
-#endif
+	}
+	free(fds);
+	return shard_sched_init(&sched, per_thread_conn, get_max_pending_reqs());
+}
+
+/*
+ * Open count non-blocking connections with the options used by the
+ * throughput and symmetric agents. Shared with the transports that reuse the
+ * TCP connection setup.
+ */
+int tcp_open_sockets(int *fds, int count)
+{
+	return connect_sockets(fds, count, throughput_socket_setup);
+}
+
+/*
+ * Churn: close conn and start a non-blocking connect to the same target in
+ * its place. The new socket is in efd with EPOLLOUT and the same index, and
+ * tcp_reopen_complete has to be called when it fires.
+ */
+int tcp_reopen(struct tcp_connection *conn, int efd)
+{
+	struct sockaddr_storage addr;
+	struct epoll_event event;
+	socklen_t len;
+	int sock, ret;
+
+	assert(conn->buffer == NULL);
+	close(conn->fd);
+
+	sock = new_socket();
+	if (sock == -1) {
+		lancet_perror("Error creating socket");
+		return -1;
+	}
+	/*
+	 * A nonblocking AF_UNIX connect fails with EAGAIN on a full backlog
+	 * instead of completing later, so UNIX sockets connect before going
+	 * nonblocking. EPOLLOUT then fires right away.
+	 */
+	if (!unix_type && throughput_socket_setup(sock))
+		return -1;
+
+	len = target_addr(conn->idx, &addr);
+	conn->reopen_start = time_ns();
+	ret = connect(sock, (struct sockaddr *)&addr, len);
+	if (ret && errno != EINPROGRESS) {
+		lancet_perror("Error connecting");
+		return -1;
+	}
+	if (unix_type && throughput_socket_setup(sock))
+		return -1;
+	conn->fd = sock;
+
+	event.events = EPOLLOUT;
+	event.data.u32 = conn->idx;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, sock, &event)) {
+		lancet_perror("Error while adding to epoll group");
+		return -1;
+	}
+	return 0;
+}
+
+int tcp_reopen_complete(struct tcp_connection *conn, int efd)
+{
+	struct epoll_event event;
+	socklen_t len;
+	int ret, err;
+
+	len = sizeof(err);
+	ret = getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (ret || err) {
+		lancet_fprintf(stderr, "Error connecting: %s\n",
+					   strerror(ret ? errno : err));
+		return -1;
+	}
+	add_connect_sample(time_ns() - conn->reopen_start);
+	conn->reopen_start = 0;
+
+	event.events = EPOLLIN;
+	event.data.u32 = conn->idx;
+	if (epoll_ctl(efd, EPOLL_CTL_MOD, conn->fd, &event)) {
+		lancet_perror("Error while modifying epoll group");
+		return -1;
 	}
 	return 0;
 }
@@ -125,14 +475,10 @@ static int latency_open_connections(void)
 static int throughput_open_connections(void)
 {
 	/*init epoll*/
-	struct sockaddr_in addr;
-	int i, efd, ret, sock, per_thread_conn, dest_idx, n;
-	int one = 1;
+	int i, efd, ret, per_thread_conn;
+	int *fds;
 	struct epoll_event event;
-	struct linger linger;
-	struct host_tuple *targets;
 
-	addr.sin_family = AF_INET;
 	efd = epoll_create(1);
 	if (efd < 0) {
 		lancet_perror("epoll_create error");
@@ -142,8 +488,9 @@ static int throughput_open_connections(void)
 	per_thread_conn = get_conn_count() / get_thread_count();
 	connections = calloc(per_thread_conn, sizeof(struct tcp_connection));
 	assert(connections);
-	if ((get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) ||
-		(get_agent_type() == SYMMETRIC_AGENT)) {
+	zerocopy = get_zerocopy();
+	churn_reqs = get_churn_reqs();
+	if (get_agent_type() != THROUGHPUT_AGENT) {
 		per_conn_tx_timestamps =
 			calloc(per_thread_conn, sizeof(struct pending_tx_timestamps));
 		assert(per_conn_tx_timestamps);
@@ -153,82 +500,59 @@ static int throughput_open_connections(void)
 			assert(per_conn_tx_timestamps[i].pending);
 		}
 	}
-	targets = get_targets();
 
-	for (i = 0; i < per_thread_conn; i++) {
-		sock = socket(AF_INET, SOCK_STREAM, 0);
-		if (sock == -1) {
-			lancet_perror("Error creating socket");
-			return -1;
-		}
-		dest_idx = i % get_target_count();
-		addr.sin_port = htons(targets[dest_idx].port);
-		addr.sin_addr.s_addr = targets[dest_idx].ip;
-		ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-		if (ret) {
-			lancet_perror("Error connecting");
-			return -1;
-		}
-		ret = fcntl(sock, F_SETFL, O_NONBLOCK);
-		if (ret == -1) {
-			lancet_perror("Error while setting nonblocking");
-			return -1;
-		}
-		n = 524288;
-		ret = setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &n, sizeof(n));
-		if (ret) {
-			lancet_perror("Error setsockopt");
-			return -1;
-		}
-		n = 524288;
-		ret = setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &n, sizeof(n));
-		if (ret) {
-			lancet_perror("Error setsockopt");
-			return -1;
-		}
-
-		if (get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) {
-			if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, get_if_name(),
-						   strlen(get_if_name()))) {
-				lancet_perror("setsockopt SO_BINDTODEVICE");
-				return -1;
-			}
-			ret = sock_enable_timestamping(sock);
-			if (ret) {
-				lancet_fprintf(stderr, "sock enable timestamping failed\n");
-				return -1;
-			}
-		}
+	fds = malloc(per_thread_conn * sizeof(int));
+	assert(fds);
+	if (tcp_open_sockets(fds, per_thread_conn))
+		return -1;
 
-		/* Disable Nagle's algorithm */
-		ret = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
-		if (ret) {
-			lancet_perror("Error setsockopt");
-			return -1;
-		}
+	for (i = 0; i < per_thread_conn; i++) {
+		connections[i].fd = fds[i];
+		connections[i].pending_reqs = 0;
+		connections[i].idx = i;
+		connections[i].closed = 0;
+		connections[i].churn_left = churn_reqs;
 
-		/* Close with RST not FIN */
-		linger.l_onoff = 1;
-		linger.l_linger = 0;
-		if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (void *)&linger,
-					   sizeof(linger))) {
-			perror("setsockopt(SO_LINGER)");
-			exit(1);
-		}
 		event.events = EPOLLIN;
 		event.data.u32 = i;
-		ret = epoll_ctl(efd, EPOLL_CTL_ADD, sock, &event);
+		ret = epoll_ctl(efd, EPOLL_CTL_ADD, connections[i].fd, &event);
 		if (ret) {
 			lancet_perror("Error while adding to epoll group");
 			return -1;
 		}
-		connections[i].fd = sock;
-		connections[i].pending_reqs = 0;
-		connections[i].idx = i;
-		connections[i].buffer_idx = 0;
-		connections[i].closed = 0;
 	}
+	free(fds);
 	epoll_fd = efd;
+	return shard_sched_init(&sched, per_thread_conn, get_max_pending_reqs());
+}
+
+static void symmetric_tcp_main(void);
+static void send_request(struct request *to_send, uint32_t fd);
+static void reap_zerocopy(int fd);
+
+/*
+ * Churn: a connection that used up its requests leaves the schedule, is
+ * reopened once their replies are in and rejoins when connected.
+ */
+static inline void churn_sent(struct tcp_connection *conn)
+{
+	if (churn_reqs && --conn->churn_left == 0)
+		conn_sched_pause(&sched, conn->idx);
+}
+
+static inline int churn_replied(struct tcp_connection *conn)
+{
+	if (!churn_reqs || conn->churn_left || conn->pending_reqs)
+		return 0;
+	return tcp_reopen(conn, epoll_fd);
+}
+
+static int churn_reopened(struct tcp_connection *conn)
+{
+	if (tcp_reopen_complete(conn, epoll_fd))
+		return -1;
+	conn->churn_left = churn_reqs;
+	conn_sched_resume(&sched, conn->idx);
 	return 0;
 }
 
@@ -252,46 +576,53 @@ static void throughput_tcp_main(void)
 	events = malloc(conn_per_thread * sizeof(struct epoll_event));
 
 	pthread_barrier_wait(&conn_open_barrier);
-	set_conn_open(1);
 
 	next_tx = time_ns();
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
+			backlog_clear();
 			continue;
 		}
-		while (time_ns() >= next_tx) {
+		backlog_fill(&next_tx);
+		while (backlog_count()) {
 			conn = pick_conn();
 			if (!conn)
 				goto REP_PROC;
+			backlog_pop();
 			to_send = prepare_request();
 			bytes_to_send = 0;
 			start_iov = 0;
 			for (i = 0; i < to_send->iov_cnt; i++)
 				bytes_to_send += to_send->iovs[i].iov_len;
-			while (1) {
-				ret = writev(conn->fd, &to_send->iovs[start_iov], to_send->iov_cnt);
-				if ((ret < 0) && (errno != EWOULDBLOCK)) {
-					lancet_perror("Unknown connection error write\n");
-					return;
-				}
-				if (ret < 0)
-					continue;
-				if (ret == bytes_to_send)
-					break;
-				bytes_to_send -= ret;
-				for (i = start_iov; i < start_iov + to_send->iov_cnt; i++) {
-					if (ret < to_send->iovs[i].iov_len) {
-						to_send->iovs[i].iov_len -= ret;
-						to_send->iovs[i].iov_base += ret;
+			if (zerocopy) {
+				send_request(to_send, conn->fd);
+				ret = bytes_to_send;
+			} else
+				while (1) {
+					ret = writev(conn->fd, &to_send->iovs[start_iov], to_send->iov_cnt);
+					if ((ret < 0) && (errno != EWOULDBLOCK)) {
+						lancet_perror("Unknown connection error write\n");
+						return;
+					}
+					if (ret < 0)
+						continue;
+					if (ret == bytes_to_send)
 						break;
+					bytes_to_send -= ret;
+					for (i = start_iov; i < start_iov + to_send->iov_cnt; i++) {
+						if (ret < to_send->iovs[i].iov_len) {
+							to_send->iovs[i].iov_len -= ret;
+							to_send->iovs[i].iov_base += ret;
+							break;
+						}
+						ret -= to_send->iovs[i].iov_len;
 					}
-					ret -= to_send->iovs[i].iov_len;
+					to_send->iov_cnt -= i - start_iov;
+					start_iov = i;
 				}
-				to_send->iov_cnt -= i - start_iov;
-				start_iov = i;
-			}
 			conn->pending_reqs++;
+			churn_sent(conn);
 			time_ns_to_ts(&tx_timestamp);
 			add_tx_timestamp(&tx_timestamp);
 
@@ -299,9 +630,6 @@ static void throughput_tcp_main(void)
 			send_res.bytes = ret;
 			send_res.reqs = 1;
 			add_throughput_tx_sample(send_res);
-
-			/*Schedule next*/
-			next_tx += get_ia();
 		}
 	REP_PROC:
 		/* process responses */
@@ -309,11 +637,15 @@ static void throughput_tcp_main(void)
 		for (i = 0; i < ready; i++) {
 			idx = events[i].data.u32;
 			conn = &connections[idx];
+			if (conn->reopen_start) {
+				if (churn_reopened(conn))
+					return;
+				continue;
+			}
 			/* Handle incoming packet */
 			if (events[i].events & EPOLLIN) {
 				// read into the connection buffer
-				ret = recv(conn->fd, &conn->buffer[conn->buffer_idx],
-						   MAX_PAYLOAD - conn->buffer_idx, 0);
+				ret = conn_recv(conn);
 				if ((ret < 0) && (errno != EWOULDBLOCK)) {
 					lancet_perror("Unknown connection error read\n");
 					return;
@@ -322,17 +654,23 @@ static void throughput_tcp_main(void)
 					close(conn->fd);
 					lancet_fprintf(stderr, "Connection closed\n");
 					conn->closed = 1;
+					conn_sched_close(&sched, conn->idx);
 					continue;
 				}
-				conn->buffer_idx += ret;
+				conn->buffer_end += ret;
 
 				read_res = handle_response(conn);
 				if (read_res.reqs > 0) {
 					conn->pending_reqs -= read_res.reqs;
+					conn_sched_put(&sched, conn->idx, read_res.reqs);
 					/* Bookkeeping */
 					add_throughput_rx_sample(read_res);
+					if (churn_replied(conn))
+						return;
 				}
-			} else
+			} else if (events[i].events & EPOLLERR)
+				reap_zerocopy(conn->fd);
+			else
 				assert(0);
 		}
 	}
@@ -341,12 +679,22 @@ static void throughput_tcp_main(void)
 static void latency_tcp_main(void)
 {
 	int i, ret, bytes_to_send;
-	long start_time, end_time, next_tx;
+	long start_time, end_time, next_tx, sched_delay;
 	struct tcp_connection *conn;
 	struct request *to_send;
 	struct byte_req_pair read_res;
 	struct byte_req_pair send_res;
 
+	/*
+	 * With more than one request per connection the latency agent runs
+	 * open loop like the symmetric one, so that slow replies do not hold
+	 * back the arrivals.
+	 */
+	if (get_max_pending_reqs() > 1) {
+		symmetric_tcp_main();
+		return;
+	}
+
 	if (latency_open_connections())
 		exit(-1);
 
@@ -356,8 +704,10 @@ static void latency_tcp_main(void)
 			next_tx = time_ns();
 			continue;
 		}
-		if (time_ns() < next_tx)
+		if (time_ns() < next_tx) {
+			pace_wait(next_tx);
 			continue;
+		}
 		conn = pick_conn();
 		if (!conn)
 			continue;
@@ -368,6 +718,8 @@ static void latency_tcp_main(void)
 			bytes_to_send += to_send->iovs[i].iov_len;
 
 		start_time = time_ns();
+		/* The agent is closed loop, lateness only counts with -d */
+		sched_delay = get_intended_latency() ? start_time - next_tx : 0;
 		ret = writev(conn->fd, to_send->iovs, to_send->iov_cnt);
 		if (ret < 0) {
 			lancet_perror("Writev failed\n");
@@ -379,10 +731,9 @@ static void latency_tcp_main(void)
 		send_res.reqs = 1;
 		add_throughput_tx_sample(send_res);
 
-		assert(conn->buffer_idx == 0);
+		assert(conn->buffer == NULL);
 		do {
-			assert(MAX_PAYLOAD - conn->buffer_idx > 0);
-			ret = recv(conn->fd, &conn->buffer[conn->buffer_idx], MAX_PAYLOAD - conn->buffer_idx, 0);
+			ret = conn_recv(conn);
 			if (ret < 0) {
 				lancet_perror("Error read\n");
 				return;
@@ -391,36 +742,41 @@ static void latency_tcp_main(void)
 				close(conn->fd);
 				lancet_fprintf(stderr, "Connection closed\n");
 				conn->closed = 1;
+				conn_sched_close(&sched, conn->idx);
 				continue;
 			}
 
-			conn->buffer_idx += ret;
+			conn->buffer_end += ret;
 			read_res = handle_response(conn);
 			if (read_res.reqs > 0) {
                                 if (get_app_proto()->type == PROTO_MEMCACHED_BIN) {
                                         assert(read_res.reqs == 1);
                                 }
 				end_time = time_ns();
+				conn_sched_put(&sched, conn->idx, read_res.reqs);
 				/*BookKeeping*/
 				add_throughput_rx_sample(read_res);
-				add_latency_sample((end_time - start_time), NULL);
+				add_latency_sample((end_time - start_time), sched_delay,
+								   NULL, to_send->op_class);
 
 				/*Schedule next*/
 				next_tx += get_ia();
 			}
-		} while (conn->buffer_idx);
+		} while (conn->buffer_end != conn->buffer_start);
 	}
 }
 
 static void symmetric_nic_tcp_main(void)
 {
 	int ready, idx, i, j, conn_per_thread, ret, bytes_to_send;
-	long next_tx;
+	long next_tx, intended;
 	struct epoll_event *events;
 	struct tcp_connection *conn;
 	struct request *to_send;
 	struct byte_req_pair read_res;
 	struct byte_req_pair send_res;
+	char *rx_buf;
+	uint32_t room;
 	struct timestamp_info rx_timestamp, *tx_timestamp;
 	struct msghdr hdr;
 	struct timespec latency;
@@ -433,18 +789,20 @@ static void symmetric_nic_tcp_main(void)
 	events = malloc(conn_per_thread * sizeof(struct epoll_event));
 
 	pthread_barrier_wait(&conn_open_barrier);
-	set_conn_open(1);
 
 	next_tx = time_ns();
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
+			backlog_clear();
 			continue;
 		}
-		if (time_ns() >= next_tx) {
+		backlog_fill(&next_tx);
+		if (backlog_count()) {
 			conn = pick_conn();
 			if (!conn)
 				goto REP_PROC;
+			intended = backlog_pop();
 
 			to_send = prepare_request();
 			// send once
@@ -462,17 +820,17 @@ static void symmetric_nic_tcp_main(void)
 				return;
 			}
 			assert(ret == bytes_to_send);
-			add_pending_tx_timestamp(&per_conn_tx_timestamps[conn->idx],
-									 bytes_to_send);
+			/* Wire to wire unless -d, the wait is in the backlog stats */
+			add_pending_tx_timestamp(
+				&per_conn_tx_timestamps[conn->idx], bytes_to_send,
+				get_intended_latency() ? time_ns() - intended : 0,
+				to_send->op_class);
 			conn->pending_reqs++;
 
 			/*BookKeeping*/
 			send_res.bytes = ret;
 			send_res.reqs = 1;
 			add_throughput_tx_sample(send_res);
-
-			/*Schedule next*/
-			next_tx += get_ia();
 		}
 	REP_PROC:
 		/* process responses */
@@ -483,9 +841,8 @@ static void symmetric_nic_tcp_main(void)
 			/* Handle incoming packet */
 			if (events[i].events & EPOLLIN) {
 				// read into the connection buffer
-				ret = timestamp_recv(conn->fd, &conn->buffer[conn->buffer_idx],
-									 MAX_PAYLOAD - conn->buffer_idx, 0,
-									 &rx_timestamp);
+				rx_buf = tcp_rx_reserve(conn, &room);
+				ret = timestamp_recv(conn->fd, rx_buf, room, 0, &rx_timestamp);
 				if ((ret < 0) && (errno != EWOULDBLOCK)) {
 					lancet_perror("Unknown connection error read\n");
 					return;
@@ -494,9 +851,10 @@ static void symmetric_nic_tcp_main(void)
 					close(conn->fd);
 					lancet_fprintf(stderr, "Connection closed\n");
 					conn->closed = 1;
+					conn_sched_close(&sched, conn->idx);
 					continue;
 				}
-				conn->buffer_idx += ret;
+				conn->buffer_end += ret;
 				read_res = handle_response(conn);
 				if (read_res.reqs == 0) {
 					continue;
@@ -505,11 +863,10 @@ static void symmetric_nic_tcp_main(void)
 				// assert(read_res.reqs >= 1);
 				// no need for assert because it must be true based on data type
 				conn->pending_reqs -= read_res.reqs;
+				conn_sched_put(&sched, conn->idx, read_res.reqs);
 				assert(conn->pending_reqs >= 0);
 
-				/*
-				 * Assume only the last request will have an rx timestamp!
-				 */
+				/* Every reply of the read is sampled against its rx timestamp */
 				for (j = 0; j < read_res.reqs; j++) {
 					tx_timestamp = pop_pending_tx_timestamps(
 						&per_conn_tx_timestamps[conn->idx]);
@@ -526,12 +883,14 @@ static void symmetric_nic_tcp_main(void)
 							&per_conn_tx_timestamps[conn->idx]);
 						assert(tx_timestamp);
 					}
+					ret = timespec_diff(&latency, &rx_timestamp.time,
+										&tx_timestamp->time);
+					assert(ret == 0);
+					long diff = latency.tv_nsec + latency.tv_sec * 1e9;
+					add_latency_sample(diff, tx_timestamp->sched_delay,
+									   &tx_timestamp->time,
+									   tx_timestamp->op_class);
 				}
-				ret = timespec_diff(&latency, &rx_timestamp.time,
-									&tx_timestamp->time);
-				assert(ret == 0);
-				long diff = latency.tv_nsec + latency.tv_sec * 1e9;
-				add_latency_sample(diff, &tx_timestamp->time);
 
 				/* Bookkeeping */
 				add_throughput_rx_sample(read_res);
@@ -547,13 +906,25 @@ static void symmetric_nic_tcp_main(void)
 	}
 }
 
-static void send_request(struct request *to_send, uint32_t fd)
+static void reap_zerocopy(int fd)
+{
+	int copied = 0;
+
+	get_zerocopy_completions(fd, &copied);
+	/* e.g. on loopback the kernel copies, so pinning only adds cost */
+	if (copied && zerocopy) {
+		lancet_fprintf(stderr, "Zero-copy sends were copied, disabling\n");
+		zerocopy = 0;
+	}
+}
+
+static void send_iovs(struct iovec *iovs, int iov_cnt, uint32_t fd, int flags)
 {
 	struct msghdr hdr;
 	int ret, bytes_to_send, i, current_iov_cnt;
-	current_iov_cnt = to_send->iov_cnt;
+	current_iov_cnt = iov_cnt;
 
-	struct iovec *current_iovs = to_send->iovs;
+	struct iovec *current_iovs = iovs;
 
 	int cumulative_bytes;
 
@@ -566,7 +937,12 @@ static void send_request(struct request *to_send, uint32_t fd)
 		for (i = 0; i < current_iov_cnt; i++)
 			bytes_to_send += current_iovs[i].iov_len;
 
-		ret = sendmsg(fd, &hdr, 0);
+		ret = sendmsg(fd, &hdr, flags);
+		/* Out of optmem for the pinned pages, wait for completions */
+		if ((ret < 0) && (errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+			reap_zerocopy(fd);
+			continue;
+		}
                 if ((ret < 0) && (errno != EWOULDBLOCK)) {
 			lancet_perror("Unknown connection error write\n");
 			return;
@@ -601,10 +977,46 @@ static void send_request(struct request *to_send, uint32_t fd)
 	} while (ret < bytes_to_send);
 }
 
+static inline int zerocopy_iov(struct iovec *iov)
+{
+	char *base = iov->iov_base;
+
+	return iov->iov_len >= ZEROCOPY_MIN_BYTES && base >= random_char &&
+		   base < random_char + MAX_VAL_SIZE;
+}
+
+/*
+ * With -z the large values that point to random_char are sent with
+ * MSG_ZEROCOPY and the rest is copied. random_char does not change after
+ * init, so the completions are only reaped and never waited for.
+ */
+static void send_request(struct request *to_send, uint32_t fd)
+{
+	int i, start, more;
+
+	if (!zerocopy) {
+		send_iovs(to_send->iovs, to_send->iov_cnt, fd, 0);
+		return;
+	}
+
+	start = 0;
+	for (i = 0; i < to_send->iov_cnt; i++) {
+		if (!zerocopy_iov(&to_send->iovs[i]))
+			continue;
+		if (i > start)
+			send_iovs(&to_send->iovs[start], i - start, fd, MSG_MORE);
+		more = (i + 1 < to_send->iov_cnt) ? MSG_MORE : 0;
+		send_iovs(&to_send->iovs[i], 1, fd, MSG_ZEROCOPY | more);
+		start = i + 1;
+	}
+	if (start < to_send->iov_cnt)
+		send_iovs(&to_send->iovs[start], to_send->iov_cnt - start, fd, 0);
+}
+
 static void symmetric_tcp_main(void)
 {
 	int ready, idx, i, j, conn_per_thread, ret, bytes_total;
-	long next_tx;
+	long next_tx, intended, now;
 	struct epoll_event *events;
 	struct tcp_connection *conn;
 	struct request *to_send;
@@ -621,38 +1033,40 @@ static void symmetric_tcp_main(void)
 	events = malloc(conn_per_thread * sizeof(struct epoll_event));
 
 	pthread_barrier_wait(&conn_open_barrier);
-	set_conn_open(1);
 
 	next_tx = time_ns();
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
+			backlog_clear();
 			continue;
 		}
-		while (time_ns() >= next_tx) {
+		backlog_fill(&next_tx);
+		while (backlog_count()) {
 			conn = pick_conn();
 			if (!conn)
 				goto REP_PROC;
 			to_send = prepare_request();
 
 			// send once
-                        time_ns_to_ts(&tx_timestamp);
+			intended = backlog_pop();
+			now = time_ns();
+			ns_to_ts(now, &tx_timestamp);
                         bytes_total = 0;
                         for (i = 0; i < to_send->iov_cnt; i++)
                                 bytes_total += to_send->iovs[i].iov_len;
                         send_request(to_send, conn->fd);
 			
 			push_complete_tx_timestamp(&per_conn_tx_timestamps[conn->idx],
-									   &tx_timestamp);
+									   &tx_timestamp, now - intended,
+									   to_send->op_class);
 			conn->pending_reqs++;
+			churn_sent(conn);
 
 			/*BookKeeping*/
 			send_res.bytes = bytes_total;
 			send_res.reqs = 1;
 			add_throughput_tx_sample(send_res);
-
-			/*Schedule next*/
-			next_tx += get_ia();
 		}
 	REP_PROC:
 		/* process responses */
@@ -660,11 +1074,15 @@ static void symmetric_tcp_main(void)
 		for (i = 0; i < ready; i++) {
 			idx = events[i].data.u32;
 			conn = &connections[idx];
+			if (conn->reopen_start) {
+				if (churn_reopened(conn))
+					return;
+				continue;
+			}
 			/* Handle incoming packet */
 			if (events[i].events & EPOLLIN) {
 				// read into the connection buffer
-				ret = recv(conn->fd, &conn->buffer[conn->buffer_idx],
-						   MAX_PAYLOAD - conn->buffer_idx, 0);
+				ret = conn_recv(conn);
 				if ((ret < 0) && (errno != EWOULDBLOCK)) {
 					lancet_perror("Unknow connection error read\n");
 					return;
@@ -673,19 +1091,22 @@ static void symmetric_tcp_main(void)
 					close(conn->fd);
 					lancet_fprintf(stderr, "Connection closed\n");
 					conn->closed = 1;
+					conn_sched_close(&sched, conn->idx);
 					continue;
 				}
 				time_ns_to_ts(&rx_timestamp);
 
-				conn->buffer_idx += ret;
+				conn->buffer_end += ret;
 				read_res = handle_response(conn);
 				if (read_res.reqs == 0)
 					continue;
 
 				// No need for assert because it's uint64
 				conn->pending_reqs -= read_res.reqs;
+				conn_sched_put(&sched, conn->idx, read_res.reqs);
 				/*
-				 * Assume only the last request will have an rx timestamp!
+				 * Every reply of the read is sampled against its rx timestamp,
+				 * with NIC timestamps the one of its last packet
 				 */
 				for (j = 0; j < read_res.reqs; j++) {
 					pending_tx = pop_pending_tx_timestamps(
@@ -703,58 +1124,101 @@ static void symmetric_tcp_main(void)
 							&per_conn_tx_timestamps[conn->idx]);
 						assert(pending_tx);
 					}
+					ret = timespec_diff(&latency, &rx_timestamp,
+										&pending_tx->time);
+					assert(ret == 0);
+					long diff = latency.tv_nsec + latency.tv_sec * 1e9;
+					add_latency_sample(diff, pending_tx->sched_delay,
+									   &pending_tx->time, pending_tx->op_class);
 				}
-				ret = timespec_diff(&latency, &rx_timestamp, &pending_tx->time);
-				assert(ret == 0);
-				long diff = latency.tv_nsec + latency.tv_sec * 1e9;
-				add_latency_sample(diff, &pending_tx->time);
 
 				/* Bookkeeping */
 				add_throughput_rx_sample(read_res);
-			} else
+				if (churn_replied(conn))
+					return;
+			} else if (events[i].events & EPOLLERR)
+				reap_zerocopy(conn->fd);
+			else
 				assert(0);
 		}
 	}
 }
 
+/*
+ * Return where to receive the next bytes of conn and how many fit. A buffer
+ * is taken from the pool if the connection holds none. When the buffer is
+ * full, leftover bytes move to the front if that frees enough room,
+ * otherwise they move to a buffer of the next size class.
+ */
+char *tcp_rx_reserve(struct tcp_connection *conn, uint32_t *room)
+{
+	uint32_t used;
+
+	if (!conn->buffer) {
+		conn->buffer = buffer_pool_get(BUFFER_POOL_MIN_SIZE, &conn->buffer_size);
+		assert(conn->buffer);
+		conn->buffer_start = 0;
+		conn->buffer_end = 0;
+	} else if (conn->buffer_end == conn->buffer_size) {
+		used = conn->buffer_end - conn->buffer_start;
+		if (used <= conn->buffer_size / 2) {
+			memmove(conn->buffer, &conn->buffer[conn->buffer_start], used);
+			conn->buffer_start = 0;
+			conn->buffer_end = used;
+		} else
+			tcp_rx_move(conn, 2 * conn->buffer_size);
+	}
+	*room = conn->buffer_size - conn->buffer_end;
+	return &conn->buffer[conn->buffer_end];
+}
+
 // this should contain all the logic for partial responses
 // so that BOTH the throughput and latency cases handle this correctly
 struct byte_req_pair handle_response(struct tcp_connection *conn)
 {
 	struct byte_req_pair brp;
-	uint64_t brp_bytes;
+	uint32_t available;
 
-	brp = process_response(conn->buffer, conn->buffer_idx);
-	brp_bytes = brp.bytes;
+	available = conn->buffer_end - conn->buffer_start;
+	brp = process_response(&conn->buffer[conn->buffer_start], available);
 
-	if (brp_bytes == 0) {
+	if (brp.bytes == 0) {
+		// wait for the rest of the response
 		assert(brp.reqs == 0);
-		if (conn->buffer_idx == MAX_PAYLOAD) {
-			lancet_fprintf(stderr, "partial request processed beyond max "
-								   "buffer size (%d). Need to make smaller "
-								   "requests or increase MAX_PAYLOAD.\n",
-						   MAX_PAYLOAD);
-			assert(0);
-		}
 		return brp;
-	} else if (brp_bytes == conn->buffer_idx) {
-		// consumed the whole response
-		conn->buffer_idx = 0;
-	} else if (brp_bytes > 0 && brp_bytes < conn->buffer_idx) {
-		size_t leftover_bytes = conn->buffer_idx - brp_bytes;
-		assert(leftover_bytes < MAX_PAYLOAD);
-		memmove(conn->buffer, &conn->buffer[brp_bytes], leftover_bytes);
-		conn->buffer_idx = leftover_bytes;
-	} else {
+	} else if (brp.bytes > available) {
 		lancet_fprintf(stderr, "got a strange amount of response bytes (%lu) "
-							   "from total bytes (%d)",
-					   brp_bytes, conn->buffer_idx);
+							   "from total bytes (%u)",
+					   brp.bytes, available);
 		assert(0);
 	}
+
+	conn->buffer_start += brp.bytes;
+	if (conn->buffer_start == conn->buffer_end) {
+		// consumed the whole response, the connection goes idle
+		buffer_pool_put(conn->buffer, conn->buffer_size);
+		conn->buffer = NULL;
+		conn->buffer_size = 0;
+	}
 	assert(brp.reqs > 0);
+	/* Connection idx goes to target idx % target_count, see connect_sockets */
+	if (shard_count)
+		add_shard_rx_sample(conn->idx % shard_count, brp.reqs);
 	return brp;
 }
 
+/*
+ * AF_UNIX stream and seqpacket sockets, run by the TCP agents. sock_type is
+ * SOCK_STREAM or SOCK_SEQPACKET.
+ */
+struct transport_protocol *init_unix(int sock_type)
+{
+	unix_type = sock_type;
+	if (sock_type == SOCK_SEQPACKET)
+		recv_flags = MSG_TRUNC;
+	return init_tcp();
+}
+
 struct transport_protocol *init_tcp(void)
 {
 	struct transport_protocol *tp;
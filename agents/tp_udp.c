@@ -22,6 +22,7 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
@@ -36,6 +37,8 @@
 #include <sys/socket.h>
 #include <time.h>
 
+#include <lancet/backlog.h>
+#include <lancet/conn_sched.h>
 #include <lancet/error.h>
 #include <lancet/manager.h>
 #include <lancet/misc.h>
@@ -44,7 +47,37 @@
 
 static __thread int epoll_fd;
 static __thread struct udp_socket *sockets;
-static __thread uint32_t socket_idx = 0;
+static __thread struct conn_sched sched;
+static __thread uint32_t socket_depth = 1;
+
+/*
+ * Batched mode state. Requests are flattened into tx slots because the
+ * buffers returned by prepare_request are reused for the next request.
+ */
+struct udp_tx_slot {
+	struct udp_socket *socket;
+	long intended; // intended send time
+	int op_class;
+	struct iovec iov;
+	char buffer[UDP_MAX_PAYLOAD];
+};
+
+static __thread struct udp_tx_slot *tx_slots;
+static __thread struct udp_tx_slot **tx_order;
+static __thread struct mmsghdr *tx_msgs;
+static __thread struct mmsghdr *rx_msgs;
+static __thread struct iovec *rx_iovs;
+static __thread char *rx_buffers;
+static __thread struct sockaddr_in *rx_addrs;
+static __thread struct pending_tx_timestamps *per_socket_tx_timestamps;
+static __thread int batch_size = 1;
+/*
+ * Connections sharing an unconnected socket, towards different targets.
+ * With one request per connection the source address of a reply tells
+ * which request it answers.
+ */
+static __thread int conns_per_fd = 1;
+static __thread struct sockaddr_in *target_addrs;
 
 /*
  * Socket management
@@ -52,16 +85,23 @@ static __thread uint32_t socket_idx = 0;
 static inline struct udp_socket *get_socket()
 {
 	int idx;
-	struct udp_socket *c;
 
-	idx = socket_idx++ % (get_conn_count() / get_thread_count());
-	c = &sockets[idx];
-	if (!c->taken) {
-		c->taken = 1;
-		return c;
-	}
+	idx = conn_sched_get(&sched);
+	if (idx < 0)
+		return NULL;
+	sockets[idx].taken++;
+	return &sockets[idx];
+}
 
-	return NULL;
+/*
+ * Mark up to count requests of the socket as answered
+ */
+static inline void put_socket(struct udp_socket *socket, uint32_t count)
+{
+	if (count > socket->taken)
+		count = socket->taken;
+	socket->taken -= count;
+	conn_sched_put(&sched, socket - sockets, count);
 }
 
 static int create_latency_sockets(void)
@@ -115,13 +155,13 @@ static int create_latency_sockets(void)
 		sockets[i].taken = 0;
 	}
 
-	return 0;
+	return conn_sched_init(&sched, per_thread_conn, socket_depth);
 }
 
 static int create_throughput_socket(void)
 {
 	struct sockaddr_in addr;
-	int i, efd, ret, sock, per_thread_conn, dest_idx;
+	int i, efd, ret, sock, per_thread_conn, million = 1e6, dest_idx;
 	struct epoll_event event;
 	struct host_tuple *targets;
 	struct timeval tv;
@@ -143,6 +183,10 @@ static int create_throughput_socket(void)
 	tv.tv_usec = 0;
 
 	for (i = 0; i < per_thread_conn; i++) {
+		if (i % conns_per_fd) {
+			sockets[i].fd = sockets[i - i % conns_per_fd].fd;
+			continue;
+		}
 		sock = socket(AF_INET, SOCK_DGRAM, 0);
 		if (sock == -1) {
 			lancet_perror("Error creating socket");
@@ -175,10 +219,22 @@ static int create_throughput_socket(void)
 			}
 		}
 
+		/* The pipelined latency agent keeps busy polling */
+		if (get_agent_type() == LATENCY_AGENT) {
+			ret = setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &million,
+							 sizeof(million));
+			if (ret) {
+				lancet_perror("Error setsockopt SO_BUSY_POLL");
+				return -1;
+			}
+		}
+
 		dest_idx = i % get_target_count();
 		addr.sin_port = htons(targets[dest_idx].port);
 		addr.sin_addr.s_addr = targets[dest_idx].ip;
-		ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+		ret = conns_per_fd > 1
+				  ? 0
+				  : connect(sock, (struct sockaddr *)&addr, sizeof(addr));
 		if (ret) {
 			lancet_perror("Error connecting");
 			return -1;
@@ -197,18 +253,30 @@ static int create_throughput_socket(void)
 		}
 	}
 	epoll_fd = efd;
-	return 0;
+	return conn_sched_init(&sched, per_thread_conn, socket_depth);
 }
 
+static void udp_batch_main(void);
+
 static void latency_udp_main(void)
 {
 	int i, ret, bytes_to_send;
-	long start_time, end_time, next_tx;
+	long start_time, end_time, next_tx, sched_delay;
 	struct udp_socket *socket;
 	struct request *to_send;
 	struct byte_req_pair read_res;
 	struct byte_req_pair send_res;
 
+	/*
+	 * With -o above one run open loop through the batched path, so that
+	 * slow replies do not hold back the arrivals. Each socket still
+	 * carries one request at a time.
+	 */
+	if (get_max_pending_reqs() > 1) {
+		udp_batch_main();
+		return;
+	}
+
 	if (create_latency_sockets())
 		return;
 
@@ -218,8 +286,10 @@ static void latency_udp_main(void)
 			next_tx = time_ns();
 			continue;
 		}
-		if (time_ns() < next_tx)
+		if (time_ns() < next_tx) {
+			pace_wait(next_tx);
 			continue;
+		}
 		socket = get_socket();
 		if (!socket)
 			continue;
@@ -230,6 +300,8 @@ static void latency_udp_main(void)
 			bytes_to_send += to_send->iovs[i].iov_len;
 		assert(bytes_to_send <= UDP_MAX_PAYLOAD);
 		start_time = time_ns();
+		/* The agent is closed loop, lateness only counts with -d */
+		sched_delay = get_intended_latency() ? start_time - next_tx : 0;
 		ret = writev(socket->fd, to_send->iovs, to_send->iov_cnt);
 		if (ret < 0) {
 			lancet_perror("Writev failed\n");
@@ -254,16 +326,307 @@ static void latency_udp_main(void)
 
 		/*BookKeeping*/
 		add_throughput_rx_sample(read_res);
-		add_latency_sample((end_time - start_time), NULL);
+		add_latency_sample((end_time - start_time), sched_delay, NULL,
+						   to_send->op_class);
 
 		/* Mark socket as available */
-		socket->taken = 0;
+		put_socket(socket, socket->taken);
 
 		/* Schedule next */
 		next_tx += get_ia();
 	}
 }
 
+/*
+ * Connection i goes to target i modulo the targets, so every group of target
+ * count connections can share one unconnected socket and one sendmmsg, with
+ * the destination in msg_name. The targets must differ to tell the replies
+ * apart.
+ */
+static void share_sockets(int per_thread_conn)
+{
+	struct host_tuple *targets = get_targets();
+	int i, j, count = get_target_count();
+
+	if (count == 1 || per_thread_conn % count)
+		return;
+	for (i = 0; i < count; i++)
+		for (j = 0; j < i; j++)
+			if (targets[i].ip == targets[j].ip &&
+				targets[i].port == targets[j].port)
+				return;
+
+	conns_per_fd = count;
+	target_addrs = calloc(count, sizeof(struct sockaddr_in));
+	assert(target_addrs);
+	for (i = 0; i < count; i++) {
+		target_addrs[i].sin_family = AF_INET;
+		target_addrs[i].sin_port = htons(targets[i].port);
+		target_addrs[i].sin_addr.s_addr = targets[i].ip;
+	}
+}
+
+static void udp_batch_init(void)
+{
+	int i, batch, per_thread_conn;
+
+	/* The pipelined latency agent may run without -b */
+	batch = get_udp_batch() > 1 ? get_udp_batch() : 1;
+	batch_size = batch;
+	per_thread_conn = get_conn_count() / get_thread_count();
+	/*
+	 * Replies are matched to the requests of a socket by arrival order, so
+	 * a lost or reordered datagram would shift every later latency. Only
+	 * the throughput agent, which does not match them, keeps up to -o
+	 * outstanding requests per socket.
+	 */
+	if (get_agent_type() == THROUGHPUT_AGENT)
+		socket_depth = get_max_pending_reqs();
+	else
+		share_sockets(per_thread_conn);
+
+	tx_slots = calloc(batch, sizeof(struct udp_tx_slot));
+	tx_order = calloc(batch, sizeof(struct udp_tx_slot *));
+	tx_msgs = calloc(batch, sizeof(struct mmsghdr));
+	rx_msgs = calloc(batch, sizeof(struct mmsghdr));
+	rx_iovs = calloc(batch, sizeof(struct iovec));
+	rx_addrs = calloc(batch, sizeof(struct sockaddr_in));
+	rx_buffers = malloc(batch * UDP_MAX_PAYLOAD);
+	assert(tx_slots && tx_order && tx_msgs && rx_msgs && rx_iovs &&
+		   rx_addrs && rx_buffers);
+	for (i = 0; i < batch; i++) {
+		tx_slots[i].iov.iov_base = tx_slots[i].buffer;
+		rx_iovs[i].iov_base = &rx_buffers[i * UDP_MAX_PAYLOAD];
+		rx_iovs[i].iov_len = UDP_MAX_PAYLOAD;
+		rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+		rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if (get_agent_type() != THROUGHPUT_AGENT) {
+		per_socket_tx_timestamps =
+			calloc(per_thread_conn, sizeof(struct pending_tx_timestamps));
+		assert(per_socket_tx_timestamps);
+		for (i = 0; i < per_thread_conn; i++) {
+			per_socket_tx_timestamps[i].pending = calloc(
+				get_max_pending_reqs(), sizeof(struct timestamp_info));
+			assert(per_socket_tx_timestamps[i].pending);
+		}
+	}
+}
+
+static void stage_request(struct udp_tx_slot *slot, struct udp_socket *socket,
+						  struct request *to_send, long intended)
+{
+	int i, len = 0;
+
+	for (i = 0; i < to_send->iov_cnt; i++) {
+		assert(len + to_send->iovs[i].iov_len <= UDP_MAX_PAYLOAD);
+		memcpy(&slot->buffer[len], to_send->iovs[i].iov_base,
+			   to_send->iovs[i].iov_len);
+		len += to_send->iovs[i].iov_len;
+	}
+	slot->iov.iov_len = len;
+	slot->socket = socket;
+	slot->intended = intended;
+	slot->op_class = to_send->op_class;
+}
+
+/*
+ * Send the staged requests with one sendmmsg per destination socket.
+ * Returns 0 on success.
+ */
+static int flush_batch(int count)
+{
+	int i, j, k, sent, ret;
+	struct udp_tx_slot *slot;
+	struct udp_socket *socket;
+	struct byte_req_pair send_res = {0};
+	struct timespec now;
+	long now_ns;
+
+	now_ns = time_ns();
+	ns_to_ts(now_ns, &now);
+	/* Group slots per socket keeping the send order within a socket */
+	for (i = 0; i < count; i++) {
+		slot = &tx_slots[i];
+		for (j = i; j > 0 && tx_order[j - 1]->socket->fd > slot->socket->fd;
+			 j--)
+			tx_order[j] = tx_order[j - 1];
+		tx_order[j] = slot;
+	}
+
+	for (i = 0; i < count; i = j) {
+		socket = tx_order[i]->socket;
+		for (j = i; j < count && tx_order[j]->socket->fd == socket->fd; j++) {
+			bzero(&tx_msgs[j - i], sizeof(struct mmsghdr));
+			tx_msgs[j - i].msg_hdr.msg_iov = &tx_order[j]->iov;
+			tx_msgs[j - i].msg_hdr.msg_iovlen = 1;
+			if (conns_per_fd == 1)
+				continue;
+			tx_msgs[j - i].msg_hdr.msg_name =
+				&target_addrs[(tx_order[j]->socket - sockets) % conns_per_fd];
+			tx_msgs[j - i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+		sent = 0;
+		while (sent < j - i) {
+			ret = sendmmsg(socket->fd, &tx_msgs[sent], j - i - sent, 0);
+			if ((ret < 0) && (errno != EWOULDBLOCK)) {
+				lancet_perror("Unknown connection error write\n");
+				return -1;
+			}
+			if (ret > 0)
+				sent += ret;
+		}
+		for (k = i; k < j; k++) {
+			slot = tx_order[k];
+			if (get_agent_type() != THROUGHPUT_AGENT)
+				push_complete_tx_timestamp(
+					&per_socket_tx_timestamps[slot->socket - sockets], &now,
+					now_ns - slot->intended, slot->op_class);
+			else
+				add_tx_timestamp(&now);
+			send_res.bytes += slot->iov.iov_len;
+		}
+	}
+
+	/*BookKeeping*/
+	send_res.reqs = count;
+	add_throughput_tx_sample(send_res);
+	return 0;
+}
+
+/*
+ * Connection of a shared socket that a reply from addr answers, NULL for a
+ * stray datagram
+ */
+static struct udp_socket *reply_socket(struct udp_socket *first,
+									   struct sockaddr_in *addr)
+{
+	int i;
+
+	for (i = 0; i < conns_per_fd; i++)
+		if (target_addrs[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+			target_addrs[i].sin_port == addr->sin_port)
+			return first[i].taken ? &first[i] : NULL;
+	return NULL;
+}
+
+/*
+ * Drain up to one batch of replies from a ready socket with recvmmsg.
+ * Returns 0 on success.
+ */
+static int drain_socket(struct udp_socket *socket)
+{
+	int i, ret, count;
+	struct byte_req_pair read_res, rx_res = {0};
+	struct timespec rx_timestamp, latency;
+	struct timestamp_info *pending_tx;
+	struct udp_socket *conn;
+
+	count = batch_size;
+	if (conns_per_fd > 1 && conns_per_fd < count)
+		count = conns_per_fd;
+	else if (conns_per_fd == 1 && socket->taken && socket->taken < count)
+		count = socket->taken;
+	for (i = 0; i < count && conns_per_fd > 1; i++) {
+		rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
+		rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+	ret = recvmmsg(socket->fd, rx_msgs, count, MSG_DONTWAIT, NULL);
+	if (ret < 0) {
+		if (errno == EWOULDBLOCK)
+			return 0;
+		lancet_perror("Unknow connection error read\n");
+		return -1;
+	}
+	/* Messages drained together share the rx timestamp */
+	time_ns_to_ts(&rx_timestamp);
+
+	for (i = 0; i < ret; i++) {
+		conn = socket;
+		if (conns_per_fd > 1) {
+			conn = reply_socket(socket, &rx_addrs[i]);
+			if (!conn)
+				continue;
+		}
+		read_res = process_response(rx_iovs[i].iov_base, rx_msgs[i].msg_len);
+		assert(read_res.bytes == rx_msgs[i].msg_len);
+		rx_res.bytes += read_res.bytes;
+		rx_res.reqs += read_res.reqs;
+
+		/* Mark socket as available */
+		put_socket(conn, 1);
+		if (get_agent_type() == THROUGHPUT_AGENT)
+			continue;
+		pending_tx = pop_pending_tx_timestamps(
+			&per_socket_tx_timestamps[conn - sockets]);
+		if (!pending_tx)
+			continue;
+		if (timespec_diff(&latency, &rx_timestamp, &pending_tx->time) == 0)
+			add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9,
+							   pending_tx->sched_delay, &pending_tx->time,
+							   pending_tx->op_class);
+	}
+
+	/* Bookkeeping */
+	add_throughput_rx_sample(rx_res);
+	return 0;
+}
+
+/*
+ * Used by the throughput and symmetric agents when -b is set, and by the
+ * latency agent when -o is above one. All requests
+ * due in one iteration are sent with one sendmmsg per socket, and ready
+ * sockets are drained with recvmmsg.
+ */
+static void udp_batch_main(void)
+{
+	int ready, i, staged, batch, conn_per_thread;
+	long next_tx;
+	struct epoll_event *events;
+	struct udp_socket *socket;
+
+	/*Initializations*/
+	udp_batch_init();
+	if (create_throughput_socket())
+		return;
+	batch = batch_size;
+	conn_per_thread = get_conn_count() / get_thread_count();
+	events = malloc(conn_per_thread * sizeof(struct epoll_event));
+
+	next_tx = time_ns();
+	while (1) {
+		if (!should_load()) {
+			next_tx = time_ns();
+			backlog_clear();
+			continue;
+		}
+		staged = 0;
+		backlog_fill(&next_tx);
+		while (backlog_count() && staged < batch) {
+			socket = get_socket();
+			if (!socket)
+				break;
+			stage_request(&tx_slots[staged++], socket, prepare_request(),
+						  backlog_pop());
+		}
+		if (staged && flush_batch(staged))
+			return;
+
+		/* process responses */
+		ready = epoll_wait(epoll_fd, events, conn_per_thread, 0);
+		for (i = 0; i < ready; i++) {
+			socket = (struct udp_socket *)events[i].data.ptr;
+			/* Handle incoming packets */
+			if (events[i].events & EPOLLIN) {
+				if (drain_socket(socket))
+					return;
+			} else
+				assert(0);
+		}
+	}
+}
+
 static void throughput_udp_main(void)
 {
 	int ready, i, conn_per_thread, ret, bytes_to_send;
@@ -275,6 +638,11 @@ static void throughput_udp_main(void)
 	struct byte_req_pair send_res;
 	struct timespec tx_timestamp;
 
+	if (get_udp_batch() > 1) {
+		udp_batch_main();
+		return;
+	}
+
 	if (create_throughput_socket())
 		return;
 
@@ -286,12 +654,15 @@ static void throughput_udp_main(void)
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
+			backlog_clear();
 			continue;
 		}
-		while (time_ns() >= next_tx) {
+		backlog_fill(&next_tx);
+		while (backlog_count()) {
 			socket = get_socket();
 			if (!socket)
 				goto REP_PROC;
+			backlog_pop();
 			to_send = prepare_request();
 			bytes_to_send = 0;
 			for (i = 0; i < to_send->iov_cnt; i++)
@@ -312,9 +683,6 @@ static void throughput_udp_main(void)
 			send_res.bytes = ret;
 			send_res.reqs = 1;
 			add_throughput_tx_sample(send_res);
-
-			/*Schedule next*/
-			next_tx += get_ia();
 		}
 	REP_PROC:
 		/* process responses */
@@ -334,7 +702,7 @@ static void throughput_udp_main(void)
 				add_throughput_rx_sample(read_res);
 
 				// Mark socket as available
-				socket->taken = 0;
+				put_socket(socket, socket->taken);
 			} else if (events[i].events & EPOLLHUP)
 				assert(0);
 			else
@@ -346,7 +714,7 @@ static void throughput_udp_main(void)
 static void symmetric_nic_udp_main(void)
 {
 	int ready, i, conn_per_thread, ret, bytes_to_send;
-	long next_tx;
+	long next_tx, intended;
 	struct epoll_event *events;
 	struct udp_socket *socket;
 	struct request *to_send;
@@ -367,12 +735,15 @@ static void symmetric_nic_udp_main(void)
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
+			backlog_clear();
 			continue;
 		}
-		if (time_ns() >= next_tx) {
+		backlog_fill(&next_tx);
+		if (backlog_count()) {
 			socket = get_socket();
 			if (!socket)
 				goto REP_PROC;
+			intended = backlog_pop();
 			to_send = prepare_request();
 
 			bytes_to_send = 0;
@@ -389,15 +760,16 @@ static void symmetric_nic_udp_main(void)
 				return;
 			}
 			assert(ret == bytes_to_send);
+			/* Wire to wire unless -d, the wait is in the backlog stats */
+			socket->sched_delay =
+				get_intended_latency() ? time_ns() - intended : 0;
+			socket->op_class = to_send->op_class;
 
 			send_res.bytes = ret;
 			send_res.reqs = 1;
 
 			/*BookKeeping*/
 			add_throughput_tx_sample(send_res);
-
-			/*Schedule next*/
-			next_tx += get_ia();
 		}
 	REP_PROC:
 		/* process responses */
@@ -430,14 +802,15 @@ static void symmetric_nic_udp_main(void)
 									&socket->tx_timestamp);
 				if (ret == 0) {
 					add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9,
-									   &socket->tx_timestamp);
+									   socket->sched_delay,
+									   &socket->tx_timestamp, socket->op_class);
 				}
 
 				/* Bookkeeping */
 				add_throughput_rx_sample(read_res);
 
 				/* Mark socket as available */
-				socket->taken = 0;
+				put_socket(socket, socket->taken);
 
 				/* Reset timestamps to make sure the next iteration on this
 				 * socket doesn't use old values */
@@ -469,7 +842,7 @@ static void symmetric_nic_udp_main(void)
 static void symmetric_udp_main(void)
 {
 	int ready, i, conn_per_thread, ret, bytes_to_send;
-	long next_tx;
+	long next_tx, intended;
 	struct epoll_event *events;
 	struct udp_socket *socket;
 	struct request *to_send;
@@ -478,6 +851,11 @@ static void symmetric_udp_main(void)
 	struct msghdr hdr;
 	struct timespec latency;
 
+	if (get_udp_batch() > 1) {
+		udp_batch_main();
+		return;
+	}
+
 	if (create_throughput_socket())
 		return;
 
@@ -489,12 +867,15 @@ static void symmetric_udp_main(void)
 	while (1) {
 		if (!should_load()) {
 			next_tx = time_ns();
+			backlog_clear();
 			continue;
 		}
-		if (time_ns() >= next_tx) {
+		backlog_fill(&next_tx);
+		if (backlog_count()) {
 			socket = get_socket();
 			if (!socket)
 				goto REP_PROC;
+			intended = backlog_pop();
 			to_send = prepare_request();
 			bytes_to_send = 0;
 			for (i = 0; i < to_send->iov_cnt; i++)
@@ -512,6 +893,8 @@ static void symmetric_udp_main(void)
 				return;
 			}
 			assert(ret == bytes_to_send);
+			socket->sched_delay = time_ns() - intended;
+			socket->op_class = to_send->op_class;
 
 			send_res.bytes = ret;
 			send_res.reqs = 1;
@@ -519,9 +902,6 @@ static void symmetric_udp_main(void)
 			/*BookKeeping*/
 			add_throughput_tx_sample(send_res);
 			add_tx_timestamp(&socket->tx_timestamp);
-
-			/*Schedule next*/
-			next_tx += get_ia();
 		}
 	REP_PROC:
 		/* process responses */
@@ -545,14 +925,15 @@ static void symmetric_udp_main(void)
 									&socket->tx_timestamp);
 				if (ret == 0) {
 					add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9,
-									   &socket->tx_timestamp);
+									   socket->sched_delay,
+									   &socket->tx_timestamp, socket->op_class);
 				}
 
 				/* Bookkeeping */
 				add_throughput_rx_sample(read_res);
 
 				/* Mark socket as available */
-				socket->taken = 0;
+				put_socket(socket, socket->taken);
 			} else if (events[i].events & EPOLLHUP)
 				assert(0);
 			else
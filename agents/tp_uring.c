@@ -0,0 +1,874 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * TCP transport driven by io_uring. Requests that become due in the same
+ * loop iteration are coalesced per connection and submitted together with a
+ * single io_uring_enter. Responses are received with one multishot recv per
+ * connection into a ring of provided buffers, so an idle loop iteration costs
+ * no system calls at all. Sockets are registered as fixed files.
+ *
+ * The ring is driven through the raw system calls to avoid depending on
+ * liburing.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lancet/app_proto.h>
+#include <lancet/backlog.h>
+#include <lancet/conn_sched.h>
+#include <lancet/error.h>
+#include <lancet/misc.h>
+#include <lancet/shard.h>
+#include <lancet/timestamping.h>
+#include <lancet/tp_proto.h>
+
+#define URING_MIN_ENTRIES 64
+#define URING_MAX_ENTRIES 32768
+#define URING_BUF_COUNT 4096 // must be a power of 2
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+#define URING_CONTROL_LEN 256
+
+#define URING_OP_RECV 1ULL
+#define URING_OP_SEND 2ULL
+#define URING_UDATA(op, idx) (((op) << 32) | (idx))
+#define URING_UDATA_OP(ud) ((ud) >> 32)
+#define URING_UDATA_IDX(ud) ((uint32_t)(ud))
+
+#define SCRATCH_EXTERNAL UINT32_MAX
+
+struct uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;
+	unsigned submitted;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	uint16_t br_tail;
+};
+
+/*
+ * Requests staged on a connection until the next submission. The buffers
+ * returned by prepare_request are reused for the next request, so everything
+ * but the shared value buffer is copied into scratch. Scratch iovecs hold an
+ * offset until submission, since scratch may move when it grows.
+ */
+struct uring_tx {
+	struct msghdr hdr;
+	struct iovec *iovs;
+	uint32_t *scratch_off;
+	int iov_cnt;
+	int iov_cap;
+	char *scratch;
+	uint32_t scratch_len;
+	uint32_t scratch_cap;
+	uint32_t *req_bytes;
+	long *req_intended; // intended send time of each staged request
+	int *req_op_class;
+	uint32_t reqs;
+	uint32_t bytes;
+	int dirty;
+};
+
+static __thread struct uring ring;
+static __thread struct tcp_connection *connections;
+static __thread struct uring_tx *txs;
+static __thread uint32_t *dirty_conns;
+static __thread uint32_t dirty_count;
+static __thread struct pending_tx_timestamps *per_conn_tx_timestamps;
+static __thread struct msghdr recvmsg_hdr;
+static __thread struct conn_sched sched;
+static __thread long latency_start;
+static __thread int latency_op_class; // of the single latency request
+static __thread long next_tx;
+
+static int uring_setup(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	size_t sq_sz, cq_sz;
+	void *sq_ptr, *cq_ptr;
+	unsigned i, *sq_array;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	p.cq_entries = 4 * entries;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0 && errno == EINVAL) {
+		/* Older kernel without SUBMIT_ALL */
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = 4 * entries;
+		r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (r->fd < 0) {
+		lancet_perror("io_uring_setup");
+		return -1;
+	}
+
+	sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_sz > sq_sz)
+			sq_sz = cq_sz;
+		cq_sz = sq_sz;
+	}
+	sq_ptr = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		lancet_perror("mmap sq ring");
+		return -1;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else {
+		cq_ptr = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) {
+			lancet_perror("mmap cq ring");
+			return -1;
+		}
+	}
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+				   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+				   IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		lancet_perror("mmap sqes");
+		return -1;
+	}
+
+	r->sq_head = sq_ptr + p.sq_off.head;
+	r->sq_tail = sq_ptr + p.sq_off.tail;
+	r->sq_mask = *(unsigned *)(sq_ptr + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sqe_tail = *r->sq_tail;
+	r->submitted = r->sqe_tail;
+	/* SQE slots are used in ring order, so the index array is fixed */
+	sq_array = sq_ptr + p.sq_off.array;
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	r->cq_head = cq_ptr + p.cq_off.head;
+	r->cq_tail = cq_ptr + p.cq_off.tail;
+	r->cq_mask = *(unsigned *)(cq_ptr + p.cq_off.ring_mask);
+	r->cqes = cq_ptr + p.cq_off.cqes;
+
+	return 0;
+}
+
+static int uring_enter(struct uring *r, unsigned wait_nr)
+{
+	unsigned to_submit;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	to_submit = r->sqe_tail - r->submitted;
+	ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+				  wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (ret < 0) {
+		/* Completion queue backed up or interrupted, retry later */
+		if (errno == EBUSY || errno == EAGAIN || errno == EINTR)
+			return 0;
+		lancet_perror("io_uring_enter");
+		return -1;
+	}
+	r->submitted += ret;
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >=
+		   r->sq_entries) {
+		if (uring_enter(r, 0) < 0)
+			return NULL;
+	}
+	sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqe_tail++;
+	return sqe;
+}
+
+static inline void uring_recycle_buf(struct uring *r, uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &r->br->bufs[r->br_tail & (URING_BUF_COUNT - 1)];
+	buf->addr = (unsigned long)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	r->br_tail++;
+}
+
+static int uring_setup_buffers(struct uring *r)
+{
+	struct io_uring_buf_reg reg;
+	int i, ret;
+
+	r->br = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf),
+				 PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (r->br == MAP_FAILED) {
+		lancet_perror("mmap buffer ring");
+		return -1;
+	}
+	r->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+	assert(r->bufs);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)r->br;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BGID;
+	ret = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+				  &reg, 1);
+	if (ret) {
+		lancet_perror("io_uring_register PBUF_RING");
+		return -1;
+	}
+
+	r->br_tail = 0;
+	for (i = 0; i < URING_BUF_COUNT; i++)
+		uring_recycle_buf(r, i);
+	__atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int uring_arm_recv(struct tcp_connection *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&ring);
+	if (!sqe)
+		return -1;
+	if (get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) {
+		/* The control messages carry the NIC rx timestamp */
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->addr = (unsigned long)&recvmsg_hdr;
+	} else
+		sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->idx;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_UDATA(URING_OP_RECV, conn->idx);
+	return 0;
+}
+
+static int uring_open_connections(void)
+{
+	int i, ret, per_thread_conn, million = 1e6;
+	unsigned entries;
+	int *fds;
+
+	per_thread_conn = get_conn_count() / get_thread_count();
+	connections = calloc(per_thread_conn, sizeof(struct tcp_connection));
+	assert(connections);
+	txs = calloc(per_thread_conn, sizeof(struct uring_tx));
+	assert(txs);
+	dirty_conns = calloc(per_thread_conn, sizeof(uint32_t));
+	assert(dirty_conns);
+	if ((get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) ||
+		(get_agent_type() == SYMMETRIC_AGENT)) {
+		per_conn_tx_timestamps =
+			calloc(per_thread_conn, sizeof(struct pending_tx_timestamps));
+		assert(per_conn_tx_timestamps);
+		for (i = 0; i < per_thread_conn; i++) {
+			per_conn_tx_timestamps[i].pending =
+				calloc(get_max_pending_reqs(), sizeof(struct timestamp_info));
+			assert(per_conn_tx_timestamps[i].pending);
+		}
+	}
+	for (i = 0; i < per_thread_conn; i++) {
+		txs[i].req_bytes = calloc(get_max_pending_reqs(), sizeof(uint32_t));
+		txs[i].req_intended = calloc(get_max_pending_reqs(), sizeof(long));
+		txs[i].req_op_class = calloc(get_max_pending_reqs(), sizeof(int));
+		assert(txs[i].req_bytes && txs[i].req_intended &&
+			   txs[i].req_op_class);
+	}
+
+	fds = malloc(per_thread_conn * sizeof(int));
+	assert(fds);
+	if (tcp_open_sockets(fds, per_thread_conn))
+		return -1;
+	for (i = 0; i < per_thread_conn; i++) {
+		connections[i].fd = fds[i];
+		connections[i].idx = i;
+	}
+
+	if (get_agent_type() == LATENCY_AGENT) {
+		for (i = 0; i < per_thread_conn; i++) {
+			ret = setsockopt(connections[i].fd, SOL_SOCKET, SO_BUSY_POLL,
+							 &million, sizeof(million));
+			if (ret) {
+				lancet_perror("Error setsockopt SO_BUSY_POLL");
+				return -1;
+			}
+		}
+	}
+
+	entries = URING_MIN_ENTRIES;
+	while (entries < 2 * per_thread_conn && entries < URING_MAX_ENTRIES)
+		entries <<= 1;
+	if (uring_setup(&ring, entries))
+		return -1;
+	if (uring_setup_buffers(&ring))
+		return -1;
+
+	ret = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds,
+				  per_thread_conn);
+	free(fds);
+	if (ret) {
+		lancet_perror("io_uring_register FILES");
+		return -1;
+	}
+
+	recvmsg_hdr.msg_controllen = URING_CONTROL_LEN;
+	for (i = 0; i < per_thread_conn; i++)
+		if (uring_arm_recv(&connections[i]))
+			return -1;
+	if (uring_enter(&ring, 0) < 0)
+		return -1;
+
+	return shard_sched_init(&sched, per_thread_conn, get_max_pending_reqs());
+}
+
+/*
+ * Connections with a send in flight are paused in the scheduler, so that
+ * their staging area is not touched until the kernel is done with it.
+ */
+static inline struct tcp_connection *pick_conn()
+{
+	int idx;
+
+	idx = shard_sched_get(&sched);
+	if (idx < 0)
+		return NULL;
+	return &connections[idx];
+}
+
+static void *scratch_reserve(struct uring_tx *tx, size_t len)
+{
+	void *res;
+
+	if (tx->scratch_len + len > tx->scratch_cap) {
+		tx->scratch_cap = 2 * (tx->scratch_len + len);
+		tx->scratch = realloc(tx->scratch, tx->scratch_cap);
+		assert(tx->scratch);
+	}
+	res = &tx->scratch[tx->scratch_len];
+	tx->scratch_len += len;
+	return res;
+}
+
+static void stage_request(struct tcp_connection *conn, struct request *req,
+						  long intended)
+{
+	struct uring_tx *tx = &txs[conn->idx];
+	char *base;
+	uint32_t bytes = 0;
+	int i;
+
+	if (tx->iov_cnt + req->iov_cnt > tx->iov_cap) {
+		tx->iov_cap = 2 * (tx->iov_cnt + req->iov_cnt);
+		tx->iovs = realloc(tx->iovs, tx->iov_cap * sizeof(struct iovec));
+		tx->scratch_off =
+			realloc(tx->scratch_off, tx->iov_cap * sizeof(uint32_t));
+		assert(tx->iovs && tx->scratch_off);
+	}
+
+	for (i = 0; i < req->iov_cnt; i++) {
+		base = req->iovs[i].iov_base;
+		bytes += req->iovs[i].iov_len;
+		if (req->iovs[i].iov_len == 0)
+			continue;
+		if (base >= random_char && base < random_char + MAX_VAL_SIZE) {
+			tx->iovs[tx->iov_cnt] = req->iovs[i];
+			tx->scratch_off[tx->iov_cnt++] = SCRATCH_EXTERNAL;
+			continue;
+		}
+		/* Extend the previous scratch iovec when contiguous */
+		if (tx->iov_cnt && tx->scratch_off[tx->iov_cnt - 1] !=
+							   SCRATCH_EXTERNAL &&
+			tx->scratch_off[tx->iov_cnt - 1] +
+					tx->iovs[tx->iov_cnt - 1].iov_len ==
+				tx->scratch_len) {
+			memcpy(scratch_reserve(tx, req->iovs[i].iov_len), base,
+				   req->iovs[i].iov_len);
+			tx->iovs[tx->iov_cnt - 1].iov_len += req->iovs[i].iov_len;
+			continue;
+		}
+		tx->scratch_off[tx->iov_cnt] = tx->scratch_len;
+		memcpy(scratch_reserve(tx, req->iovs[i].iov_len), base,
+			   req->iovs[i].iov_len);
+		tx->iovs[tx->iov_cnt++].iov_len = req->iovs[i].iov_len;
+	}
+
+	tx->req_intended[tx->reqs] = intended;
+	tx->req_op_class[tx->reqs] = req->op_class;
+	tx->req_bytes[tx->reqs++] = bytes;
+	latency_op_class = req->op_class;
+	tx->bytes += bytes;
+	conn->pending_reqs++;
+	if (!tx->dirty) {
+		tx->dirty = 1;
+		dirty_conns[dirty_count++] = conn->idx;
+	}
+}
+
+static int submit_send(struct tcp_connection *conn)
+{
+	struct uring_tx *tx = &txs[conn->idx];
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&ring);
+	if (!sqe)
+		return -1;
+	tx->hdr.msg_iov = tx->iovs;
+	tx->hdr.msg_iovlen = tx->iov_cnt;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = conn->idx;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->addr = (unsigned long)&tx->hdr;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->user_data = URING_UDATA(URING_OP_SEND, conn->idx);
+	conn_sched_pause(&sched, conn->idx);
+	return 0;
+}
+
+/*
+ * Queue one send per connection with staged requests and submit them all
+ * with a single system call.
+ */
+static int flush_requests(void)
+{
+	struct tcp_connection *conn;
+	struct uring_tx *tx;
+	struct timespec tx_timestamp;
+	long now;
+	struct byte_req_pair send_res;
+	uint32_t i, j;
+
+	if (dirty_count == 0)
+		return 0;
+
+	now = time_ns();
+	ns_to_ts(now, &tx_timestamp);
+	for (i = 0; i < dirty_count; i++) {
+		conn = &connections[dirty_conns[i]];
+		tx = &txs[conn->idx];
+		for (j = 0; j < tx->iov_cnt; j++)
+			if (tx->scratch_off[j] != SCRATCH_EXTERNAL)
+				tx->iovs[j].iov_base = &tx->scratch[tx->scratch_off[j]];
+
+		for (j = 0; j < tx->reqs; j++) {
+			switch (get_agent_type()) {
+			case SYMMETRIC_NIC_TIMESTAMP_AGENT:
+				/* Wire to wire unless -d */
+				add_pending_tx_timestamp(&per_conn_tx_timestamps[conn->idx],
+										 tx->req_bytes[j],
+										 get_intended_latency()
+											 ? now - tx->req_intended[j]
+											 : 0,
+										 tx->req_op_class[j]);
+				break;
+			case SYMMETRIC_AGENT:
+				push_complete_tx_timestamp(&per_conn_tx_timestamps[conn->idx],
+										   &tx_timestamp,
+										   now - tx->req_intended[j],
+										   tx->req_op_class[j]);
+				break;
+			case THROUGHPUT_AGENT:
+				add_tx_timestamp(&tx_timestamp);
+				break;
+			default:
+				break;
+			}
+		}
+
+		/*BookKeeping*/
+		send_res.bytes = tx->bytes;
+		send_res.reqs = tx->reqs;
+		add_throughput_tx_sample(send_res);
+
+		tx->dirty = 0;
+		if (submit_send(conn))
+			return -1;
+	}
+	dirty_count = 0;
+
+	if (get_agent_type() == LATENCY_AGENT)
+		latency_start = time_ns();
+	return uring_enter(&ring, 0);
+}
+
+static void complete_send(struct tcp_connection *conn, int res)
+{
+	struct uring_tx *tx = &txs[conn->idx];
+	int i;
+
+	if (res < 0) {
+		lancet_fprintf(stderr, "Unknown connection error write: %s\n",
+					   strerror(-res));
+		conn->closed = 1;
+		conn_sched_close(&sched, conn->idx);
+		return;
+	}
+
+	tx->bytes -= res;
+	if (tx->bytes == 0) {
+		tx->iov_cnt = 0;
+		tx->scratch_len = 0;
+		tx->reqs = 0;
+		conn_sched_resume(&sched, conn->idx);
+		return;
+	}
+
+	/* Short send, resubmit the rest */
+	for (i = 0; i < tx->iov_cnt; i++) {
+		if (res < tx->iovs[i].iov_len) {
+			tx->iovs[i].iov_len -= res;
+			tx->iovs[i].iov_base += res;
+			break;
+		}
+		res -= tx->iovs[i].iov_len;
+	}
+	memmove(tx->iovs, &tx->iovs[i], (tx->iov_cnt - i) * sizeof(struct iovec));
+	memmove(tx->scratch_off, &tx->scratch_off[i],
+			(tx->iov_cnt - i) * sizeof(uint32_t));
+	tx->iov_cnt -= i;
+	submit_send(conn);
+}
+
+/*
+ * Feed received bytes to the application protocol. Data is parsed in place
+ * in the provided buffer and only a trailing partial response is copied to
+ * the connection buffer.
+ */
+static struct byte_req_pair consume_rx(struct tcp_connection *conn,
+									   char *data, int len)
+{
+	struct byte_req_pair res = {0}, brp;
+	uint32_t n;
+	char *rx_buf;
+
+	while (len > 0) {
+		if (!conn->buffer) {
+			brp = process_response(data, len);
+			if (brp.bytes) {
+				res.bytes += brp.bytes;
+				res.reqs += brp.reqs;
+				data += brp.bytes;
+				len -= brp.bytes;
+				continue;
+			}
+		}
+		rx_buf = tcp_rx_reserve(conn, &n);
+		if (n > len)
+			n = len;
+		memcpy(rx_buf, data, n);
+		conn->buffer_end += n;
+		data += n;
+		len -= n;
+		brp = handle_response(conn);
+		res.bytes += brp.bytes;
+		res.reqs += brp.reqs;
+	}
+	return res;
+}
+
+static void account_response(struct tcp_connection *conn,
+							 struct byte_req_pair read_res,
+							 struct timespec *rx_timestamp)
+{
+	struct timestamp_info *pending_tx = NULL;
+	struct timespec latency;
+	int j, ret;
+	long diff;
+
+	conn->pending_reqs -= read_res.reqs;
+	conn_sched_put(&sched, conn->idx, read_res.reqs);
+
+	switch (get_agent_type()) {
+	case LATENCY_AGENT:
+		/* The agent is closed loop, lateness only counts with -d */
+		add_latency_sample(time_ns() - latency_start,
+						   get_intended_latency() ? latency_start - next_tx : 0,
+						   NULL, latency_op_class);
+		next_tx += get_ia();
+		break;
+	case SYMMETRIC_NIC_TIMESTAMP_AGENT:
+	case SYMMETRIC_AGENT:
+		/*
+		 * Every reply of the read is sampled against its rx timestamp,
+		 * with NIC timestamps the one of its last packet
+		 */
+		for (j = 0; j < read_res.reqs; j++) {
+			pending_tx =
+				pop_pending_tx_timestamps(&per_conn_tx_timestamps[conn->idx]);
+			if (!pending_tx) {
+				ret = get_tx_timestamp(conn->fd,
+									   &per_conn_tx_timestamps[conn->idx]);
+				while (ret != 1)
+					ret = get_tx_timestamp(conn->fd,
+										   &per_conn_tx_timestamps[conn->idx]);
+				pending_tx = pop_pending_tx_timestamps(
+					&per_conn_tx_timestamps[conn->idx]);
+				assert(pending_tx);
+			}
+			ret = timespec_diff(&latency, rx_timestamp, &pending_tx->time);
+			assert(ret == 0);
+			diff = latency.tv_nsec + latency.tv_sec * 1e9;
+			add_latency_sample(diff, pending_tx->sched_delay, &pending_tx->time,
+							   pending_tx->op_class);
+		}
+		break;
+	default:
+		break;
+	}
+
+	/* Bookkeeping */
+	add_throughput_rx_sample(read_res);
+}
+
+static int complete_recv(struct tcp_connection *conn,
+						 struct io_uring_cqe *cqe)
+{
+	struct byte_req_pair read_res;
+	struct timestamp_info rx_info;
+	struct timespec rx_timestamp;
+	struct io_uring_recvmsg_out *out;
+	struct msghdr hdr;
+	char *data;
+	int len, ret;
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+		/* Out of provided buffers or connection error */
+		if (cqe->res == -ENOBUFS || cqe->res == 0)
+			goto REARM;
+		if (conn->closed)
+			return 0;
+		lancet_fprintf(stderr, "Unknown connection error read: %s\n",
+					   strerror(-cqe->res));
+		return -1;
+	}
+
+	data = ring.bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) *
+						   URING_BUF_SIZE;
+	len = cqe->res;
+	if (get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT) {
+		out = (struct io_uring_recvmsg_out *)data;
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_control = data + sizeof(*out) + recvmsg_hdr.msg_namelen;
+		hdr.msg_controllen = out->controllen;
+		ret = extract_rx_timestamp(&hdr, &rx_info);
+		assert(ret == 1);
+		rx_timestamp = rx_info.time;
+		data = hdr.msg_control + recvmsg_hdr.msg_controllen;
+		len = out->payloadlen;
+	} else
+		time_ns_to_ts(&rx_timestamp);
+
+	if (len == 0) {
+		close(conn->fd);
+		lancet_fprintf(stderr, "Connection closed\n");
+		conn->closed = 1;
+		conn_sched_close(&sched, conn->idx);
+	} else {
+		read_res = consume_rx(conn, data, len);
+		if (read_res.reqs > 0)
+			account_response(conn, read_res, &rx_timestamp);
+	}
+	uring_recycle_buf(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+REARM:
+	if (cqe->res == 0 && !conn->closed) {
+		close(conn->fd);
+		lancet_fprintf(stderr, "Connection closed\n");
+		conn->closed = 1;
+		conn_sched_close(&sched, conn->idx);
+	}
+	if (!(cqe->flags & IORING_CQE_F_MORE) && !conn->closed)
+		return uring_arm_recv(conn);
+	return 0;
+}
+
+/*
+ * Returns the number of completions processed or -1 on error
+ */
+static int process_completions(void)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint16_t br_tail;
+	int count = 0;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	br_tail = ring.br_tail;
+	while (head != tail) {
+		cqe = &ring.cqes[head & ring.cq_mask];
+		switch (URING_UDATA_OP(cqe->user_data)) {
+		case URING_OP_SEND:
+			complete_send(&connections[URING_UDATA_IDX(cqe->user_data)],
+						  cqe->res);
+			break;
+		case URING_OP_RECV:
+			if (complete_recv(&connections[URING_UDATA_IDX(cqe->user_data)],
+							  cqe))
+				return -1;
+			break;
+		default:
+			assert(0);
+		}
+		head++;
+		count++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	if (br_tail != ring.br_tail)
+		__atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+	/* Submit re-armed receives and resent remainders */
+	if (ring.sqe_tail != ring.submitted && uring_enter(&ring, 0) < 0)
+		return -1;
+	return count;
+}
+
+/*
+ * NIC tx timestamps are not reported through the ring, collect them before
+ * they pile up in the error queues.
+ */
+static void drain_tx_timestamps(void)
+{
+	int i, conn_per_thread;
+	struct pending_tx_timestamps *pending;
+
+	conn_per_thread = get_conn_count() / get_thread_count();
+	for (i = 0; i < conn_per_thread; i++) {
+		pending = &per_conn_tx_timestamps[i];
+		while (pending->head != pending->tail &&
+			   get_tx_timestamp(connections[i].fd, pending) == 1)
+			;
+	}
+}
+
+static void uring_main(void)
+{
+	struct tcp_connection *conn;
+
+	if (uring_open_connections())
+		return;
+
+	pthread_barrier_wait(&conn_open_barrier);
+
+	next_tx = time_ns();
+	while (1) {
+		if (!should_load()) {
+			next_tx = time_ns();
+			backlog_clear();
+			continue;
+		}
+		backlog_fill(&next_tx);
+		while (backlog_count()) {
+			conn = pick_conn();
+			if (!conn)
+				break;
+			stage_request(conn, prepare_request(), backlog_pop());
+		}
+		if (flush_requests() < 0)
+			return;
+		if (get_agent_type() == SYMMETRIC_NIC_TIMESTAMP_AGENT)
+			drain_tx_timestamps();
+		/* process responses */
+		if (process_completions() < 0)
+			return;
+	}
+}
+
+static void latency_uring_main(void)
+{
+	struct tcp_connection *conn;
+
+	if (uring_open_connections())
+		exit(-1);
+
+	next_tx = time_ns();
+	while (1) {
+		if (!should_load()) {
+			next_tx = time_ns();
+			continue;
+		}
+		if (time_ns() < next_tx) {
+			pace_wait(next_tx);
+			continue;
+		}
+		conn = pick_conn();
+		if (!conn)
+			continue;
+
+		stage_request(conn, prepare_request(), next_tx);
+		if (flush_requests() < 0)
+			return;
+		/* Spin on the completion queue, next_tx moves on the reply */
+		while (conn->pending_reqs && !conn->closed)
+			if (process_completions() < 0)
+				return;
+	}
+}
+
+struct transport_protocol *init_uring(void)
+{
+	struct transport_protocol *tp;
+
+	tp = malloc(sizeof(struct transport_protocol));
+	if (!tp) {
+		lancet_fprintf(stderr, "Failed to alloc transport_protocol\n");
+		return NULL;
+	}
+
+	tp->tp_main[THROUGHPUT_AGENT] = uring_main;
+	tp->tp_main[LATENCY_AGENT] = latency_uring_main;
+	tp->tp_main[SYMMETRIC_NIC_TIMESTAMP_AGENT] = uring_main;
+	tp->tp_main[SYMMETRIC_AGENT] = uring_main;
+
+	return tp;
+}
@@ -0,0 +1,859 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * UDP over AF_XDP. Every agent thread owns one XDP socket bound to the
+ * NIC queue with the same index as the thread, with its own UMEM. Frames
+ * are built and parsed here, so the kernel UDP stack is bypassed in both
+ * directions. A small XDP program redirects the UDP replies to the agent
+ * ports to the socket of the queue they arrive on, and passes everything
+ * else to the kernel. The interface needs one rx queue per thread, and
+ * with more than one queue the replies to a thread's ports have to be
+ * steered to its queue, e.g. with ethtool flow rules, since RSS spreads
+ * them over all queues.
+ *
+ * The sockets run in copy mode, or in zero-copy mode with -z. The program
+ * and the socket rings are driven through the raw system calls to avoid
+ * depending on libbpf or libxdp.
+ */
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lancet/backlog.h>
+#include <lancet/conn_sched.h>
+#include <lancet/error.h>
+#include <lancet/misc.h>
+#include <lancet/timestamping.h>
+#include <lancet/tp_proto.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_NUM_FRAMES 4096
+#define XDP_FRAME_SIZE 2048 // power of 2
+#define XDP_RING_SIZE 2048 // half of the frames for rx, half for tx
+#define XDP_BATCH 64
+#define XDP_PORT_BASE 40000
+#define XDP_HDR_LEN                                                            \
+	(sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr))
+#define XDP_MAX_PAYLOAD (1500 - sizeof(struct iphdr) - sizeof(struct udphdr))
+#define XDP_LOG_SIZE 4096
+
+#define BPF_INSN(c, d, s, o, i)                                                \
+	((struct bpf_insn){                                                        \
+		.code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+
+struct xdp_ring {
+	uint32_t *producer;
+	uint32_t *consumer;
+	uint32_t *flags;
+	void *descs;
+	uint32_t mask;
+	uint32_t size;
+	uint32_t cached_prod;
+	uint32_t cached_cons;
+};
+
+/*
+ * Every connection is a local UDP port towards one target
+ */
+struct xdp_port {
+	uint16_t port;
+	uint16_t target;
+	uint32_t taken;
+};
+
+/* Shared by all threads, set once by xdp_setup */
+static pthread_once_t setup_once = PTHREAD_ONCE_INIT;
+static int setup_ret;
+static int ifindex;
+static uint8_t src_mac[ETH_ALEN];
+static uint32_t src_ip;
+static uint8_t (*target_macs)[ETH_ALEN];
+static int xsks_map_fd;
+static int link_fd;
+
+static __thread int xsk_fd;
+static __thread char *umem;
+static __thread struct xdp_ring fill_ring;
+static __thread struct xdp_ring comp_ring;
+static __thread struct xdp_ring rx_ring;
+static __thread struct xdp_ring tx_ring;
+static __thread uint64_t *tx_frames; // stack of free tx frames
+static __thread uint32_t tx_frame_count;
+static __thread uint32_t bind_flags;
+static __thread struct xdp_port *ports;
+static __thread uint32_t port_base;
+static __thread uint32_t port_count;
+static __thread struct pending_tx_timestamps *per_port_tx_timestamps;
+static __thread struct conn_sched sched;
+
+static int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * Returns 0 if the MAC of ip is in the ARP table of the interface
+ */
+static int arp_lookup(uint32_t ip, uint8_t *mac)
+{
+	char line[256], ip_str[64], hw_str[64], dev[IF_NAMESIZE];
+	unsigned int flags;
+	struct in_addr addr;
+	FILE *f;
+	int found = -1;
+
+	f = fopen("/proc/net/arp", "r");
+	if (!f)
+		return -1;
+	/* Skip the header */
+	if (!fgets(line, sizeof(line), f)) {
+		fclose(f);
+		return -1;
+	}
+	while (found && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%63s %*s %x %63s %*s %15s", ip_str, &flags, hw_str,
+				   dev) != 4)
+			continue;
+		if (!(flags & ATF_COM) || strcmp(dev, get_if_name()) ||
+			!inet_aton(ip_str, &addr) || addr.s_addr != ip)
+			continue;
+		if (sscanf(hw_str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1],
+				   &mac[2], &mac[3], &mac[4], &mac[5]) == 6)
+			found = 0;
+	}
+	fclose(f);
+	return found;
+}
+
+/*
+ * Look up the MAC of a target. If it is not known yet, send an empty
+ * datagram to its discard port through the kernel to trigger ARP.
+ */
+static int resolve_mac(uint32_t ip, uint8_t *mac)
+{
+	struct sockaddr_in addr = {0};
+	int i, fd;
+
+	if (arp_lookup(ip, mac) == 0)
+		return 0;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		lancet_perror("socket");
+		return -1;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, get_if_name(),
+				   strlen(get_if_name()))) {
+		lancet_perror("setsockopt SO_BINDTODEVICE");
+		close(fd);
+		return -1;
+	}
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(9);
+	addr.sin_addr.s_addr = ip;
+	sendto(fd, NULL, 0, 0, (struct sockaddr *)&addr, sizeof(addr));
+	close(fd);
+
+	for (i = 0; i < 100; i++) {
+		usleep(10000);
+		if (arp_lookup(ip, mac) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+static int read_if_addresses(void)
+{
+	struct ifreq ifr = {0};
+	int fd, ret = -1;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		lancet_perror("socket");
+		return -1;
+	}
+	strncpy(ifr.ifr_name, get_if_name(), IF_NAMESIZE - 1);
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr)) {
+		lancet_perror("ioctl SIOCGIFHWADDR");
+		goto out;
+	}
+	memcpy(src_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+	if (ioctl(fd, SIOCGIFADDR, &ifr)) {
+		lancet_perror("ioctl SIOCGIFADDR");
+		goto out;
+	}
+	src_ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * The XDP program hands a reply to the socket of the queue it arrives on, so
+ * every thread needs its own rx queue. Devices without channels have one.
+ */
+static int check_rx_queues(void)
+{
+	struct ethtool_channels channels = {.cmd = ETHTOOL_GCHANNELS};
+	struct ifreq ifr = {0};
+	uint32_t queues = 1;
+	int fd, t, per_thread_conn;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		lancet_perror("socket");
+		return -1;
+	}
+	strncpy(ifr.ifr_name, get_if_name(), IF_NAMESIZE - 1);
+	ifr.ifr_data = (void *)&channels;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) == 0)
+		queues = channels.rx_count + channels.combined_count;
+	else if (errno != EOPNOTSUPP) {
+		lancet_perror("ioctl ETHTOOL_GCHANNELS");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (queues != (uint32_t)get_thread_count()) {
+		lancet_fprintf(stderr,
+					   "XDP needs one rx queue per thread, %s has %u for %d "
+					   "threads (ethtool -L %s combined %d)\n",
+					   get_if_name(), queues, get_thread_count(),
+					   get_if_name(), get_thread_count());
+		return -1;
+	}
+	if (queues == 1)
+		return 0;
+	per_thread_conn = get_conn_count() / get_thread_count();
+	for (t = 0; t < get_thread_count(); t++)
+		lancet_fprintf(stderr,
+					   "Replies to UDP ports %d-%d must be steered to rx "
+					   "queue %d\n",
+					   XDP_PORT_BASE + t * per_thread_conn,
+					   XDP_PORT_BASE + (t + 1) * per_thread_conn - 1, t);
+	return 0;
+}
+
+/*
+ * Load the XDP program and attach it to the interface. It redirects IPv4
+ * UDP frames without IP options whose destination port is one of the
+ * agent ports to xsks_map[rx_queue_index], all other frames pass.
+ */
+static int load_xdp_program(uint16_t first_port, uint16_t port_cnt)
+{
+	union bpf_attr attr;
+	char log[XDP_LOG_SIZE];
+	int prog_fd;
+	struct bpf_insn prog[] = {
+		/* r6 = ctx, r2 = data, r3 = data_end */
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 1,
+				 offsetof(struct xdp_md, data), 0),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 3, 1,
+				 offsetof(struct xdp_md, data_end), 0),
+		/* Bounds check for the eth, ip and udp headers */
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, XDP_HDR_LEN),
+		BPF_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 16, 0),
+		/* IPv4, no options, UDP */
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2,
+				 offsetof(struct ethhdr, h_proto), 0),
+		BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 14, htons(ETH_P_IP)),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2, sizeof(struct ethhdr), 0),
+		BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 12, 0x45),
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_B, 4, 2,
+				 sizeof(struct ethhdr) + offsetof(struct iphdr, protocol), 0),
+		BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 10, IPPROTO_UDP),
+		/* Destination port in [first_port, first_port + port_cnt) */
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_H, 4, 2,
+				 sizeof(struct ethhdr) + sizeof(struct iphdr) +
+					 offsetof(struct udphdr, dest),
+				 0),
+		BPF_INSN(BPF_ALU | BPF_END | BPF_TO_BE, 4, 0, 0, 16),
+		BPF_INSN(BPF_JMP | BPF_JLT | BPF_K, 4, 0, 7, first_port),
+		BPF_INSN(BPF_JMP | BPF_JGE | BPF_K, 4, 0, 6, first_port + port_cnt),
+		/* return bpf_redirect_map(&xsks_map, rx_queue_index, XDP_PASS) */
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+				 offsetof(struct xdp_md, rx_queue_index), 0),
+		BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0,
+				 xsks_map_fd),
+		BPF_INSN(0, 0, 0, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+		BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* pass: */
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(unsigned long)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(struct bpf_insn);
+	attr.license = (uint64_t)(unsigned long)"Dual MIT/GPL";
+	attr.log_buf = (uint64_t)(unsigned long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	log[0] = '\0';
+	prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (prog_fd < 0) {
+		lancet_perror("BPF_PROG_LOAD");
+		lancet_fprintf(stderr, "%s\n", log);
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	/* The program stays attached as long as the link is open */
+	link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (link_fd < 0) {
+		lancet_perror("Error attaching the XDP program");
+		return -1;
+	}
+	return 0;
+}
+
+static void xdp_setup(void)
+{
+	struct rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY};
+	union bpf_attr attr;
+	int i, per_thread_conn;
+
+	setup_ret = -1;
+	ifindex = if_nametoindex(get_if_name());
+	if (!ifindex) {
+		lancet_fprintf(stderr, "XDP needs the interface name (-n)\n");
+		return;
+	}
+	if (read_if_addresses() || check_rx_queues())
+		return;
+
+	target_macs = calloc(get_target_count(), ETH_ALEN);
+	assert(target_macs);
+	for (i = 0; i < get_target_count(); i++) {
+		if (resolve_mac(get_targets()[i].ip, target_macs[i])) {
+			lancet_fprintf(stderr, "Failed to resolve the MAC of target %d\n",
+						   i);
+			return;
+		}
+	}
+
+	/* Older kernels account the UMEM and the maps to RLIMIT_MEMLOCK */
+	setrlimit(RLIMIT_MEMLOCK, &rlim);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = get_thread_count();
+	xsks_map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (xsks_map_fd < 0) {
+		lancet_perror("BPF_MAP_CREATE");
+		return;
+	}
+
+	per_thread_conn = get_conn_count() / get_thread_count();
+	if (XDP_PORT_BASE + per_thread_conn * get_thread_count() > UINT16_MAX) {
+		lancet_fprintf(stderr, "Too many connections for XDP\n");
+		return;
+	}
+	if (load_xdp_program(XDP_PORT_BASE, per_thread_conn * get_thread_count()))
+		return;
+
+	setup_ret = 0;
+}
+
+static int xdp_ring_map(struct xdp_ring *r, struct xdp_ring_offset *off,
+						size_t desc_size, off_t pgoff)
+{
+	void *map;
+
+	map = mmap(NULL, off->desc + XDP_RING_SIZE * desc_size,
+			   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk_fd, pgoff);
+	if (map == MAP_FAILED) {
+		lancet_perror("mmap xdp ring");
+		return -1;
+	}
+	r->producer = map + off->producer;
+	r->consumer = map + off->consumer;
+	r->flags = map + off->flags;
+	r->descs = map + off->desc;
+	r->size = XDP_RING_SIZE;
+	r->mask = XDP_RING_SIZE - 1;
+	r->cached_prod = *r->producer;
+	r->cached_cons = *r->consumer;
+	return 0;
+}
+
+/*
+ * Free slots of a ring we produce to
+ */
+static inline uint32_t xdp_ring_free(struct xdp_ring *r)
+{
+	r->cached_cons = __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE);
+	return r->size - (r->cached_prod - r->cached_cons);
+}
+
+/*
+ * Ready entries of a ring we consume from
+ */
+static inline uint32_t xdp_ring_ready(struct xdp_ring *r)
+{
+	r->cached_prod = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+	return r->cached_prod - r->cached_cons;
+}
+
+static inline void xdp_ring_submit(struct xdp_ring *r)
+{
+	__atomic_store_n(r->producer, r->cached_prod, __ATOMIC_RELEASE);
+}
+
+static inline void xdp_ring_release(struct xdp_ring *r)
+{
+	__atomic_store_n(r->consumer, r->cached_cons, __ATOMIC_RELEASE);
+}
+
+static int xsk_open(void)
+{
+	struct xdp_umem_reg mr = {0};
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp = {0};
+	union bpf_attr attr;
+	socklen_t optlen;
+	uint32_t i, queue, ring_size = XDP_RING_SIZE;
+
+	pthread_once(&setup_once, xdp_setup);
+	if (setup_ret)
+		return -1;
+
+	xsk_fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (xsk_fd < 0) {
+		lancet_perror("socket AF_XDP");
+		return -1;
+	}
+
+	umem = mmap(NULL, XDP_NUM_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (umem == MAP_FAILED) {
+		lancet_perror("mmap umem");
+		return -1;
+	}
+	mr.addr = (uint64_t)(unsigned long)umem;
+	mr.len = XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+	mr.chunk_size = XDP_FRAME_SIZE;
+	if (setsockopt(xsk_fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr))) {
+		lancet_perror("setsockopt XDP_UMEM_REG");
+		return -1;
+	}
+	if (setsockopt(xsk_fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size,
+				   sizeof(ring_size)) ||
+		setsockopt(xsk_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size,
+				   sizeof(ring_size)) ||
+		setsockopt(xsk_fd, SOL_XDP, XDP_RX_RING, &ring_size,
+				   sizeof(ring_size)) ||
+		setsockopt(xsk_fd, SOL_XDP, XDP_TX_RING, &ring_size,
+				   sizeof(ring_size))) {
+		lancet_perror("setsockopt xdp ring size");
+		return -1;
+	}
+
+	optlen = sizeof(off);
+	if (getsockopt(xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+		lancet_perror("getsockopt XDP_MMAP_OFFSETS");
+		return -1;
+	}
+	if (xdp_ring_map(&fill_ring, &off.fr, sizeof(uint64_t),
+					 XDP_UMEM_PGOFF_FILL_RING) ||
+		xdp_ring_map(&comp_ring, &off.cr, sizeof(uint64_t),
+					 XDP_UMEM_PGOFF_COMPLETION_RING) ||
+		xdp_ring_map(&rx_ring, &off.rx, sizeof(struct xdp_desc),
+					 XDP_PGOFF_RX_RING) ||
+		xdp_ring_map(&tx_ring, &off.tx, sizeof(struct xdp_desc),
+					 XDP_PGOFF_TX_RING))
+		return -1;
+
+	/* The first half of the frames is for rx, the second half for tx */
+	for (i = 0; i < XDP_RING_SIZE; i++)
+		((uint64_t *)fill_ring.descs)[fill_ring.cached_prod++ &
+									  fill_ring.mask] = i * XDP_FRAME_SIZE;
+	xdp_ring_submit(&fill_ring);
+	tx_frames = malloc((XDP_NUM_FRAMES - XDP_RING_SIZE) * sizeof(uint64_t));
+	assert(tx_frames);
+	for (i = XDP_RING_SIZE; i < XDP_NUM_FRAMES; i++)
+		tx_frames[tx_frame_count++] = i * XDP_FRAME_SIZE;
+
+	queue = get_agent_tid();
+	bind_flags = XDP_USE_NEED_WAKEUP | (get_zerocopy() ? XDP_ZEROCOPY : XDP_COPY);
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = bind_flags;
+	if (bind(xsk_fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+		lancet_perror("bind AF_XDP");
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = xsks_map_fd;
+	attr.key = (uint64_t)(unsigned long)&queue;
+	attr.value = (uint64_t)(unsigned long)&xsk_fd;
+	attr.flags = BPF_ANY;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+		lancet_perror("Error adding the XDP socket to the map");
+		return -1;
+	}
+	return 0;
+}
+
+static int xdp_open_ports(void)
+{
+	int i, per_thread_conn, fifo_size, depth = 1;
+
+	if (xsk_open())
+		return -1;
+
+	per_thread_conn = get_conn_count() / get_thread_count();
+	fifo_size = get_max_pending_reqs() > 0 ? get_max_pending_reqs() : 1;
+	/*
+	 * Replies are matched to the requests of a port by arrival order, so
+	 * only the throughput agent keeps up to -o outstanding per port, see
+	 * udp_batch_init.
+	 */
+	if (get_agent_type() == THROUGHPUT_AGENT)
+		depth = fifo_size;
+	port_count = per_thread_conn;
+	port_base = XDP_PORT_BASE + get_agent_tid() * per_thread_conn;
+	ports = calloc(per_thread_conn, sizeof(struct xdp_port));
+	assert(ports);
+	per_port_tx_timestamps =
+		calloc(per_thread_conn, sizeof(struct pending_tx_timestamps));
+	assert(per_port_tx_timestamps);
+	for (i = 0; i < per_thread_conn; i++) {
+		ports[i].port = port_base + i;
+		ports[i].target = i % get_target_count();
+		per_port_tx_timestamps[i].pending =
+			calloc(fifo_size, sizeof(struct timestamp_info));
+		assert(per_port_tx_timestamps[i].pending);
+	}
+	add_conn_open(per_thread_conn);
+
+	return conn_sched_init(&sched, per_thread_conn, depth);
+}
+
+static inline uint16_t ip_checksum(void *hdr, int len)
+{
+	uint16_t *p = hdr;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+/*
+ * Write the frame of a request into the umem. Returns the frame length.
+ */
+static uint32_t build_frame(char *frame, struct xdp_port *port,
+							struct request *req)
+{
+	struct ethhdr *eth = (struct ethhdr *)frame;
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	struct host_tuple *target = &get_targets()[port->target];
+	char *payload = (char *)(udp + 1);
+	uint32_t len = 0;
+	int i;
+
+	for (i = 0; i < req->iov_cnt; i++) {
+		assert(len + req->iovs[i].iov_len <= XDP_MAX_PAYLOAD);
+		memcpy(&payload[len], req->iovs[i].iov_base, req->iovs[i].iov_len);
+		len += req->iovs[i].iov_len;
+	}
+
+	memcpy(eth->h_dest, target_macs[port->target], ETH_ALEN);
+	memcpy(eth->h_source, src_mac, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+
+	ip->version = 4;
+	ip->ihl = sizeof(struct iphdr) / 4;
+	ip->tos = 0;
+	ip->tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + len);
+	ip->id = 0;
+	ip->frag_off = htons(IP_DF);
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->check = 0;
+	ip->saddr = src_ip;
+	ip->daddr = target->ip;
+	ip->check = ip_checksum(ip, sizeof(struct iphdr));
+
+	udp->source = htons(port->port);
+	udp->dest = htons(target->port);
+	udp->len = htons(sizeof(struct udphdr) + len);
+	udp->check = 0; // optional over IPv4
+
+	return XDP_HDR_LEN + len;
+}
+
+static inline void xdp_kick_tx(void)
+{
+	if (!(bind_flags & XDP_USE_NEED_WAKEUP) ||
+		(*tx_ring.flags & XDP_RING_NEED_WAKEUP))
+		sendto(xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+static void reclaim_tx_frames(void)
+{
+	uint32_t i, ready;
+
+	ready = xdp_ring_ready(&comp_ring);
+	for (i = 0; i < ready; i++)
+		tx_frames[tx_frame_count++] =
+			((uint64_t *)comp_ring.descs)[comp_ring.cached_cons++ &
+										  comp_ring.mask];
+	if (ready)
+		xdp_ring_release(&comp_ring);
+}
+
+/*
+ * Send up to one batch of the requests in the backlog
+ */
+static void xdp_send_batch(void)
+{
+	struct xdp_port *batch_ports[XDP_BATCH];
+	long intended[XDP_BATCH];
+	int op_class[XDP_BATCH];
+	struct byte_req_pair send_res = {0};
+	struct request *to_send;
+	struct xdp_desc *desc;
+	struct xdp_port *port;
+	struct timespec now;
+	uint32_t i, count, free;
+	long now_ns;
+	int idx;
+
+	reclaim_tx_frames();
+	free = xdp_ring_free(&tx_ring);
+	for (count = 0; count < XDP_BATCH && count < free && tx_frame_count &&
+					backlog_count();
+		 count++) {
+		idx = conn_sched_get(&sched);
+		if (idx < 0)
+			break;
+		port = &ports[idx];
+		port->taken++;
+		intended[count] = backlog_pop();
+		batch_ports[count] = port;
+
+		desc = &((struct xdp_desc *)tx_ring.descs)[tx_ring.cached_prod++ &
+												   tx_ring.mask];
+		desc->addr = tx_frames[--tx_frame_count];
+		to_send = prepare_request();
+		op_class[count] = to_send->op_class;
+		desc->len = build_frame(umem + desc->addr, port, to_send);
+		desc->options = 0;
+		send_res.bytes += desc->len - XDP_HDR_LEN;
+	}
+	if (count == 0)
+		return;
+
+	xdp_ring_submit(&tx_ring);
+	xdp_kick_tx();
+
+	now_ns = time_ns();
+	ns_to_ts(now_ns, &now);
+	for (i = 0; i < count; i++) {
+		if (get_agent_type() == THROUGHPUT_AGENT)
+			add_tx_timestamp(&now);
+		else
+			push_complete_tx_timestamp(
+				&per_port_tx_timestamps[batch_ports[i] - ports], &now,
+				now_ns - intended[i], op_class[i]);
+	}
+
+	/*BookKeeping*/
+	send_res.reqs = count;
+	add_throughput_tx_sample(send_res);
+}
+
+static void xdp_handle_frame(char *frame, uint32_t len,
+							 struct timespec *rx_timestamp,
+							 struct byte_req_pair *rx_res)
+{
+	struct iphdr *ip = (struct iphdr *)(frame + sizeof(struct ethhdr));
+	struct udphdr *udp = (struct udphdr *)(ip + 1);
+	struct byte_req_pair read_res;
+	struct timestamp_info *pending_tx;
+	struct timespec latency;
+	struct xdp_port *port;
+	uint32_t idx, payload_len;
+
+	if (len < XDP_HDR_LEN)
+		return;
+	/* Replies to the ports of other threads are dropped */
+	idx = ntohs(udp->dest) - port_base;
+	if (idx >= port_count)
+		return;
+	port = &ports[idx];
+	payload_len = ntohs(udp->len) - sizeof(struct udphdr);
+	if (payload_len > len - XDP_HDR_LEN)
+		return;
+
+	read_res = process_response(frame + XDP_HDR_LEN, payload_len);
+	rx_res->bytes += read_res.bytes;
+	rx_res->reqs += read_res.reqs;
+
+	if (get_agent_type() != THROUGHPUT_AGENT) {
+		pending_tx = pop_pending_tx_timestamps(&per_port_tx_timestamps[idx]);
+		if (pending_tx &&
+			timespec_diff(&latency, rx_timestamp, &pending_tx->time) == 0)
+			add_latency_sample(latency.tv_nsec + latency.tv_sec * 1e9,
+							   pending_tx->sched_delay, &pending_tx->time,
+							   pending_tx->op_class);
+	}
+
+	/* Mark the port as available */
+	if (read_res.reqs > port->taken)
+		read_res.reqs = port->taken;
+	port->taken -= read_res.reqs;
+	conn_sched_put(&sched, idx, read_res.reqs);
+}
+
+/*
+ * Receive up to one batch of frames and give the frames back to the
+ * fill ring
+ */
+static void xdp_recv_batch(void)
+{
+	struct byte_req_pair rx_res = {0};
+	struct timespec rx_timestamp;
+	struct xdp_desc *desc;
+	uint32_t i, ready;
+
+	ready = xdp_ring_ready(&rx_ring);
+	if (ready == 0) {
+		if (*fill_ring.flags & XDP_RING_NEED_WAKEUP)
+			recvfrom(xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		return;
+	}
+	if (ready > XDP_BATCH)
+		ready = XDP_BATCH;
+
+	/* Frames received together share the rx timestamp */
+	time_ns_to_ts(&rx_timestamp);
+	for (i = 0; i < ready; i++) {
+		desc = &((struct xdp_desc *)rx_ring.descs)[rx_ring.cached_cons++ &
+												   rx_ring.mask];
+		xdp_handle_frame(umem + desc->addr, desc->len, &rx_timestamp,
+						 &rx_res);
+		/* There are as many rx frames as fill ring slots */
+		((uint64_t *)fill_ring.descs)[fill_ring.cached_prod++ &
+									  fill_ring.mask] =
+			desc->addr & ~((uint64_t)XDP_FRAME_SIZE - 1);
+	}
+	xdp_ring_release(&rx_ring);
+	xdp_ring_submit(&fill_ring);
+
+	/* Bookkeeping */
+	add_throughput_rx_sample(rx_res);
+}
+
+/*
+ * Used by the throughput, latency and symmetric agents. Due requests are
+ * sent open loop in batches, up to -o per port for the throughput agent
+ * and one per port otherwise.
+ */
+static void xdp_main(void)
+{
+	long next_tx;
+
+	if (xdp_open_ports())
+		return;
+
+	next_tx = time_ns();
+	while (1) {
+		if (!should_load()) {
+			next_tx = time_ns();
+			backlog_clear();
+			continue;
+		}
+		backlog_fill(&next_tx);
+		if (backlog_count())
+			xdp_send_batch();
+		xdp_recv_batch();
+	}
+}
+
+struct transport_protocol *init_xdp(void)
+{
+	struct transport_protocol *tp;
+
+	tp = malloc(sizeof(struct transport_protocol));
+	if (!tp) {
+		lancet_fprintf(stderr, "Failed to alloc transport_protocol\n");
+		return NULL;
+	}
+
+	tp->tp_main[THROUGHPUT_AGENT] = xdp_main;
+	tp->tp_main[LATENCY_AGENT] = xdp_main;
+	/* The frames never reach the kernel stack, -a 2 is refused by args.c */
+	tp->tp_main[SYMMETRIC_NIC_TIMESTAMP_AGENT] = NULL;
+	tp->tp_main[SYMMETRIC_AGENT] = xdp_main;
+
+	return tp;
+}
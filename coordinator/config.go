@@ -33,16 +33,29 @@ import (
 )
 
 type ServerConfig struct {
-	target     string
-	thThreads  int
-	ltThreads  int
-	thConn     int
-	ltConn     int
-	idist      string
-	appProto   string
-	comProto   string
-	ifName     string
-	reqPerConn int
+	target      string
+	thThreads   int
+	ltThreads   int
+	thConn      int
+	ltConn      int
+	idist       string
+	appProto    string
+	comProto    string
+	ifName      string
+	reqPerConn  int
+	ltReqs      int
+	udpBatch    int
+	connWave    int
+	intendLat   bool
+	cpuList     string
+	numaNode    string
+	zeroCopy    bool
+	kTLS        bool
+	keyRouting  string
+	churnReqs   int
+	tlsResume   bool
+	pacingSpin  int
+	statsWindow int
 }
 
 type ExperimentConfig struct {
@@ -55,6 +68,7 @@ type ExperimentConfig struct {
 	ciSize         int
 	nicTS          bool
 	privateKeyPath string
+	timeSeries     string
 }
 
 type GeneralConfig struct {
@@ -66,7 +80,7 @@ func ParseConfig() (*ServerConfig, *ExperimentConfig, *GeneralConfig, error) {
 	currentUser, _ := user.Current()
 	id_rsa_path := path.Join(currentUser.HomeDir, ".ssh/id_rsa")
 	var agentPort = flag.Int("agentPort", 5001, "listening port of the agent")
-	var target = flag.String("targetHost", "127.0.0.1:8000", "host:port comma-separated list to run experiment against")
+	var target = flag.String("targetHost", "127.0.0.1:8000", "host:port comma-separated list to run experiment against, socket paths for UNIX and UNIXPACKET")
 	var thAgents = flag.String("loadAgents", "", "ip of loading agents separated by commas, e.g. ip1,ip2,...")
 	var ltAgents = flag.String("ltAgents", "", "ip of latency agents separated by commas, e.g. ip1,ip2,...")
 	var symAgents = flag.String("symAgents", "", "ip of symmetric agents separated by commas, e.g. ip1,ip2,...")
@@ -76,14 +90,28 @@ func ParseConfig() (*ServerConfig, *ExperimentConfig, *GeneralConfig, error) {
 	var ltConn = flag.Int("ltConns", 1, "number of latency connections")
 	var idist = flag.String("idist", "exp", "interarrival distibution: fixed, exp")
 	var appProto = flag.String("appProto", "echo:4", "application protocol")
-	var comProto = flag.String("comProto", "TCP", "TCP|R2P2|UDP|TLS")
+	var comProto = flag.String("comProto", "TCP", "TCP|R2P2|UDP|TLS|URING|XDP|UNIX|UNIXPACKET")
 	var ltRate = flag.Int("lqps", 4000, "latency qps")
 	var loadPattern = flag.String("loadPattern", "fixed:10000", "load pattern")
 	var ciSize = flag.Int("ciSize", 10, "size of 95-confidence interval in us")
 	var nicTS = flag.Bool("nicTS", false, "NIC timestamping for symmetric agents")
 	var privateKey = flag.String("privateKey", id_rsa_path, "location of the (local) private key to deploy the agents. Will find a default if not specified")
-	var ifName = flag.String("ifName", "enp65s0", "interface name for hardware timestamping")
+	var ifName = flag.String("ifName", "enp65s0", "interface name for hardware timestamping and XDP")
 	var reqPerConn = flag.Int("reqPerConn", 1, "Number of outstanding requests per TCP connection")
+	var ltReqs = flag.Int("ltReqPerConn", 1, "Number of outstanding requests per latency connection, above 1 the latency agent runs open loop (with UDP every connection opens this many sockets)")
+	var udpBatch = flag.Int("udpBatch", 0, "Max UDP requests per sendmmsg/recvmmsg, 0 disables batching. Load agents batch up to reqPerConn requests per connection, sym agents one request per target on a socket shared by the targets")
+	var connWave = flag.Int("connWave", 512, "Max TCP connection attempts in flight per agent thread during setup")
+	var intendLat = flag.Bool("intendedLat", false, "Also report latency from the intended send time of latency and sym agents")
+	var cpuList = flag.String("cpuList", "", "CPUs of the agent threads, e.g. 0-7,16-23 (default: every CPU, or the CPUs of numaNode)")
+	var numaNode = flag.String("numaNode", "", "NUMA node of the agent threads and their memory, or nic for the node of ifName")
+	var zeroCopy = flag.Bool("zeroCopy", false, "Send large SET and STSS values with MSG_ZEROCOPY (TCP), or bind the XDP sockets in zero-copy mode (XDP), not with nicTS")
+	var kTLS = flag.Bool("kTLS", false, "Hand the TLS records to kernel TLS after the handshake, falling back to user-space TLS without it, not with nicTS")
+	var churnReqs = flag.Int("churnReqs", 0, "Close and reopen each load and sym connection after this many requests (TCP, TLS and UNIX), 0 keeps them open")
+	var keyRouting = flag.String("keyRouting", "", "Send KV requests to the target that owns their key: ketama (memcached consistent hashing) or slots (Redis cluster CRC16 slots split evenly in targetHost order), default spreads by connection")
+	var tlsResume = flag.Bool("tlsResume", false, "Resume the TLS session when churnReqs reopens a connection")
+	var pacingSpin = flag.Int("pacingSpin", 0, "Park idle agent threads and let latency agents sleep until this many us before each send, 0 always busy-waits")
+	var statsWindow = flag.Int("statsWindow", 100, "Length in ms of the windows of the agent stats time series")
+	var timeSeries = flag.String("timeSeries", "", "Write the throughput and latency of every stats window of the agents to this CSV file while measuring")
 	var runAgents = flag.Bool("runAgents", true, "Automatically run agents")
 	var printAgentArgs = flag.Bool("printAgentArgs", false, "Print in JSON format the arguments for each agent")
 
@@ -112,6 +140,24 @@ func ParseConfig() (*ServerConfig, *ExperimentConfig, *GeneralConfig, error) {
 	serverCfg.comProto = *comProto
 	serverCfg.ifName = *ifName
 	serverCfg.reqPerConn = *reqPerConn
+	serverCfg.ltReqs = *ltReqs
+	// A UDP socket carries one request at a time, so every latency
+	// connection gets ltReqPerConn sockets
+	if *comProto == "UDP" && *ltReqs > 1 {
+		serverCfg.ltConn = *ltConn * *ltReqs
+	}
+	serverCfg.udpBatch = *udpBatch
+	serverCfg.connWave = *connWave
+	serverCfg.intendLat = *intendLat
+	serverCfg.cpuList = *cpuList
+	serverCfg.numaNode = *numaNode
+	serverCfg.zeroCopy = *zeroCopy
+	serverCfg.kTLS = *kTLS
+	serverCfg.keyRouting = *keyRouting
+	serverCfg.churnReqs = *churnReqs
+	serverCfg.tlsResume = *tlsResume
+	serverCfg.pacingSpin = *pacingSpin
+	serverCfg.statsWindow = *statsWindow
 
 	if *thAgents == "" {
 		expCfg.thAgents = nil
@@ -134,6 +180,43 @@ func ParseConfig() (*ServerConfig, *ExperimentConfig, *GeneralConfig, error) {
 	expCfg.ciSize = *ciSize
 	expCfg.nicTS = *nicTS
 	expCfg.privateKeyPath = *privateKey
+	expCfg.timeSeries = *timeSeries
+
+	if *zeroCopy && ((*comProto != "TCP" && *comProto != "XDP") || *nicTS) {
+		return nil, nil, nil, fmt.Errorf("zeroCopy needs TCP or XDP without nicTS")
+	}
+	if *kTLS && (*comProto != "TLS" || *nicTS) {
+		return nil, nil, nil, fmt.Errorf("kTLS needs TLS without nicTS")
+	}
+	if *churnReqs < 0 || (*churnReqs > 0 && ((*comProto != "TCP" && *comProto != "TLS" &&
+		*comProto != "UNIX" && *comProto != "UNIXPACKET") || *nicTS)) {
+		return nil, nil, nil, fmt.Errorf("churnReqs needs TCP, TLS or UNIX without nicTS")
+	}
+	if (*comProto == "UNIX" || *comProto == "UNIXPACKET" || *comProto == "XDP") && *nicTS {
+		return nil, nil, nil, fmt.Errorf("UNIX and XDP sockets have no NIC timestamps")
+	}
+	if *keyRouting != "" {
+		if *keyRouting != "ketama" && *keyRouting != "slots" {
+			return nil, nil, nil, fmt.Errorf("keyRouting must be ketama or slots")
+		}
+		switch *comProto {
+		case "TCP", "TLS", "URING", "UNIX", "UNIXPACKET":
+		default:
+			return nil, nil, nil, fmt.Errorf("keyRouting needs TCP, TLS, URING, UNIX or UNIXPACKET")
+		}
+		if !strings.HasPrefix(*appProto, "memcache-") && !strings.HasPrefix(*appProto, "redis_") {
+			return nil, nil, nil, fmt.Errorf("keyRouting needs a memcache or redis key-value appProto")
+		}
+	}
+	if *tlsResume && (*comProto != "TLS" || *churnReqs == 0) {
+		return nil, nil, nil, fmt.Errorf("tlsResume needs TLS with churnReqs")
+	}
+	if *pacingSpin < 0 {
+		return nil, nil, nil, fmt.Errorf("pacingSpin must not be negative")
+	}
+	if *statsWindow <= 0 {
+		return nil, nil, nil, fmt.Errorf("statsWindow must be positive")
+	}
 
 	generalCfg.runAgents = *runAgents
 	generalCfg.printAgentArgs = *printAgentArgs
@@ -44,6 +44,7 @@ type coordinator struct {
 	state          coordState
 	samplingRate   float64
 	shouldWaitConn bool
+	series         *timeSeries
 }
 
 const (
@@ -55,6 +56,7 @@ const (
 	Measure             coordState = 1
 	Exit                coordState = 2
 	samplesStep                    = 10000
+	seriesPoll                     = 1 * time.Second
 )
 
 func (c *coordinator) load(loadRate, latencyRate int) error {
@@ -95,6 +97,31 @@ func (c *coordinator) load(loadRate, latencyRate int) error {
 	return nil
 }
 
+// Sleeps for d, collecting the stats windows of the agents meanwhile with
+// -timeSeries
+func (c *coordinator) wait(d time.Duration) error {
+	if c.series == nil {
+		time.Sleep(d)
+		return nil
+	}
+	end := time.Now().Add(d)
+	for {
+		left := time.Until(end)
+		if left <= 0 {
+			return nil
+		}
+		if left > seriesPoll {
+			left = seriesPoll
+		}
+		time.Sleep(left)
+		windows, until, err := reportWindows(append(append(c.thAgents, c.ltAgents...), c.symAgents...))
+		if err != nil {
+			return fmt.Errorf("Error getting stats windows: %v\n", err)
+		}
+		c.series.add(windows, until)
+	}
+}
+
 func (c *coordinator) fixedPattern(loadRate, latencyRate int) error {
 	fmt.Printf("Load rate is %v\n", loadRate)
 	fmt.Printf("Latency rate = %v\n", latencyRate)
@@ -106,7 +133,10 @@ func (c *coordinator) fixedPattern(loadRate, latencyRate int) error {
 	if err != nil {
 		return err
 	}
-	time.Sleep(time.Duration(2) * time.Second)
+	err = c.wait(time.Duration(2) * time.Second)
+	if err != nil {
+		return err
+	}
 
 	var perAgentLoad int
 	var baseRate float64
@@ -133,40 +163,48 @@ func (c *coordinator) fixedPattern(loadRate, latencyRate int) error {
 	if err != nil {
 		return fmt.Errorf("Error starting measuring: %v\n", err)
 	}
-	time.Sleep(time.Duration(duration) * time.Second)
+	err = c.wait(time.Duration(duration) * time.Second)
+	if err != nil {
+		return err
+	}
 
 	var throughputReplies []*C.struct_throughput_reply
+	var connHists []*connHist
 	var latencyReplies []*C.struct_latency_reply
+	var latHists []*latHist
 	var e error
 
 	if len(c.thAgents) > 0 {
-		throughputReplies, e = reportThroughput(c.thAgents)
+		throughputReplies, connHists, e = reportThroughput(c.thAgents)
 		if e != nil {
 			return fmt.Errorf("Error getting throughput replies: %v\n", e)
 		}
 	} else {
 		throughputReplies = make([]*C.struct_throughput_reply, 0)
+		connHists = make([]*connHist, 0)
 	}
 
 	if len(c.ltAgents) > 0 || len(c.symAgents) > 0 {
-		latencyReplies, e = reportLatency(append(c.ltAgents, c.symAgents...))
+		latencyReplies, latHists, e = reportLatency(append(c.ltAgents, c.symAgents...))
 		if e != nil {
 			return fmt.Errorf("Error getting latency replies: %v\n", e)
 		}
 
-		for _, reply := range latencyReplies {
+		for i, reply := range latencyReplies {
 			latAgentThroughput := &reply.Th_data
 			throughputReplies = append(throughputReplies, latAgentThroughput)
+			connHists = append(connHists, latHists[i].conn)
 		}
 	}
 
-	agg_throughput := computeStatsThroughput(throughputReplies)
+	agg_throughput := computeStatsThroughput(throughputReplies, connHists)
 	printThroughputStats(agg_throughput)
 
 	if len(c.ltAgents) > 0 || len(c.symAgents) > 0 {
-		aggLatency := computeStatsLatency(latencyReplies)
+		aggLatency := computeStatsLatency(latencyReplies, latHists)
 		fmt.Println("Aggregate latency")
 		printLatencyStats(aggLatency)
+		printOpLatencyStats(latHists, agg_throughput.Duration)
 	}
 	return nil
 }
@@ -185,20 +223,26 @@ func (c *coordinator) fixedQualPattern(loadRate, latencyRate int) error {
 				return err
 			}
 			// Wait
-			time.Sleep(1 * time.Second)
+			err = c.wait(1 * time.Second)
+			if err != nil {
+				return err
+			}
 			// Measure
 			samplingRate := c.samplingRate * float64(len(c.symAgents)+len(c.ltAgents))
 			err = startMeasure(append(append(c.thAgents, c.ltAgents...), c.symAgents...), c.samples, samplingRate)
 			if err != nil {
 				return fmt.Errorf("Error starting measuring: %v\n", err)
 			}
-			time.Sleep(1 * time.Second)
+			err = c.wait(1 * time.Second)
+			if err != nil {
+				return err
+			}
 			// Collect throughput
-			throughputReplies, e := reportThroughput(append(append(c.thAgents, c.ltAgents...), c.symAgents...))
+			throughputReplies, connHists, e := reportThroughput(append(append(c.thAgents, c.ltAgents...), c.symAgents...))
 			if e != nil {
 				return fmt.Errorf("Error getting throughput replies: %v\n", e)
 			}
-			aggThroughput := computeStatsThroughput(throughputReplies)
+			aggThroughput := computeStatsThroughput(throughputReplies, connHists)
 			rps := getRPS(aggThroughput)
 			// Check if throughput reached
 			if rps > expectedRPS*1.1 || rps < expectedRPS*0.90 {
@@ -235,13 +279,16 @@ func (c *coordinator) fixedQualPattern(loadRate, latencyRate int) error {
 			if duration > maxDuration {
 				maxTimeReached = true
 			}
-			time.Sleep(time.Duration(duration) * time.Second)
+			err = c.wait(time.Duration(duration) * time.Second)
+			if err != nil {
+				return err
+			}
 
-			latencyReplies, e1 := reportLatency(append(c.symAgents, c.ltAgents...))
+			latencyReplies, latHists, e1 := reportLatency(append(c.symAgents, c.ltAgents...))
 			if e1 != nil {
 				return fmt.Errorf("Error getting latencyReplies replies: %v\n", e1)
 			}
-			agg_lat := computeStatsLatency(latencyReplies)
+			agg_lat := computeStatsLatency(latencyReplies, latHists)
 
 			if !maxTimeReached {
 				// Check if stationary
@@ -281,25 +328,29 @@ func (c *coordinator) fixedQualPattern(loadRate, latencyRate int) error {
 			fmt.Printf("Final #samples: %v\n", c.samples)
 			// Collect throughput
 			var throughputReplies []*C.struct_throughput_reply
+			var connHists []*connHist
 
 			if len(c.thAgents) > 0 {
-				throughputReplies, err = reportThroughput(c.thAgents)
+				throughputReplies, connHists, err = reportThroughput(c.thAgents)
 				if err != nil {
 					return fmt.Errorf("Error getting throughput replies: %v\n", err)
 				}
 			} else {
 				throughputReplies = make([]*C.struct_throughput_reply, 0)
+				connHists = make([]*connHist, 0)
 			}
 
-			for _, reply := range latencyReplies {
+			for i, reply := range latencyReplies {
 				latAgentThroughput := &reply.Th_data
 				throughputReplies = append(throughputReplies, latAgentThroughput)
+				connHists = append(connHists, latHists[i].conn)
 			}
 
-			agg_throughput := computeStatsThroughput(throughputReplies)
+			agg_throughput := computeStatsThroughput(throughputReplies, connHists)
 			printThroughputStats(agg_throughput)
 			fmt.Println("Aggregate latency")
 			printLatencyStats(agg_lat)
+			printOpLatencyStats(latHists, agg_throughput.Duration)
 			if maxTimeReached {
 				return fmt.Errorf("Max time reached\n")
 			}
@@ -333,41 +384,49 @@ func (c *coordinator) fixedTimePattern(loadRate, latencyRate, duration int) erro
 	if err != nil {
 		return fmt.Errorf("Error starting measuring: %v\n", err)
 	}
-	time.Sleep(time.Duration(duration) * time.Second)
+	err = c.wait(time.Duration(duration) * time.Second)
+	if err != nil {
+		return err
+	}
 
 	var throughputReplies []*C.struct_throughput_reply
+	var connHists []*connHist
 	var latencyReplies []*C.struct_latency_reply
+	var latHists []*latHist
 	var e error
 
 	if len(c.thAgents) > 0 {
-		throughputReplies, e = reportThroughput(c.thAgents)
+		throughputReplies, connHists, e = reportThroughput(c.thAgents)
 		if e != nil {
 			return fmt.Errorf("Error getting throughput replies: %v\n", e)
 		}
 
 	} else {
 		throughputReplies = make([]*C.struct_throughput_reply, 0)
+		connHists = make([]*connHist, 0)
 	}
 
 	if len(c.ltAgents) > 0 || len(c.symAgents) > 0 {
-		latencyReplies, e = reportLatency(append(c.ltAgents, c.symAgents...))
+		latencyReplies, latHists, e = reportLatency(append(c.ltAgents, c.symAgents...))
 		if e != nil {
 			return fmt.Errorf("Error getting latency replies: %v\n", e)
 		}
 
-		for _, reply := range latencyReplies {
+		for i, reply := range latencyReplies {
 			latAgentThroughput := &reply.Th_data
 			throughputReplies = append(throughputReplies, latAgentThroughput)
+			connHists = append(connHists, latHists[i].conn)
 		}
 	}
 
-	agg_throughput := computeStatsThroughput(throughputReplies)
+	agg_throughput := computeStatsThroughput(throughputReplies, connHists)
 	printThroughputStats(agg_throughput)
 
 	if len(c.ltAgents) > 0 || len(c.symAgents) > 0 {
-		aggLatency := computeStatsLatency(latencyReplies)
+		aggLatency := computeStatsLatency(latencyReplies, latHists)
 		fmt.Println("Aggregate latency")
 		printLatencyStats(aggLatency)
+		printOpLatencyStats(latHists, agg_throughput.Duration)
 	}
 	return nil
 }
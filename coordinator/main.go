@@ -71,10 +71,46 @@ func main() {
 		agentArgsMap = make(map[string]string)
 	}
 
+	// Options shared by every agent
+	commonArgs := ""
+	if serverCfg.cpuList != "" {
+		commonArgs += fmt.Sprintf(" -u %s", serverCfg.cpuList)
+	}
+	if serverCfg.numaNode != "" {
+		commonArgs += fmt.Sprintf(" -m %s", serverCfg.numaNode)
+	}
+	// XDP runs on the interface, the NIC node is the node of the interface
+	if serverCfg.comProto == "XDP" || serverCfg.numaNode == "nic" {
+		commonArgs += fmt.Sprintf(" -n %s", serverCfg.ifName)
+	}
+	if serverCfg.zeroCopy {
+		commonArgs += " -z 1"
+	}
+	if serverCfg.kTLS {
+		commonArgs += " -k 1"
+	}
+	if serverCfg.keyRouting != "" {
+		commonArgs += fmt.Sprintf(" -g %s", serverCfg.keyRouting)
+	}
+	if serverCfg.pacingSpin > 0 {
+		commonArgs += fmt.Sprintf(" -y %d", serverCfg.pacingSpin)
+	}
+	commonArgs += fmt.Sprintf(" -l %d", serverCfg.statsWindow)
+
+	// Connection churn only applies to the load and sym agents
+	churnArgs := ""
+	if serverCfg.churnReqs > 0 {
+		churnArgs = fmt.Sprintf(" -e %d", serverCfg.churnReqs)
+	}
+	if serverCfg.tlsResume {
+		churnArgs += " -x 1"
+	}
+
 	// Run throughput agents
-	agentArgs := fmt.Sprintf("-s %s -t %d -c %d -o %d -i %s -p %s -r %s -a 0",
+	agentArgs := fmt.Sprintf("-s %s -t %d -c %d -o %d -i %s -p %s -r %s -b %d -w %d -a 0%s%s",
 		serverCfg.target, serverCfg.thThreads, serverCfg.thConn, serverCfg.reqPerConn,
-		serverCfg.idist, serverCfg.comProto, serverCfg.appProto)
+		serverCfg.idist, serverCfg.comProto, serverCfg.appProto, serverCfg.udpBatch,
+		serverCfg.connWave, commonArgs, churnArgs)
 	for i, a := range expCfg.thAgents {
 		if generalCfg.printAgentArgs {
 			agentArgsMap[a] = agentArgs
@@ -90,9 +126,14 @@ func main() {
 	}
 
 	// Run latency agents
-	ltArgs := fmt.Sprintf("-s %s -t %d -c %d -i %s -p %s -r %s -a 1 -o 1",
+	intendedLatArg := 0
+	if serverCfg.intendLat {
+		intendedLatArg = 1
+	}
+	ltArgs := fmt.Sprintf("-s %s -t %d -c %d -i %s -p %s -r %s -w %d -d %d -a 1 -o %d%s",
 		serverCfg.target, serverCfg.ltThreads, serverCfg.ltConn,
-		serverCfg.idist, serverCfg.comProto, serverCfg.appProto)
+		serverCfg.idist, serverCfg.comProto, serverCfg.appProto, serverCfg.connWave,
+		intendedLatArg, serverCfg.ltReqs, commonArgs)
 	for i, a := range expCfg.ltAgents {
 		if generalCfg.printAgentArgs {
 			agentArgsMap[a] = ltArgs
@@ -107,9 +148,10 @@ func main() {
 		c.ltAgents[i] = &agent{name: a, aType: lATENCY_AGENT}
 	}
 
-	symArgsPre := fmt.Sprintf("-s %s -t %d -c %d -o %d -i %s -p %s -r %s",
+	symArgsPre := fmt.Sprintf("-s %s -t %d -c %d -o %d -i %s -p %s -r %s -b %d -w %d -d %d%s%s",
 		serverCfg.target, serverCfg.thThreads, serverCfg.thConn, serverCfg.reqPerConn,
-		serverCfg.idist, serverCfg.comProto, serverCfg.appProto)
+		serverCfg.idist, serverCfg.comProto, serverCfg.appProto, serverCfg.udpBatch,
+		serverCfg.connWave, intendedLatArg, commonArgs, churnArgs)
 	var symArgs string
 	if expCfg.nicTS {
 		symArgs = fmt.Sprintf("%s -a %d -n %s", symArgsPre, 2, serverCfg.ifName)
@@ -192,10 +234,21 @@ func main() {
 
 	// Run experiment
 	c.shouldWaitConn = false
-	if serverCfg.comProto == "TCP" {
+	switch serverCfg.comProto {
+	case "TCP", "URING", "UNIX", "UNIXPACKET":
 		c.shouldWaitConn = true
 	}
+	if expCfg.timeSeries != "" {
+		c.series, err = newTimeSeries(expCfg.timeSeries)
+		if err != nil {
+			fmt.Println(err)
+			os.Exit(1)
+		}
+	}
 	err = c.runExp(expCfg.loadPattern, expCfg.ltRate, expCfg.ciSize)
+	if c.series != nil {
+		c.series.close()
+	}
 	if err != nil {
 		fmt.Println(err)
 		os.Exit(1)
@@ -93,68 +93,225 @@ func collectValues(agents []*agent) ([]int, error) {
 	return ret, nil
 }
 
-func collectThroughputResults(agents []*agent) ([]*C.struct_throughput_reply, error) {
+func collectThroughputResults(agents []*agent) ([]*C.struct_throughput_reply, []*connHist, error) {
 	result := make([]*C.struct_throughput_reply, 0)
+	connHists := make([]*connHist, 0)
 	timeOut := 30000 * time.Millisecond
 	for _, a := range agents {
 		a.conn.SetReadDeadline(time.Now().Add(timeOut))
 		reply := &C.struct_throughput_reply{}
 		prelude := &C.struct_msg1{}
-		data := make([]byte, 1024)
-		_, err := a.conn.Read(data)
-		if err != nil {
-			return nil, fmt.Errorf("Read from agent failed: %v\n", err)
-		}
-		r := bytes.NewReader(data)
+		// The reply does not fit in a single read
+		r := a.conn
 
 		// Read throughput reply
-		err = binary.Read(r, binary.LittleEndian, prelude)
+		err := binary.Read(r, binary.LittleEndian, prelude)
 		if err != nil {
-			return nil, fmt.Errorf("Error parsing throughput_reply header: %v\n", err)
+			return nil, nil, fmt.Errorf("Error parsing throughput_reply header: %v\n", err)
 		}
 		if prelude.Info != C.REPLY_STATS_THROUGHPUT {
-			return nil, fmt.Errorf("Didn't receive throughput stats\n")
+			return nil, nil, fmt.Errorf("Didn't receive throughput stats\n")
 		}
 		err = binary.Read(r, binary.LittleEndian, reply)
 		if err != nil {
-			return nil, fmt.Errorf("Error parsing throughput_reply: %v\n", err)
+			return nil, nil, fmt.Errorf("Error parsing throughput_reply: %v\n", err)
 		}
 		result = append(result, reply)
+
+		hist, err := collectConnHist(a)
+		if err != nil {
+			return nil, nil, err
+		}
+		connHists = append(connHists, hist)
+	}
+	return result, connHists, nil
+}
+
+// The connection histograms follow every throughput and latency reply
+func collectConnHist(a *agent) (*connHist, error) {
+	prelude := &C.struct_msg1{}
+	reply := &C.struct_conn_hist_reply{}
+	r := a.conn
+	err := binary.Read(r, binary.LittleEndian, prelude)
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing conn_hist_reply header: %v\n", err)
+	}
+	if prelude.Info != C.REPLY_CONN_HIST {
+		return nil, fmt.Errorf("Didn't receive connection histograms\n")
+	}
+	err = binary.Read(r, binary.LittleEndian, reply)
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing conn_hist_reply: %v\n", err)
+	}
+	entries := make([]C.struct_lat_hist_entry, reply.Entries)
+	handshakeEntries := make([]C.struct_lat_hist_entry, reply.Handshake_entries)
+	err = binary.Read(r, binary.LittleEndian, entries)
+	if err == nil {
+		err = binary.Read(r, binary.LittleEndian, handshakeEntries)
+	}
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing conn_hist_reply entries: %v\n", err)
 	}
-	return result, nil
+	return newConnHist(reply, entries, handshakeEntries)
 }
 
-func collectLatencyResults(agents []*agent) ([]*C.struct_latency_reply, error) {
+func collectLatencyResults(agents []*agent) ([]*C.struct_latency_reply, []*latHist, error) {
 	result := make([]*C.struct_latency_reply, 0)
+	hists := make([]*latHist, 0)
 	timeOut := 10000 * time.Millisecond
 	aggregate := 0
 	for _, a := range agents {
 		a.conn.SetReadDeadline(time.Now().Add(timeOut))
 		reply := &C.struct_latency_reply{}
 		prelude := &C.struct_msg1{}
-		data := make([]byte, 1024)
-		_, err := a.conn.Read(data)
-
+		r := a.conn
+		err := binary.Read(r, binary.LittleEndian, prelude)
 		if err != nil {
-			return nil, fmt.Errorf("Read from agent failed: %v\n", err)
-		}
-		r := bytes.NewReader(data)
-		err = binary.Read(r, binary.LittleEndian, prelude)
-		if err != nil {
-			return nil, fmt.Errorf("Error parsing latency_reply header: %v\n", err)
+			return nil, nil, fmt.Errorf("Error parsing latency_reply header: %v\n", err)
 		}
 		if prelude.Info != C.REPLY_STATS_LATENCY {
-			return nil, fmt.Errorf("Didn't receive latency stats\n")
+			return nil, nil, fmt.Errorf("Didn't receive latency stats\n")
 		}
 		err = binary.Read(r, binary.LittleEndian, reply)
 		if err != nil {
-			return nil, fmt.Errorf("Error parsing latency_reply: %v\n", err)
+			return nil, nil, fmt.Errorf("Error parsing latency_reply: %v\n", err)
 		}
 		aggregate += int(reply.Th_data.CorrectIAD)
 		result = append(result, reply)
+
+		conn, err := collectConnHist(a)
+		if err != nil {
+			return nil, nil, err
+		}
+		hist, err := collectLatHist(a)
+		if err != nil {
+			return nil, nil, err
+		}
+		hist.conn = conn
+		hists = append(hists, hist)
 	}
 	fmt.Printf("Overall IA check: %v\n", aggregate)
-	return result, nil
+	return result, hists, nil
+}
+
+// The histograms follow every latency reply
+func collectLatHist(a *agent) (*latHist, error) {
+	prelude := &C.struct_msg1{}
+	reply := &C.struct_lat_hist_reply{}
+	r := a.conn
+	err := binary.Read(r, binary.LittleEndian, prelude)
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing lat_hist_reply header: %v\n", err)
+	}
+	if prelude.Info != C.REPLY_LAT_HIST {
+		return nil, fmt.Errorf("Didn't receive latency histograms\n")
+	}
+	err = binary.Read(r, binary.LittleEndian, reply)
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing lat_hist_reply: %v\n", err)
+	}
+	entries := make([]C.struct_lat_hist_entry, reply.Entries)
+	intendedEntries := make([]C.struct_lat_hist_entry, reply.Intended_entries)
+	err = binary.Read(r, binary.LittleEndian, entries)
+	if err == nil {
+		err = binary.Read(r, binary.LittleEndian, intendedEntries)
+	}
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing lat_hist_reply entries: %v\n", err)
+	}
+	h, err := newLatHist(reply, entries, intendedEntries)
+	if err != nil {
+		return nil, err
+	}
+	h.ops, err = collectOpHists(a, h.subBits)
+	if err != nil {
+		return nil, err
+	}
+	return h, nil
+}
+
+// The histograms of the operation classes follow the latency histograms
+func collectOpHists(a *agent, subBits uint) ([]*opHist, error) {
+	prelude := &C.struct_msg1{}
+	reply := &C.struct_op_hists_reply{}
+	r := a.conn
+	err := binary.Read(r, binary.LittleEndian, prelude)
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing op_hists_reply header: %v\n", err)
+	}
+	if prelude.Info != C.REPLY_OP_HISTS {
+		return nil, fmt.Errorf("Didn't receive operation histograms\n")
+	}
+	err = binary.Read(r, binary.LittleEndian, reply)
+	if err != nil {
+		return nil, fmt.Errorf("Error parsing op_hists_reply: %v\n", err)
+	}
+	if uint(reply.Sub_bits) != subBits || reply.Classes > 16 {
+		return nil, fmt.Errorf("Bad operation histograms %v/%v\n", reply.Classes, reply.Sub_bits)
+	}
+	ops := make([]*opHist, reply.Classes)
+	for i := range ops {
+		entry := &C.struct_op_hist_entry{}
+		err = binary.Read(r, binary.LittleEndian, entry)
+		if err != nil {
+			return nil, fmt.Errorf("Error parsing op_hist_entry: %v\n", err)
+		}
+		hist := make([]C.struct_lat_hist_entry, entry.Entries)
+		err = binary.Read(r, binary.LittleEndian, hist)
+		if err != nil {
+			return nil, fmt.Errorf("Error parsing op_hist_entry histogram: %v\n", err)
+		}
+		ops[i], err = newOpHist(entry, hist, subBits)
+		if err != nil {
+			return nil, err
+		}
+	}
+	return ops, nil
+}
+
+// The windows of all agents and the end of the windows they all reported on
+func collectWindows(agents []*agent) ([]*statsWindow, uint64, error) {
+	result := make([]*statsWindow, 0)
+	var until uint64
+	timeOut := 10000 * time.Millisecond
+	for i, a := range agents {
+		a.conn.SetReadDeadline(time.Now().Add(timeOut))
+		prelude := &C.struct_msg1{}
+		reply := &C.struct_windows_reply{}
+		r := a.conn
+		err := binary.Read(r, binary.LittleEndian, prelude)
+		if err != nil {
+			return nil, 0, fmt.Errorf("Error parsing windows_reply header: %v\n", err)
+		}
+		if prelude.Info != C.REPLY_WINDOWS {
+			return nil, 0, fmt.Errorf("Didn't receive stats windows\n")
+		}
+		err = binary.Read(r, binary.LittleEndian, reply)
+		if err != nil {
+			return nil, 0, fmt.Errorf("Error parsing windows_reply: %v\n", err)
+		}
+		for j := 0; j < int(reply.Count); j++ {
+			entry := &C.struct_window_entry{}
+			err = binary.Read(r, binary.LittleEndian, entry)
+			if err != nil {
+				return nil, 0, fmt.Errorf("Error parsing window_entry: %v\n", err)
+			}
+			hist := make([]C.struct_lat_hist_entry, entry.Entries)
+			err = binary.Read(r, binary.LittleEndian, hist)
+			if err != nil {
+				return nil, 0, fmt.Errorf("Error parsing window_entry histogram: %v\n", err)
+			}
+			w, err := newStatsWindow(entry, reply, hist)
+			if err != nil {
+				return nil, 0, err
+			}
+			result = append(result, w)
+		}
+		if i == 0 || uint64(reply.Until_ns) < until {
+			until = uint64(reply.Until_ns)
+		}
+	}
+	return result, until, nil
 }
 
 func collectConvergenceResults(agents []*agent) ([]int, error) {
@@ -244,7 +401,7 @@ func startMeasure(agents []*agent, sampleCount int, samplingRate float64) error
 	return nil
 }
 
-func reportThroughput(agents []*agent) ([]*C.struct_throughput_reply, error) {
+func reportThroughput(agents []*agent) ([]*C.struct_throughput_reply, []*connHist, error) {
 	msg := C.struct_msg1{
 		Hdr: C.struct_msg_hdr{
 			MessageType:   C.uint32_t(C.REPORT_REQ),
@@ -255,16 +412,16 @@ func reportThroughput(agents []*agent) ([]*C.struct_throughput_reply, error) {
 	buf := &bytes.Buffer{}
 	err := binary.Write(buf, binary.LittleEndian, msg)
 	if err != nil {
-		return nil, fmt.Errorf("Error formating message: %v", err)
+		return nil, nil, fmt.Errorf("Error formating message: %v", err)
 	}
 	err = broadcastMessage(buf, agents)
 	if err != nil {
-		return nil, err
+		return nil, nil, err
 	}
 	return collectThroughputResults(agents)
 }
 
-func reportLatency(agents []*agent) ([]*C.struct_latency_reply, error) {
+func reportLatency(agents []*agent) ([]*C.struct_latency_reply, []*latHist, error) {
 	msg := C.struct_msg1{
 		Hdr: C.struct_msg_hdr{
 			MessageType:   C.uint32_t(C.REPORT_REQ),
@@ -275,15 +432,35 @@ func reportLatency(agents []*agent) ([]*C.struct_latency_reply, error) {
 	buf := &bytes.Buffer{}
 	err := binary.Write(buf, binary.LittleEndian, msg)
 	if err != nil {
-		return nil, fmt.Errorf("Error formating message: %v", err)
+		return nil, nil, fmt.Errorf("Error formating message: %v", err)
 	}
 	err = broadcastMessage(buf, agents)
 	if err != nil {
-		return nil, err
+		return nil, nil, err
 	}
 	return collectLatencyResults(agents)
 }
 
+func reportWindows(agents []*agent) ([]*statsWindow, uint64, error) {
+	msg := C.struct_msg1{
+		Hdr: C.struct_msg_hdr{
+			MessageType:   C.uint32_t(C.REPORT_REQ),
+			MessageLength: C.uint32_t(4),
+		},
+		Info: C.uint32_t(C.REPORT_WINDOWS),
+	}
+	buf := &bytes.Buffer{}
+	err := binary.Write(buf, binary.LittleEndian, msg)
+	if err != nil {
+		return nil, 0, fmt.Errorf("Error formating message: %v", err)
+	}
+	err = broadcastMessage(buf, agents)
+	if err != nil {
+		return nil, 0, err
+	}
+	return collectWindows(agents)
+}
+
 func check_conn_open(agents []*agent) (bool, error) {
 	msg := C.struct_msg1{
 		Hdr: C.struct_msg_hdr{
@@ -27,78 +27,409 @@ package main
 import "C"
 import (
 	"fmt"
+	"math"
+	"os"
+	"sort"
 )
 
-func computeStatsThroughput(replies []*C.struct_throughput_reply) *C.struct_throughput_reply {
+func computeStatsThroughput(replies []*C.struct_throughput_reply, connHists []*connHist) *C.struct_throughput_reply {
 	agg_stats := &C.struct_throughput_reply{}
 	for _, r := range replies {
+		agg_stats.Conn_opened += r.Conn_opened
+		agg_stats.Conn_resumed += r.Conn_resumed
+		agg_stats.Pool_exhausted += r.Pool_exhausted
+		for i := range r.Shard_tx {
+			agg_stats.Shard_tx[i] += r.Shard_tx[i]
+			agg_stats.Shard_rx[i] += r.Shard_rx[i]
+		}
+		for i := range r.Op_tx {
+			agg_stats.Op_tx[i] += r.Op_tx[i]
+		}
 		agg_stats.Rx_bytes += r.Rx_bytes
 		agg_stats.Tx_bytes += r.Tx_bytes
 		agg_stats.Req_count += r.Req_count
 		agg_stats.CorrectIAD += r.CorrectIAD
+		agg_stats.Backlog_reqs += r.Backlog_reqs
+		agg_stats.Backlog_wait += r.Backlog_wait
+		agg_stats.Backlog_dropped += r.Backlog_dropped
+		if r.Backlog_max_wait > agg_stats.Backlog_max_wait {
+			agg_stats.Backlog_max_wait = r.Backlog_max_wait
+		}
+		if r.Backlog_max_depth > agg_stats.Backlog_max_depth {
+			agg_stats.Backlog_max_depth = r.Backlog_max_depth
+		}
 	}
 	agg_stats.Duration = replies[0].Duration
+	if len(connHists) > 0 {
+		h := mergeConnHists(connHists)
+		agg_stats.Connect_P50 = h.connectPercentile(0.5)
+		agg_stats.Connect_P99 = h.connectPercentile(0.99)
+		agg_stats.Handshake_P50 = h.handshakePercentile(0.5)
+		agg_stats.Handshake_P99 = h.handshakePercentile(0.99)
+	}
 
 	return agg_stats
 }
 
-func computeStatsLatency(replies []*C.struct_latency_reply) *C.struct_latency_reply {
+// Connect and TLS handshake times of the reopened connections of an agent,
+// see conn_hist_bucket in agents/stats.c
+type connHist struct {
+	subBits   uint
+	connect   []uint64
+	handshake []uint64
+}
+
+func newConnHist(reply *C.struct_conn_hist_reply, entries, handshakeEntries []C.struct_lat_hist_entry) (*connHist, error) {
+	if reply.Sub_bits > 16 {
+		return nil, fmt.Errorf("Bad connection histogram precision %v\n", reply.Sub_bits)
+	}
+	h := &connHist{subBits: uint(reply.Sub_bits)}
+	h.connect = make([]uint64, 64<<h.subBits)
+	h.handshake = make([]uint64, 64<<h.subBits)
+	for _, e := range entries {
+		if int(e.Bucket) >= len(h.connect) {
+			return nil, fmt.Errorf("Connection histogram bucket %v out of range\n", e.Bucket)
+		}
+		h.connect[e.Bucket] += uint64(e.Count)
+	}
+	for _, e := range handshakeEntries {
+		if int(e.Bucket) >= len(h.handshake) {
+			return nil, fmt.Errorf("Connection histogram bucket %v out of range\n", e.Bucket)
+		}
+		h.handshake[e.Bucket] += uint64(e.Count)
+	}
+	return h, nil
+}
+
+func mergeConnHists(hists []*connHist) *connHist {
+	merged := &connHist{subBits: hists[0].subBits}
+	merged.connect = make([]uint64, len(hists[0].connect))
+	merged.handshake = make([]uint64, len(hists[0].handshake))
+	for _, h := range hists {
+		if h.subBits != merged.subBits {
+			panic("Agents with different connection histograms")
+		}
+		for i := range h.connect {
+			merged.connect[i] += h.connect[i]
+			merged.handshake[i] += h.handshake[i]
+		}
+	}
+	return merged
+}
+
+func bucketsPercentile(buckets []uint64, subBits uint, p float64) C.uint64_t {
+	var count uint64
+	for _, c := range buckets {
+		count += c
+	}
+	return C.uint64_t(histPercentile(buckets, count, subBits, p))
+}
+
+func (h *connHist) connectPercentile(p float64) C.uint64_t {
+	return bucketsPercentile(h.connect, h.subBits, p)
+}
+
+func (h *connHist) handshakePercentile(p float64) C.uint64_t {
+	return bucketsPercentile(h.handshake, h.subBits, p)
+}
+
+// Log-linear latency histograms of an agent, see hist_bucket in agents/stats.c
+type latHist struct {
+	subBits       uint
+	samples       uint64 // iid samples, for the confidence intervals
+	count         uint64
+	sumNs         uint64
+	buckets       []uint64
+	intendedCount uint64
+	intendedSumNs uint64
+	intended      []uint64
+	ops           []*opHist // one per operation class
+	conn          *connHist
+}
+
+// Operation classes of the KV protocols, see enum op_class in inc/lancet/stats.h
+var opClassNames = []string{"other", "read", "write", "scan"}
+
+func opClassName(c int) string {
+	if c < len(opClassNames) {
+		return opClassNames[c]
+	}
+	return fmt.Sprint(c)
+}
+
+// Latency histogram of one operation class, with the buckets of latHist
+type opHist struct {
+	count   uint64
+	sumNs   uint64
+	buckets []uint64
+}
+
+func newOpHist(entry *C.struct_op_hist_entry, entries []C.struct_lat_hist_entry, subBits uint) (*opHist, error) {
+	o := &opHist{
+		count:   uint64(entry.Count),
+		sumNs:   uint64(entry.Sum_ns),
+		buckets: make([]uint64, 64<<subBits),
+	}
+	for _, e := range entries {
+		if int(e.Bucket) >= len(o.buckets) {
+			return nil, fmt.Errorf("Latency histogram bucket %v out of range\n", e.Bucket)
+		}
+		o.buckets[e.Bucket] += uint64(e.Count)
+	}
+	return o, nil
+}
+
+func newLatHist(reply *C.struct_lat_hist_reply, entries, intendedEntries []C.struct_lat_hist_entry) (*latHist, error) {
+	if reply.Sub_bits > 16 {
+		return nil, fmt.Errorf("Bad latency histogram precision %v\n", reply.Sub_bits)
+	}
+	h := &latHist{
+		subBits:       uint(reply.Sub_bits),
+		samples:       uint64(reply.Samples),
+		count:         uint64(reply.Count),
+		sumNs:         uint64(reply.Sum_ns),
+		intendedCount: uint64(reply.Intended_count),
+		intendedSumNs: uint64(reply.Intended_sum_ns),
+	}
+	h.buckets = make([]uint64, 64<<h.subBits)
+	h.intended = make([]uint64, 64<<h.subBits)
+	for _, e := range entries {
+		if int(e.Bucket) >= len(h.buckets) {
+			return nil, fmt.Errorf("Latency histogram bucket %v out of range\n", e.Bucket)
+		}
+		h.buckets[e.Bucket] += uint64(e.Count)
+	}
+	for _, e := range intendedEntries {
+		if int(e.Bucket) >= len(h.intended) {
+			return nil, fmt.Errorf("Latency histogram bucket %v out of range\n", e.Bucket)
+		}
+		h.intended[e.Bucket] += uint64(e.Count)
+	}
+	return h, nil
+}
+
+// Adding up the buckets is exact, unlike averaging the percentiles
+func mergeLatHists(hists []*latHist) *latHist {
+	merged := &latHist{subBits: hists[0].subBits}
+	merged.buckets = make([]uint64, len(hists[0].buckets))
+	merged.intended = make([]uint64, len(hists[0].intended))
+	merged.ops = make([]*opHist, len(hists[0].ops))
+	for c := range merged.ops {
+		merged.ops[c] = &opHist{buckets: make([]uint64, len(merged.buckets))}
+	}
+	for _, h := range hists {
+		if h.subBits != merged.subBits || len(h.ops) != len(merged.ops) {
+			panic("Agents with different latency histograms")
+		}
+		for c, o := range h.ops {
+			merged.ops[c].count += o.count
+			merged.ops[c].sumNs += o.sumNs
+			for i := range o.buckets {
+				merged.ops[c].buckets[i] += o.buckets[i]
+			}
+		}
+		merged.samples += h.samples
+		merged.count += h.count
+		merged.sumNs += h.sumNs
+		merged.intendedCount += h.intendedCount
+		merged.intendedSumNs += h.intendedSumNs
+		for i := range h.buckets {
+			merged.buckets[i] += h.buckets[i]
+			merged.intended[i] += h.intended[i]
+		}
+	}
+	return merged
+}
+
+// Middle of a bucket of hist_bucket in agents/stats.c
+func histNs(bucket int, subBits uint) uint64 {
+	if bucket < 1<<subBits {
+		return uint64(bucket)
+	}
+	shift := uint(bucket>>subBits) - 1
+	mask := 1<<subBits - 1
+	return uint64((1<<subBits)+(bucket&mask))<<shift + (1<<shift)/2
+}
+
+func histPercentile(buckets []uint64, count uint64, subBits uint, p float64) uint64 {
+	var seen uint64
+	if count == 0 {
+		return 0
+	}
+	rank := uint64(math.Ceil(p * float64(count)))
+	if rank < 1 {
+		rank = 1
+	}
+	for b, c := range buckets {
+		seen += c
+		if seen >= rank {
+			return histNs(b, subBits)
+		}
+	}
+	return 0
+}
+
+// The confidence interval is between the same order statistics of the iid
+// samples of all agents as get_ci in the agent manager, looked up in the
+// merged histogram
+func (h *latHist) percentile(p float64) (C.uint64_t, C.uint64_t, C.uint64_t) {
+	n := float64(h.samples)
+	prod := n * p
+	bound := func(x float64) C.uint64_t {
+		if x < 0 || x >= n {
+			return 0
+		}
+		return C.uint64_t(histPercentile(h.buckets, h.count, h.subBits, (x+1)/n))
+	}
+	j := bound(math.Floor(prod - 1.96*math.Sqrt(prod*(1-p))))
+	k := bound(math.Ceil(prod+1.96*math.Sqrt(prod*(1-p))) + 1)
+	return j, C.uint64_t(histPercentile(h.buckets, h.count, h.subBits, p)), k
+}
+
+func (h *latHist) intendedPercentile(p float64) C.uint64_t {
+	return C.uint64_t(histPercentile(h.intended, h.intendedCount, h.subBits, p))
+}
+
+// Traffic of the agents in one stats window, see struct stats_window
+type statsWindow struct {
+	startNs  uint64
+	windowNs uint64
+	subBits  uint
+	rxBytes  uint64
+	rxReqs   uint64
+	txBytes  uint64
+	txReqs   uint64
+	latCount uint64
+	latSumNs uint64
+	buckets  []uint64
+}
+
+func newStatsWindow(entry *C.struct_window_entry, reply *C.struct_windows_reply, entries []C.struct_lat_hist_entry) (*statsWindow, error) {
+	if reply.Sub_bits > 16 || reply.Window_ns == 0 {
+		return nil, fmt.Errorf("Bad stats windows of %v ns with precision %v\n", reply.Window_ns, reply.Sub_bits)
+	}
+	w := &statsWindow{
+		startNs:  uint64(entry.Start_ns),
+		windowNs: uint64(reply.Window_ns),
+		subBits:  uint(reply.Sub_bits),
+		rxBytes:  uint64(entry.Rx_bytes),
+		rxReqs:   uint64(entry.Rx_reqs),
+		txBytes:  uint64(entry.Tx_bytes),
+		txReqs:   uint64(entry.Tx_reqs),
+		latCount: uint64(entry.Lat_count),
+		latSumNs: uint64(entry.Lat_sum_ns),
+	}
+	w.buckets = make([]uint64, 64<<w.subBits)
+	for _, e := range entries {
+		if int(e.Bucket) >= len(w.buckets) {
+			return nil, fmt.Errorf("Window histogram bucket %v out of range\n", e.Bucket)
+		}
+		w.buckets[e.Bucket] += uint64(e.Count)
+	}
+	return w, nil
+}
+
+func (w *statsWindow) merge(o *statsWindow) {
+	if o.windowNs != w.windowNs || o.subBits != w.subBits {
+		panic("Agents with different stats windows")
+	}
+	w.rxBytes += o.rxBytes
+	w.rxReqs += o.rxReqs
+	w.txBytes += o.txBytes
+	w.txReqs += o.txReqs
+	w.latCount += o.latCount
+	w.latSumNs += o.latSumNs
+	for i := range o.buckets {
+		w.buckets[i] += o.buckets[i]
+	}
+}
+
+// The windows of the agents by start time, written out once every agent
+// has reported on them
+type timeSeries struct {
+	out     *os.File
+	pending map[uint64]*statsWindow
+}
+
+func newTimeSeries(path string) (*timeSeries, error) {
+	out, err := os.Create(path)
+	if err != nil {
+		return nil, fmt.Errorf("Error creating time series: %v\n", err)
+	}
+	fmt.Fprintln(out, "start_ns,qps,tx_qps,rx_bw,tx_bw,avg_lat_us,p50_us,p99_us,p999_us")
+	return &timeSeries{out: out, pending: make(map[uint64]*statsWindow)}, nil
+}
+
+func (ts *timeSeries) add(windows []*statsWindow, until uint64) {
+	for _, w := range windows {
+		if p, ok := ts.pending[w.startNs]; ok {
+			p.merge(w)
+		} else {
+			ts.pending[w.startNs] = w
+		}
+	}
+	ts.flush(until)
+}
+
+func (ts *timeSeries) flush(until uint64) {
+	starts := make([]uint64, 0)
+	for start, w := range ts.pending {
+		if start+w.windowNs <= until {
+			starts = append(starts, start)
+		}
+	}
+	sort.Slice(starts, func(i, j int) bool { return starts[i] < starts[j] })
+	for _, start := range starts {
+		w := ts.pending[start]
+		delete(ts.pending, start)
+		secs := float64(w.windowNs) / 1e9
+		var avg float64
+		if w.latCount > 0 {
+			avg = float64(w.latSumNs) / float64(w.latCount) / 1e3
+		}
+		fmt.Fprintf(ts.out, "%v,%v,%v,%v,%v,%v,%v,%v,%v\n", w.startNs,
+			float64(w.rxReqs)/secs, float64(w.txReqs)/secs,
+			float64(w.rxBytes)/secs, float64(w.txBytes)/secs, avg,
+			float64(histPercentile(w.buckets, w.latCount, w.subBits, 0.5))/1e3,
+			float64(histPercentile(w.buckets, w.latCount, w.subBits, 0.99))/1e3,
+			float64(histPercentile(w.buckets, w.latCount, w.subBits, 0.999))/1e3)
+	}
+}
+
+// Also writes the windows that not every agent reported on
+func (ts *timeSeries) close() {
+	ts.flush(math.MaxUint64)
+	ts.out.Close()
+}
+
+func computeStatsLatency(replies []*C.struct_latency_reply, hists []*latHist) *C.struct_latency_reply {
 	agg_stats := &C.struct_latency_reply{}
 	for _, r := range replies {
 		printLatencyStats(r)
-		agg_stats.Avg_lat += r.Avg_lat
-		agg_stats.P50_i += r.P50_i
-		agg_stats.P50 += r.P50
-		agg_stats.P50_k += r.P50_k
-		agg_stats.P90_i += r.P90_i
-		agg_stats.P90 += r.P90
-		agg_stats.P90_k += r.P90_k
-		agg_stats.P95_i += r.P95_i
-		agg_stats.P95 += r.P95
-		agg_stats.P95_k += r.P95_k
-		agg_stats.P99_i += r.P99_i
-		agg_stats.P99 += r.P99
-		agg_stats.P99_k += r.P99_k
-		agg_stats.P999_i += r.P999_i
-		agg_stats.P999 += r.P999
-		agg_stats.P999_k += r.P999_k
-		agg_stats.P9999_i += r.P9999_i
-		agg_stats.P9999 += r.P9999
-		agg_stats.P9999_k += r.P9999_k
-		agg_stats.P99999_i += r.P99999_i
-		agg_stats.P99999 += r.P99999
-		agg_stats.P99999_k += r.P99999_k
-		agg_stats.P999999_i += r.P999999_i
-		agg_stats.P999999 += r.P999999
-		agg_stats.P999999_k += r.P999999_k
 		agg_stats.IsStationary += r.IsStationary
 		agg_stats.IsIid += r.IsIid
 	}
-	agg_stats.Avg_lat /= C.uint64_t(len(replies))
-	agg_stats.P50_i /= C.uint64_t(len(replies))
-	agg_stats.P50 /= C.uint64_t(len(replies))
-	agg_stats.P50_k /= C.uint64_t(len(replies))
-	agg_stats.P90_i /= C.uint64_t(len(replies))
-	agg_stats.P90 /= C.uint64_t(len(replies))
-	agg_stats.P90_k /= C.uint64_t(len(replies))
-	agg_stats.P95_i /= C.uint64_t(len(replies))
-	agg_stats.P95 /= C.uint64_t(len(replies))
-	agg_stats.P95_k /= C.uint64_t(len(replies))
-	agg_stats.P99_i /= C.uint64_t(len(replies))
-	agg_stats.P99 /= C.uint64_t(len(replies))
-	agg_stats.P99_k /= C.uint64_t(len(replies))
-	agg_stats.P999_i /= C.uint64_t(len(replies))
-	agg_stats.P999 /= C.uint64_t(len(replies))
-	agg_stats.P999_k /= C.uint64_t(len(replies))
-	agg_stats.P9999_i /= C.uint64_t(len(replies))
-	agg_stats.P9999 /= C.uint64_t(len(replies))
-	agg_stats.P9999_k /= C.uint64_t(len(replies))
-	agg_stats.P99999_i /= C.uint64_t(len(replies))
-	agg_stats.P99999 /= C.uint64_t(len(replies))
-	agg_stats.P99999_k /= C.uint64_t(len(replies))
-	agg_stats.P999999_i /= C.uint64_t(len(replies))
-	agg_stats.P999999 /= C.uint64_t(len(replies))
-	agg_stats.P999999_k /= C.uint64_t(len(replies))
+
+	h := mergeLatHists(hists)
+	if h.count > 0 {
+		agg_stats.Avg_lat = C.uint64_t(h.sumNs / h.count)
+	}
+	agg_stats.P50_i, agg_stats.P50, agg_stats.P50_k = h.percentile(0.5)
+	agg_stats.P90_i, agg_stats.P90, agg_stats.P90_k = h.percentile(0.9)
+	agg_stats.P95_i, agg_stats.P95, agg_stats.P95_k = h.percentile(0.95)
+	agg_stats.P99_i, agg_stats.P99, agg_stats.P99_k = h.percentile(0.99)
+	agg_stats.P999_i, agg_stats.P999, agg_stats.P999_k = h.percentile(0.999)
+	agg_stats.P9999_i, agg_stats.P9999, agg_stats.P9999_k = h.percentile(0.9999)
+	agg_stats.P99999_i, agg_stats.P99999, agg_stats.P99999_k = h.percentile(0.99999)
+	agg_stats.P999999_i, agg_stats.P999999, agg_stats.P999999_k = h.percentile(0.999999)
+	if h.intendedCount > 0 {
+		agg_stats.Intended_avg = C.uint64_t(h.intendedSumNs / h.intendedCount)
+	}
+	agg_stats.Intended_P50 = h.intendedPercentile(0.5)
+	agg_stats.Intended_P90 = h.intendedPercentile(0.9)
+	agg_stats.Intended_P99 = h.intendedPercentile(0.99)
+	agg_stats.Intended_P999 = h.intendedPercentile(0.999)
+	agg_stats.Intended_P9999 = h.intendedPercentile(0.9999)
 
 	if agg_stats.IsIid == 0 {
 		agg_stats.ToReduceSampling = 1000000
@@ -119,6 +450,108 @@ func printThroughputStats(stats *C.struct_throughput_reply) {
 		1e6*float64(stats.Req_count)/float64(stats.Duration),
 		1e6*float64(stats.Rx_bytes)/float64(stats.Duration),
 		1e6*float64(stats.Tx_bytes)/float64(stats.Duration))
+	printBacklogStats(stats)
+	printChurnStats(stats)
+	printShardStats(stats)
+	printOpTxStats(stats)
+	if stats.Pool_exhausted > 0 {
+		fmt.Printf("#R2P2 contexts allocated past the pool: %v\n",
+			stats.Pool_exhausted)
+	}
+}
+
+// Shards are numbered in the order of targetHost
+func printShardStats(stats *C.struct_throughput_reply) {
+	var total C.uint64_t
+	last := -1
+	for i := range stats.Shard_tx {
+		total += stats.Shard_tx[i]
+		if stats.Shard_tx[i] > 0 || stats.Shard_rx[i] > 0 {
+			last = i
+		}
+	}
+	if last < 0 {
+		return
+	}
+	fmt.Println("#Shard\tTxQPS\tRxQPS\tShare(%)")
+	for i := 0; i <= last; i++ {
+		fmt.Printf("%v\t%v\t%v\t%v\n", i,
+			1e6*float64(stats.Shard_tx[i])/float64(stats.Duration),
+			1e6*float64(stats.Shard_rx[i])/float64(stats.Duration),
+			100*float64(stats.Shard_tx[i])/float64(total))
+	}
+}
+
+// Only for the protocols that tag their requests with an operation class
+func printOpTxStats(stats *C.struct_throughput_reply) {
+	var total, tagged C.uint64_t
+	for i := range stats.Op_tx {
+		total += stats.Op_tx[i]
+		if i > 0 {
+			tagged += stats.Op_tx[i]
+		}
+	}
+	if tagged == 0 {
+		return
+	}
+	fmt.Println("#Op\tTxQPS\tShare(%)")
+	for i := range stats.Op_tx {
+		if stats.Op_tx[i] == 0 {
+			continue
+		}
+		fmt.Printf("%v\t%v\t%v\n", opClassName(i),
+			1e6*float64(stats.Op_tx[i])/float64(stats.Duration),
+			100*float64(stats.Op_tx[i])/float64(total))
+	}
+}
+
+// Latency of every operation class, from the merged histograms of the agents
+func printOpLatencyStats(hists []*latHist, duration C.uint64_t) {
+	h := mergeLatHists(hists)
+	var tagged uint64
+	for c, o := range h.ops {
+		if c > 0 {
+			tagged += o.count
+		}
+	}
+	if tagged == 0 {
+		return
+	}
+	fmt.Println("#Op\tQPS\tAvg Lat\t50th\t99th\t99.9th")
+	for c, o := range h.ops {
+		if o.count == 0 {
+			continue
+		}
+		fmt.Printf("%v\t%v\t%v\t%v\t%v\t%v\n", opClassName(c),
+			1e6*float64(o.count)/float64(duration),
+			float64(o.sumNs/o.count)/1e3,
+			float64(histPercentile(o.buckets, o.count, h.subBits, 0.5))/1e3,
+			float64(histPercentile(o.buckets, o.count, h.subBits, 0.99))/1e3,
+			float64(histPercentile(o.buckets, o.count, h.subBits, 0.999))/1e3)
+	}
+}
+
+func printChurnStats(stats *C.struct_throughput_reply) {
+	if stats.Conn_opened == 0 {
+		return
+	}
+	fmt.Println("#Churn Conn/s\tResumed\tConnect50th(us)\t99th\tHandshake50th(us)\t99th")
+	fmt.Printf("%v\t%v\t%v\t%v\t%v\t%v\n",
+		1e6*float64(stats.Conn_opened)/float64(stats.Duration),
+		stats.Conn_resumed,
+		float64(stats.Connect_P50)/1e3, float64(stats.Connect_P99)/1e3,
+		float64(stats.Handshake_P50)/1e3, float64(stats.Handshake_P99)/1e3)
+}
+
+func printBacklogStats(stats *C.struct_throughput_reply) {
+	var avgWait float64
+	if stats.Backlog_reqs > 0 {
+		avgWait = float64(stats.Backlog_wait) / float64(stats.Backlog_reqs) / 1e3
+	}
+	fmt.Println("#Backlog AvgWait(us)\tMaxWait(us)\tMaxDepth\tDropped")
+	fmt.Printf("%v\t%v\t%v\t%v\n", avgWait,
+		float64(stats.Backlog_max_wait)/1e3, stats.Backlog_max_depth,
+		stats.Backlog_dropped)
 }
 
 func printLatencyStats(stats *C.struct_latency_reply) {
@@ -133,6 +566,14 @@ func printLatencyStats(stats *C.struct_latency_reply) {
 		float64(stats.P9999)/1e3, float64(stats.P9999_i)/1e3, float64(stats.P9999_k)/1e3,
 		float64(stats.P99999)/1e3, float64(stats.P99999_i)/1e3, float64(stats.P99999_k)/1e3,
 		float64(stats.P999999)/1e3, float64(stats.P999999_i)/1e3, float64(stats.P999999_k)/1e3)
+	if stats.Intended_P50 == 0 {
+		return
+	}
+	fmt.Println("#Intended Avg Lat\t50th\t90th\t99th\t99.9th\t99.99th")
+	fmt.Printf("%v\t%v\t%v\t%v\t%v\t%v\n",
+		float64(stats.Intended_avg)/1e3, float64(stats.Intended_P50)/1e3,
+		float64(stats.Intended_P90)/1e3, float64(stats.Intended_P99)/1e3,
+		float64(stats.Intended_P999)/1e3, float64(stats.Intended_P9999)/1e3)
 }
 
 func getRPS(stats *C.struct_throughput_reply) float64 {
@@ -29,8 +29,6 @@
 #include <lancet/app_proto.h>
 #include <lancet/rand_gen.h>
 
-#define MAX_THREADS 16
-
 struct host_tuple {
 	uint32_t ip;
 	uint16_t port;
@@ -49,12 +47,22 @@ enum transport_protocol_type {
 	R2P2,
 	UDP,
 	TLS,
+	URING,
+	XDP,
+	UNIX,
+	UNIXPACKET,
 };
 
+#define UNIX_PATH_LEN 108 // sizeof(sun_path) of struct sockaddr_un
+#define IA_RING_SIZE 64 // power of 2
+#define IA_BATCH 32
+#define LOAD_PARK_NS 100000000 // idle threads recheck should_load every 100ms
+
 struct agent_config {
 	int thread_count;
 	int conn_count;
 	struct host_tuple targets[8192];
+	char unix_paths[64][UNIX_PATH_LEN];
 	int target_count;
 	enum agent_type atype;
 	enum transport_protocol_type tp_type;
@@ -63,6 +71,18 @@ struct agent_config {
 	struct application_protocol *app_proto;
 	char if_name[64];
 	int per_conn_reqs;
+	int udp_batch;
+	int conn_wave;
+	int intended_latency;
+	char cpu_list[256];
+	int numa_node;
+	int zerocopy;
+	int ktls;
+	int churn_reqs;
+	int tls_resume;
+	int shard_policy;
+	long pacing_spin_ns; // sleep before the last pacing_spin_ns, 0 spins
+	long stats_window_ns;
 };
 
 struct __attribute__((packed)) agent_control_block {
@@ -73,7 +93,8 @@ struct __attribute__((packed)) agent_control_block {
 	int agent_type;
 	uint32_t per_thread_samples;
 	double sampling;
-	int conn_open;
+	int conn_open; // connections established so far
+	int conn_total;
 };
 
 int should_load(void);
@@ -84,15 +105,26 @@ int get_thread_count(void);
 int get_target_count(void);
 struct application_protocol * get_app_proto(void);
 struct host_tuple *get_targets(void);
+char *get_unix_path(int idx);
 long get_ia(void);
+void pace_wait(long next_tx);
 enum agent_type get_agent_type(void);
 int get_agent_tid(void);
 uint32_t get_per_thread_samples(void);
 double get_sampling_rate(void);
 char *get_if_name(void);
 int get_max_pending_reqs(void);
-void set_conn_open(int val);
+int get_udp_batch(void);
+int get_conn_wave(void);
+int get_intended_latency(void);
+int get_zerocopy(void);
+int get_ktls(void);
+int get_churn_reqs(void);
+int get_tls_resume(void);
+long get_stats_window_ns(void);
+void add_conn_open(int count);
 struct request *prepare_request(void);
+struct request *peek_request(void);
 struct byte_req_pair process_response(char *buf, int size);
 
 extern pthread_barrier_t conn_open_barrier;
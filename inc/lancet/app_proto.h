@@ -42,6 +42,7 @@ extern __thread void *per_thread_arg;
 #define MAX_IOVS 64
 struct request {
 	void *meta;
+	int op_class; // enum op_class
 	int iov_cnt;
 	struct iovec iovs[MAX_IOVS];
 };
@@ -70,6 +71,7 @@ struct application_protocol *init_app_proto(char *proto);
 static inline int create_request(struct application_protocol *proto,
 								 struct request *req)
 {
+	req->op_class = OP_OTHER;
 	return proto->create_request(proto, req);
 };
 
@@ -84,6 +86,7 @@ struct kv_info {
 	struct rand_gen *val_len;
 	struct rand_gen *key_sel;
 	double get_ratio;
+	int route_keys; // leave the key in req->meta for key routing
 };
 
 static inline int kv_get_key_count(struct application_protocol *proto)
@@ -0,0 +1,54 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * Per-thread scheduler of the connections (or sockets) with spare pipeline
+ * slots. Connections are handed out round robin among the ones that can
+ * take a request, in O(1).
+ * With shards, connection idx belongs to shard idx % shard_count and every
+ * shard has a queue of its own.
+ */
+#pragma once
+
+#include <stdint.h>
+
+struct conn_sched {
+	uint32_t *queue; // connections with spare slots, each at most once
+	uint32_t *head; // per shard
+	uint32_t *tail;
+	uint32_t size; // of the queue of a shard, a power of two
+	uint32_t shard_count;
+	uint16_t *spare;
+	uint8_t *flags;
+};
+
+int conn_sched_init(struct conn_sched *s, int count, int depth);
+int conn_sched_init_shards(struct conn_sched *s, int count, int depth,
+						   int shard_count);
+int conn_sched_get(struct conn_sched *s);
+int conn_sched_get_shard(struct conn_sched *s, int shard);
+void conn_sched_put(struct conn_sched *s, int idx, int slots);
+void conn_sched_pause(struct conn_sched *s, int idx);
+void conn_sched_resume(struct conn_sched *s, int idx);
+void conn_sched_close(struct conn_sched *s, int idx);
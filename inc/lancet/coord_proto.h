@@ -44,6 +44,7 @@ enum {
 enum {
 	REPORT_THROUGHPUT = 0,
 	REPORT_LATENCY,
+	REPORT_WINDOWS,
 };
 
 /*
@@ -56,6 +57,10 @@ enum {
 	REPLY_CONVERGENCE,
 	REPLY_IA_COMP,
 	REPLY_IID,
+	REPLY_LAT_HIST,
+	REPLY_WINDOWS,
+	REPLY_OP_HISTS,
+	REPLY_CONN_HIST,
 	// REPLY_KV_STATS etc...
 };
 
@@ -82,6 +87,21 @@ struct __attribute__((__packed__)) throughput_reply {
 	uint64_t Req_count;
 	uint64_t Duration;
 	uint64_t CorrectIAD; // to avoid padding
+	uint64_t Backlog_reqs;
+	uint64_t Backlog_wait; // total ns spent in the open-loop backlog
+	uint64_t Backlog_max_wait;
+	uint64_t Backlog_max_depth;
+	uint64_t Backlog_dropped;
+	uint64_t Conn_opened; // connections reopened by churn
+	uint64_t Conn_resumed;
+	uint64_t Connect_P50; // of this agent, see conn_hist_reply
+	uint64_t Connect_P99;
+	uint64_t Handshake_P50;
+	uint64_t Handshake_P99;
+	uint64_t Pool_exhausted; // R2P2 contexts allocated past the pool
+	uint64_t Shard_tx[64]; // requests per target with key routing, MAX_SHARDS
+	uint64_t Shard_rx[64];
+	uint64_t Op_tx[4]; // requests per operation class, OP_CLASSES
 };
 
 struct __attribute__((__packed__)) latency_reply {
@@ -114,4 +134,91 @@ struct __attribute__((__packed__)) latency_reply {
 	uint32_t ToReduceSampling;
 	uint8_t IsIid;
 	uint8_t IsStationary;
+	uint8_t Pad[2]; // cgo drops unaligned fields
+	/* Latency from the intended send time, 0 unless agents run with -d */
+	uint64_t Intended_avg;
+	uint64_t Intended_P50;
+	uint64_t Intended_P90;
+	uint64_t Intended_P99;
+	uint64_t Intended_P999;
+	uint64_t Intended_P9999;
+};
+
+/*
+ * Sent after every latency_reply: the latency histograms of the agent, so
+ * that the coordinator can merge them instead of averaging percentiles.
+ * Followed by Entries lat_hist_entry for the latency and Intended_entries
+ * for the latency from the intended send time, only the non-empty buckets.
+ */
+struct __attribute__((__packed__)) lat_hist_reply {
+	uint64_t Samples; // iid samples behind the confidence intervals
+	uint64_t Count;
+	uint64_t Sum_ns;
+	uint64_t Intended_count;
+	uint64_t Intended_sum_ns;
+	uint32_t Sub_bits; // log-linear buckets per power of two, LAT_HIST_SUB_BITS
+	uint32_t Entries;
+	uint32_t Intended_entries;
+	uint32_t Pad;
+};
+
+struct __attribute__((__packed__)) lat_hist_entry {
+	uint64_t Bucket;
+	uint64_t Count;
+};
+
+/*
+ * Sent after every throughput_reply and latency_reply: the connect and TLS
+ * handshake histograms of the reopened connections of the agent, so that
+ * the coordinator can merge them. Followed by Entries lat_hist_entry for the
+ * connect times and Handshake_entries for the handshakes, only the non-empty
+ * buckets.
+ */
+struct __attribute__((__packed__)) conn_hist_reply {
+	uint32_t Sub_bits; // CONN_HIST_SUB_BITS
+	uint32_t Entries;
+	uint32_t Handshake_entries;
+	uint32_t Pad;
+};
+
+/*
+ * Sent after the lat_hist_reply: the latency histogram of every operation
+ * class, in enum op_class order. Each op_hist_entry is followed by its
+ * Entries lat_hist_entry, with Sub_bits buckets per power of two.
+ */
+struct __attribute__((__packed__)) op_hists_reply {
+	uint32_t Classes; // OP_CLASSES
+	uint32_t Sub_bits; // LAT_HIST_SUB_BITS
+};
+
+struct __attribute__((__packed__)) op_hist_entry {
+	uint64_t Count;
+	uint64_t Sum_ns;
+	uint32_t Entries;
+	uint32_t Pad;
+};
+
+/*
+ * Reply to REPORT_WINDOWS, does not stop measuring: the stats windows that
+ * ended since the previous report, added up over the agent threads. Each
+ * window_entry is followed by its Entries lat_hist_entry, with Sub_bits
+ * buckets per power of two.
+ */
+struct __attribute__((__packed__)) windows_reply {
+	uint64_t Window_ns;
+	uint64_t Until_ns; // wall-clock end of the last window reported on
+	uint32_t Sub_bits; // WINDOW_HIST_SUB_BITS
+	uint32_t Count;
+};
+
+struct __attribute__((__packed__)) window_entry {
+	uint64_t Start_ns; // wall clock
+	uint64_t Rx_bytes;
+	uint64_t Rx_reqs;
+	uint64_t Tx_bytes;
+	uint64_t Tx_reqs;
+	uint64_t Lat_count;
+	uint64_t Lat_sum_ns;
+	uint32_t Entries;
+	uint32_t Pad;
 };
@@ -24,7 +24,29 @@
  */
 #pragma once
 
+#include <assert.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * With an invariant TSC, time_init calibrates it against CLOCK_MONOTONIC and
+ * the software timestamps are base_ns + (tsc - base_tsc) * mult / 2^32.
+ * Otherwise they come from clock_gettime.
+ */
+struct tsc_clock {
+	uint64_t base_tsc;
+	int64_t base_ns;
+	uint64_t mult; // ns per cycle, 32.32 fixed point
+	int enabled;
+};
+extern struct tsc_clock tsc_clock;
+
+void time_init(void);
 
 static inline long time_us(void)
 {
@@ -33,23 +55,55 @@ static inline long time_us(void)
 	return (long)tv.tv_sec * 1000000 + (long)tv.tv_usec;
 }
 
+static inline unsigned long rdtsc(void)
+{
+	unsigned int a, d;
+	asm volatile("rdtsc" : "=a"(a), "=d"(d));
+	return ((unsigned long)a) | (((unsigned long)d) << 32);
+}
+
+#ifdef __x86_64__
+/* Not executed ahead of the preceding instructions, like the vDSO read */
+static inline int64_t tsc_time_ns(void)
+{
+	int64_t cycles;
+
+	asm volatile("lfence" ::: "memory");
+	cycles = rdtsc() - tsc_clock.base_tsc;
+	return tsc_clock.base_ns + (int64_t)(((__int128)cycles * tsc_clock.mult) >> 32);
+}
+#endif
+
 static inline int64_t time_ns()
 {
 	struct timespec ts;
+#ifdef __x86_64__
+	if (tsc_clock.enabled)
+		return tsc_time_ns();
+#endif
 	int r = clock_gettime(CLOCK_MONOTONIC, &ts);
 	assert(r == 0);
 	return (ts.tv_nsec + ts.tv_sec * 1e9);
 }
 
+static inline void ns_to_ts(long ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
 static inline void time_ns_to_ts(struct timespec *ts)
 {
+#ifdef __x86_64__
+	if (tsc_clock.enabled) {
+		ns_to_ts(tsc_time_ns(), ts);
+		return;
+	}
+#endif
 	int r = clock_gettime(CLOCK_MONOTONIC, ts);
 	assert(r == 0);
 }
 
-static inline unsigned long rdtsc(void)
-{
-	unsigned int a, d;
-	asm volatile("rdtsc" : "=a"(a), "=d"(d));
-	return ((unsigned long)a) | (((unsigned long)d) << 32);
-}
+#ifdef __cplusplus
+};
+#endif
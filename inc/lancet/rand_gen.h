@@ -93,6 +93,8 @@ struct __attribute__((packed)) rand_gen {
 	/* Set only if the random + inv_cdf pattern is not followed */
 	double (*generate)(struct rand_gen *generator);
 	union rand_params params;
+	/* Bumped by set_avg_ext, so that cached samples can be dropped */
+	uint32_t version;
 };
 
 /* Initialise random generator */
@@ -109,6 +111,9 @@ static inline void set_avg(struct rand_gen *gen, double avg)
 	return gen->set_avg(gen, avg);
 }
 
+/* Fill out with count random numbers */
+void generate_batch(struct rand_gen *gen, double *out, int count);
+
 /* Generate a random number */
 static inline double generate(struct rand_gen *generator)
 {
@@ -0,0 +1,70 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2019-2021 Ecole Polytechnique Federale Lausanne (EPFL)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+/*
+ * Key routing: KV requests go to the target that owns their key, like a
+ * sharding client would send them. The shard of every key is computed at
+ * startup and create_request leaves the key in req->meta for the transport.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <lancet/agent.h>
+#include <lancet/app_proto.h>
+#include <lancet/conn_sched.h>
+
+enum shard_policy {
+	SHARD_NONE = 0,
+	SHARD_KETAMA, // memcached consistent hashing
+	SHARD_SLOTS,  // Redis cluster CRC16 slots, split evenly among the targets
+};
+
+extern int shard_count; // 0 without key routing
+extern struct iovec *shard_keys;
+extern uint8_t *key_shard;
+
+int shard_init(struct agent_config *cfg);
+
+static inline int request_shard(struct request *req)
+{
+	return key_shard[(struct iovec *)req->meta - shard_keys];
+}
+
+static inline int shard_sched_init(struct conn_sched *s, int count, int depth)
+{
+	return conn_sched_init_shards(s, count, depth,
+								  shard_count ? shard_count : 1);
+}
+
+/*
+ * Connection for the next request, on the shard of its key with key routing
+ */
+static inline int shard_sched_get(struct conn_sched *s)
+{
+	if (!shard_count)
+		return conn_sched_get(s);
+	return conn_sched_get_shard(s, request_shard(peek_request()));
+}
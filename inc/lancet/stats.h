@@ -31,31 +31,152 @@
 
 #define MAX_PER_THREAD_SAMPLES 131072
 #define MAX_PER_THREAD_TX_SAMPLES 4096
+/* 8 log-linear buckets per power of two ns, see conn_hist_bucket */
+#define CONN_HIST_SUB_BITS 3
+#define CONN_HIST_BUCKETS (64 << CONN_HIST_SUB_BITS)
+/* 128 buckets per power of two, values within 1/256 of the bucket middle */
+#define LAT_HIST_SUB_BITS 7
+#define LAT_HIST_BUCKETS (64 << LAT_HIST_SUB_BITS)
+#define MAX_SHARDS 64
+/* Coarser histograms for the windows, like the connection histograms */
+#define WINDOW_HIST_SUB_BITS 3
+#define WINDOW_HIST_BUCKETS (64 << WINDOW_HIST_SUB_BITS)
+#define STATS_WINDOWS 256
+#define STATS_WINDOW_NS 100000000 // default window length, -l
+/* Bump on every change of the layout of the stats in shared memory */
+#define STATS_VERSION 3
+#define CACHE_LINE 64
+#define __cacheline_aligned __attribute__((aligned(CACHE_LINE)))
+
+/*
+ * Kind of operation of a request, set by create_request, so that the mix of
+ * a KV workload can be broken down
+ */
+enum op_class {
+	OP_OTHER = 0, // protocols without operations
+	OP_READ,
+	OP_WRITE,
+	OP_SCAN,
+	OP_CLASSES,
+};
 
 struct byte_req_pair {
 	uint64_t bytes;
 	uint64_t reqs;
 };
 
-struct __attribute__((packed)) tx_samples {
-	uint32_t count;
-	struct timespec samples[MAX_PER_THREAD_SAMPLES];
+struct tx_samples {
+	uint32_t count __cacheline_aligned;
+	struct timespec samples[MAX_PER_THREAD_SAMPLES] __cacheline_aligned;
 };
 
-struct __attribute__((packed)) throughput_stats {
-	struct byte_req_pair rx;
+struct backlog_stats {
+	uint64_t reqs;        // requests sent out of the backlog
+	uint64_t wait_ns;     // total time spent waiting for a connection
+	uint64_t max_wait_ns;
+	uint64_t max_depth;
+	uint64_t dropped;     // arrivals lost because the backlog was full
+};
+
+/*
+ * Connections reopened by churn, with the TCP connect and the TLS handshake
+ * times in histograms of their own.
+ */
+struct conn_stats {
+	uint64_t opened;
+	uint64_t resumed; // TLS handshakes that resumed the previous session
+	uint64_t connect_hist[CONN_HIST_BUCKETS];
+	uint64_t handshake_hist[CONN_HIST_BUCKETS];
+};
+
+/*
+ * Requests sent to and replies received from each target with key routing
+ */
+struct shard_stats {
+	uint64_t tx_reqs[MAX_SHARDS];
+	uint64_t rx_reqs[MAX_SHARDS];
+};
+
+/*
+ * Requests sent per op class
+ */
+struct op_stats {
+	uint64_t tx_reqs[OP_CLASSES];
+};
+
+/*
+ * Start of the stats of every thread, checked by the manager before it
+ * maps the rest
+ */
+struct stats_header {
+	uint32_t version; // STATS_VERSION
+	uint32_t agent_type;
+	uint64_t tx_samples_off; // from the start of the stats
+	uint64_t windows_off;
+};
+
+/*
+ * The counters that change on every request get cache lines of their own,
+ * so that they do not share one with the fields the manager reads.
+ */
+struct throughput_stats {
+	struct stats_header hdr;
+	struct byte_req_pair rx __cacheline_aligned;
 	struct byte_req_pair tx;
+	struct backlog_stats backlog __cacheline_aligned;
+	struct conn_stats conn __cacheline_aligned;
+	uint64_t pool_exhausted __cacheline_aligned; // R2P2 contexts allocated past the pool
+	struct shard_stats shards __cacheline_aligned;
+	struct op_stats ops __cacheline_aligned;
 };
 
-struct __attribute__((packed)) lat_sample {
+struct lat_sample {
 	uint64_t nsec;
 	struct timespec tx; // used for iid-ness checks
+	uint64_t intended_nsec; // from the intended send time, 0 if not kept
+};
+
+/*
+ * Every measured latency, independently of the sampling rate, so that the
+ * histograms of threads and agents can be added up
+ */
+struct lat_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t buckets[LAT_HIST_BUCKETS];
 };
 
-struct __attribute__((packed)) latency_stats {
+struct latency_stats {
 	struct throughput_stats th_s;
-	uint32_t inc_idx; // increment idx
-	struct lat_sample samples[MAX_PER_THREAD_SAMPLES];
+	uint32_t inc_idx __cacheline_aligned; // increment idx
+	struct lat_sample samples[MAX_PER_THREAD_SAMPLES] __cacheline_aligned;
+	struct lat_hist hist __cacheline_aligned;
+	struct lat_hist intended_hist __cacheline_aligned; // only with -d
+	struct lat_hist op_hists[OP_CLASSES] __cacheline_aligned; // like hist
+};
+
+/*
+ * Traffic of a thread in one window of time. idx is the number of the
+ * window, its wall-clock start over the window length, and 0 while the
+ * thread resets the slot for a new window.
+ */
+struct stats_window {
+	uint64_t idx;
+	struct byte_req_pair rx;
+	struct byte_req_pair tx;
+	uint64_t lat_count;
+	uint64_t lat_sum_ns;
+	uint32_t lat_hist[WINDOW_HIST_BUCKETS];
+} __cacheline_aligned;
+
+/*
+ * The last STATS_WINDOWS windows of a thread, window idx in slot
+ * idx % STATS_WINDOWS. Unlike the other stats they count while loading,
+ * not only while measuring, so that the manager can read them at any time.
+ */
+struct stats_windows {
+	uint64_t window_ns;
+	struct stats_window windows[STATS_WINDOWS] __cacheline_aligned;
 };
 
 union stats {
@@ -67,7 +188,16 @@ int init_per_thread_stats(void);
 int add_throughput_tx_sample(struct byte_req_pair tx_p);
 int add_throughput_rx_sample(struct byte_req_pair rx_p);
 int add_tx_timestamp(struct timespec *tx_ts);
-int add_latency_sample(long diff, struct timespec *tx);
+int add_latency_sample(long diff, long sched_delay, struct timespec *tx,
+					   int op_class);
+int add_backlog_sample(long wait, uint32_t depth);
+int add_backlog_drop(void);
+int add_connect_sample(long connect);
+int add_handshake_sample(long handshake, int resumed);
+int add_pool_exhausted(void);
+int add_shard_tx_sample(int shard);
+int add_shard_rx_sample(int shard, uint64_t reqs);
+int add_op_tx_sample(int op_class);
 // void clear_stats(union stats *stats);
 // void compute_latency_percentiles(struct latency_stats *lt_s);
 // void compute_latency_percentiles_ci(struct latency_stats *lt_s);
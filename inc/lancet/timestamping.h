@@ -24,11 +24,15 @@
  */
 #pragma once
 
+#include <sys/socket.h>
+
 #include <lancet/tp_proto.h>
 
 struct timestamp_info {
 	struct timespec time;
 	uint32_t optid;
+	long sched_delay; // ns between the intended and the actual send
+	int op_class; // of the request, enum op_class
 };
 
 /*
@@ -48,10 +52,12 @@ int disable_nic_timestamping(char *if_name);
 int sock_enable_timestamping(int fd);
 ssize_t timestamp_recv(int sockfd, void *buf, size_t len, int flags,
 					   struct timestamp_info *last_rx_time);
+int extract_rx_timestamp(struct msghdr *hdr, struct timestamp_info *rx_time);
 int get_tx_timestamp(int sockfd, struct pending_tx_timestamps *tx_timestamps);
 int udp_get_tx_timestamp(int sockfd, struct timespec *tx_timestamp);
+int get_zerocopy_completions(int sockfd, int *copied);
 void add_pending_tx_timestamp(struct pending_tx_timestamps *tx_timestamps,
-							  uint32_t bytes);
+							  uint32_t bytes, long sched_delay, int op_class);
 struct timestamp_info *
 pop_pending_tx_timestamps(struct pending_tx_timestamps *tx_timestamps);
 int timespec_diff(struct timespec *res, struct timespec *a, struct timespec *b);
@@ -59,4 +65,5 @@ int timespec_diff(struct timespec *res, struct timespec *a, struct timespec *b);
  * Used only in userspace symmetric timestamping
  */
 void push_complete_tx_timestamp(struct pending_tx_timestamps *tx_timestamps,
-								struct timespec *to_add);
+								struct timespec *to_add, long sched_delay,
+								int op_class);
@@ -43,20 +43,39 @@ struct transport_protocol *init_r2p2(void);
 #endif
 struct transport_protocol *init_udp(void);
 struct transport_protocol *init_tls(void);
+struct transport_protocol *init_uring(void);
+struct transport_protocol *init_unix(int sock_type);
+#ifdef ENABLE_XDP
+struct transport_protocol *init_xdp(void);
+#endif
 
 /*
  * TCP specific
  */
-#define MAX_PAYLOAD 16384
+/*
+ * Received bytes live in buffer[buffer_start, buffer_end). The buffer comes
+ * from the per-thread buffer pool and is only held while a response is
+ * partially received.
+ * With churn, a connection takes churn_left more requests and is reopened
+ * once their replies are in. reopen_start is set while it connects.
+ */
 struct tcp_connection {
 	uint32_t fd;
 	uint16_t idx;
 	uint16_t closed;
 	uint16_t pending_reqs;
-	uint16_t buffer_idx;
-	char buffer[MAX_PAYLOAD];
+	char *buffer;
+	uint32_t buffer_start;
+	uint32_t buffer_end;
+	uint32_t buffer_size;
+	uint32_t churn_left;
+	long reopen_start;
 };
+char *tcp_rx_reserve(struct tcp_connection *conn, uint32_t *room);
 struct byte_req_pair handle_response(struct tcp_connection *conn);
+int tcp_open_sockets(int *fds, int count);
+int tcp_reopen(struct tcp_connection *conn, int efd);
+int tcp_reopen_complete(struct tcp_connection *conn, int efd);
 
 /*
  * UDP specific
@@ -67,13 +86,36 @@ struct udp_socket {
 	uint32_t taken;
 	struct timespec tx_timestamp;
 	struct timespec rx_timestamp;
+	long sched_delay; // ns between the intended and the actual send
+	int op_class; // of the request in flight
 	char buffer[UDP_MAX_PAYLOAD];
 };
 
 /*
  * TLS specific
  */
+/*
+ * After the handshake the SSL engine works on memory BIOs and the agent
+ * moves the records between them and the non-blocking socket. With kTLS the
+ * socket stays the read BIO of the engine. If the kernel also builds the
+ * records (KTLS_TX) requests are written as plaintext, otherwise they are
+ * still encrypted through the memory write BIO. Bytes that the socket did
+ * not take yet wait in tx_buf[0, tx_len).
+ */
+#define KTLS_TX 0x1
+#define KTLS_RX 0x2
+
 struct tls_connection {
 	struct tcp_connection conn;
 	SSL *ssl;
+	BIO *rbio;
+	BIO *wbio;
+	char *tx_buf;
+	uint32_t tx_len;
+	uint32_t tx_size;
+	uint32_t tx_armed; // EPOLLOUT is set while tx_len > 0
+	uint32_t ktls; // KTLS_TX | KTLS_RX, the directions the kernel handles
+	uint32_t handshaking; // non-blocking handshake of a reopened connection
+	long handshake_start;
+	SSL_SESSION *session; // offered again on reopen, with -x
 };